@@ -542,6 +542,7 @@ pub enum PagestreamFeMessage {
     Nblocks(PagestreamNblocksRequest),
     GetPage(PagestreamGetPageRequest),
     DbSize(PagestreamDbSizeRequest),
+    GetPageV(PagestreamGetPageVRequest),
 }
 
 // Wrapped in libpq CopyData
@@ -551,6 +552,7 @@ pub enum PagestreamBeMessage {
     GetPage(PagestreamGetPageResponse),
     Error(PagestreamErrorResponse),
     DbSize(PagestreamDbSizeResponse),
+    GetPageV(PagestreamGetPageVResponse),
 }
 
 #[derive(Debug, PartialEq, Eq)]
@@ -575,6 +577,15 @@ pub struct PagestreamGetPageRequest {
     pub blkno: u32,
 }
 
+#[derive(Debug, PartialEq, Eq)]
+pub struct PagestreamGetPageVRequest {
+    pub latest: bool,
+    pub lsn: Lsn,
+    pub rel: RelTag,
+    pub blkno: u32,
+    pub nblocks: u32,
+}
+
 #[derive(Debug, PartialEq, Eq)]
 pub struct PagestreamDbSizeRequest {
     pub latest: bool,
@@ -597,6 +608,11 @@ pub struct PagestreamGetPageResponse {
     pub page: Bytes,
 }
 
+#[derive(Debug)]
+pub struct PagestreamGetPageVResponse {
+    pub pages: Vec<Bytes>,
+}
+
 #[derive(Debug)]
 pub struct PagestreamErrorResponse {
     pub message: String,
@@ -649,6 +665,18 @@ impl PagestreamFeMessage {
                 bytes.put_u64(req.lsn.0);
                 bytes.put_u32(req.dbnode);
             }
+
+            Self::GetPageV(req) => {
+                bytes.put_u8(4);
+                bytes.put_u8(u8::from(req.latest));
+                bytes.put_u64(req.lsn.0);
+                bytes.put_u32(req.rel.spcnode);
+                bytes.put_u32(req.rel.dbnode);
+                bytes.put_u32(req.rel.relnode);
+                bytes.put_u8(req.rel.forknum);
+                bytes.put_u32(req.blkno);
+                bytes.put_u32(req.nblocks);
+            }
         }
 
         bytes.into()
@@ -699,13 +727,64 @@ impl PagestreamFeMessage {
                 lsn: Lsn::from(body.read_u64::<BigEndian>()?),
                 dbnode: body.read_u32::<BigEndian>()?,
             })),
+            4 => Ok(PagestreamFeMessage::GetPageV(PagestreamGetPageVRequest {
+                latest: body.read_u8()? != 0,
+                lsn: Lsn::from(body.read_u64::<BigEndian>()?),
+                rel: RelTag {
+                    spcnode: body.read_u32::<BigEndian>()?,
+                    dbnode: body.read_u32::<BigEndian>()?,
+                    relnode: body.read_u32::<BigEndian>()?,
+                    forknum: body.read_u8()?,
+                },
+                blkno: body.read_u32::<BigEndian>()?,
+                nblocks: body.read_u32::<BigEndian>()?,
+            })),
             _ => bail!("unknown smgr message tag: {:?}", msg_tag),
         }
     }
 }
 
+/// How page payloads in GetPage(V) responses are encoded on the wire.
+/// Negotiated per connection via the `compress=` option of the `pagestream`
+/// command; see `serialize_with`.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum PagestreamCompression {
+    None,
+    Zlib,
+}
+
+/// Append a page payload to a response being serialized: a u32 compressed
+/// length followed by the zlib stream, with length 0 marking an
+/// incompressible payload stored raw.
+fn put_compressed_pages(bytes: &mut BytesMut, pages: &[&[u8]]) {
+    use flate2::write::ZlibEncoder;
+    use flate2::Compression;
+    use std::io::Write;
+
+    let raw_len: usize = pages.iter().map(|p| p.len()).sum();
+    let mut encoder = ZlibEncoder::new(Vec::with_capacity(raw_len / 2), Compression::fast());
+    for page in pages {
+        encoder.write_all(page).expect("in-memory write cannot fail");
+    }
+    let compressed = encoder.finish().expect("in-memory write cannot fail");
+
+    if compressed.len() < raw_len {
+        bytes.put_u32(compressed.len() as u32);
+        bytes.put(&compressed[..]);
+    } else {
+        bytes.put_u32(0);
+        for page in pages {
+            bytes.put(*page);
+        }
+    }
+}
+
 impl PagestreamBeMessage {
     pub fn serialize(&self) -> Bytes {
+        self.serialize_with(PagestreamCompression::None)
+    }
+
+    pub fn serialize_with(&self, compression: PagestreamCompression) -> Bytes {
         let mut bytes = BytesMut::new();
 
         match self {
@@ -721,7 +800,12 @@ impl PagestreamBeMessage {
 
             Self::GetPage(resp) => {
                 bytes.put_u8(102); /* tag from pagestore_client.h */
-                bytes.put(&resp.page[..]);
+                match compression {
+                    PagestreamCompression::None => bytes.put(&resp.page[..]),
+                    PagestreamCompression::Zlib => {
+                        put_compressed_pages(&mut bytes, &[&resp.page[..]])
+                    }
+                }
             }
 
             Self::Error(resp) => {
@@ -733,6 +817,22 @@ impl PagestreamBeMessage {
                 bytes.put_u8(104); /* tag from pagestore_client.h */
                 bytes.put_i64(resp.db_size);
             }
+
+            Self::GetPageV(resp) => {
+                bytes.put_u8(105); /* tag from pagestore_client.h */
+                bytes.put_u32(resp.pages.len() as u32);
+                match compression {
+                    PagestreamCompression::None => {
+                        for page in &resp.pages {
+                            bytes.put(&page[..]);
+                        }
+                    }
+                    PagestreamCompression::Zlib => {
+                        let pages = resp.pages.iter().map(|p| &p[..]).collect::<Vec<_>>();
+                        put_compressed_pages(&mut bytes, &pages);
+                    }
+                }
+            }
         }
 
         bytes.into()
@@ -786,6 +886,18 @@ mod tests {
                 lsn: Lsn(4),
                 dbnode: 7,
             }),
+            PagestreamFeMessage::GetPageV(PagestreamGetPageVRequest {
+                latest: true,
+                lsn: Lsn(4),
+                rel: RelTag {
+                    forknum: 1,
+                    spcnode: 2,
+                    dbnode: 3,
+                    relnode: 4,
+                },
+                blkno: 7,
+                nblocks: 32,
+            }),
         ];
         for msg in messages {
             let bytes = msg.serialize();
@@ -794,6 +906,30 @@ mod tests {
         }
     }
 
+    #[test]
+    fn test_pagestream_compressed_response() {
+        use flate2::read::ZlibDecoder;
+        use std::io::Read;
+
+        // a compressible page: the payload must come out as [tag][u32 len][zlib]
+        let page = Bytes::from(vec![42u8; 8192]);
+        let msg = PagestreamBeMessage::GetPage(PagestreamGetPageResponse { page: page.clone() });
+        let bytes = msg.serialize_with(PagestreamCompression::Zlib);
+
+        let mut buf = bytes.reader();
+        let mut hdr = [0u8; 5];
+        buf.read_exact(&mut hdr).unwrap();
+        assert_eq!(hdr[0], 102);
+        let clen = u32::from_be_bytes(hdr[1..5].try_into().unwrap()) as usize;
+        assert!(clen > 0 && clen < page.len());
+
+        let mut decompressed = Vec::new();
+        ZlibDecoder::new(buf.take(clen as u64))
+            .read_to_end(&mut decompressed)
+            .unwrap();
+        assert_eq!(decompressed, page);
+    }
+
     #[test]
     fn test_tenantinfo_serde() {
         // Test serialization/deserialization of TenantInfo
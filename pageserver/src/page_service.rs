@@ -16,10 +16,11 @@ use bytes::Bytes;
 use futures::Stream;
 use pageserver_api::models::TenantState;
 use pageserver_api::models::{
-    PagestreamBeMessage, PagestreamDbSizeRequest, PagestreamDbSizeResponse,
+    PagestreamBeMessage, PagestreamCompression, PagestreamDbSizeRequest, PagestreamDbSizeResponse,
     PagestreamErrorResponse, PagestreamExistsRequest, PagestreamExistsResponse,
     PagestreamFeMessage, PagestreamGetPageRequest, PagestreamGetPageResponse,
-    PagestreamNblocksRequest, PagestreamNblocksResponse,
+    PagestreamGetPageVRequest, PagestreamGetPageVResponse, PagestreamNblocksRequest,
+    PagestreamNblocksResponse,
 };
 use postgres_backend::{self, is_expected_io_error, AuthType, PostgresBackend, QueryError};
 use pq_proto::framed::ConnectionError;
@@ -374,6 +375,7 @@ impl PageServerHandler {
         pgb: &mut PostgresBackend<IO>,
         tenant_id: TenantId,
         timeline_id: TimelineId,
+        compression: PagestreamCompression,
         ctx: RequestContext,
     ) -> Result<(), QueryError>
     where
@@ -463,6 +465,11 @@ impl PageServerHandler {
                     let _timer = metrics.get_db_size.start_timer();
                     self.handle_db_size_request(&timeline, &req, &ctx).await
                 }
+                PagestreamFeMessage::GetPageV(req) => {
+                    let _timer = metrics.get_page_at_lsn.start_timer();
+                    self.handle_get_page_v_at_lsn_request(&timeline, &req, &ctx)
+                        .await
+                }
             };
 
             let response = response.unwrap_or_else(|e| {
@@ -474,7 +481,7 @@ impl PageServerHandler {
                 })
             });
 
-            pgb.write_message_noflush(&BeMessage::CopyData(&response.serialize()))?;
+            pgb.write_message_noflush(&BeMessage::CopyData(&response.serialize_with(compression)))?;
             pgb.flush().await?;
         }
         Ok(())
@@ -748,6 +755,31 @@ impl PageServerHandler {
         }))
     }
 
+    #[instrument(skip(self, timeline, req, ctx), fields(rel = %req.rel, blkno = %req.blkno, nblocks = %req.nblocks, req_lsn = %req.lsn))]
+    async fn handle_get_page_v_at_lsn_request(
+        &self,
+        timeline: &Timeline,
+        req: &PagestreamGetPageVRequest,
+        ctx: &RequestContext,
+    ) -> anyhow::Result<PagestreamBeMessage> {
+        let latest_gc_cutoff_lsn = timeline.get_latest_gc_cutoff_lsn();
+        let lsn =
+            Self::wait_or_get_last_lsn(timeline, req.lsn, req.latest, &latest_gc_cutoff_lsn, ctx)
+                .await?;
+
+        let mut pages = Vec::with_capacity(req.nblocks as usize);
+        for blkno in req.blkno..req.blkno + req.nblocks {
+            let page = timeline
+                .get_rel_page_at_lsn(req.rel, blkno, lsn, req.latest, ctx)
+                .await?;
+            pages.push(page);
+        }
+
+        Ok(PagestreamBeMessage::GetPageV(PagestreamGetPageVResponse {
+            pages,
+        }))
+    }
+
     #[allow(clippy::too_many_arguments)]
     #[instrument(skip_all, fields(?lsn, ?prev_lsn, %full_backup))]
     async fn handle_basebackup_request<IO>(
@@ -923,7 +955,7 @@ where
         if query_string.starts_with("pagestream ") {
             let (_, params_raw) = query_string.split_at("pagestream ".len());
             let params = params_raw.split(' ').collect::<Vec<_>>();
-            if params.len() != 2 {
+            if !(2..=3).contains(&params.len()) {
                 return Err(QueryError::Other(anyhow::anyhow!(
                     "invalid param number for pagestream command"
                 )));
@@ -932,6 +964,15 @@ where
                 .with_context(|| format!("Failed to parse tenant id from {}", params[0]))?;
             let timeline_id = TimelineId::from_str(params[1])
                 .with_context(|| format!("Failed to parse timeline id from {}", params[1]))?;
+            let compression = match params.get(2) {
+                None => PagestreamCompression::None,
+                Some(&"compress=zlib") => PagestreamCompression::Zlib,
+                Some(other) => {
+                    return Err(QueryError::Other(anyhow::anyhow!(
+                        "invalid pagestream option {other}"
+                    )));
+                }
+            };
 
             tracing::Span::current()
                 .record("tenant_id", field::display(tenant_id))
@@ -939,7 +980,7 @@ where
 
             self.check_permission(Some(tenant_id))?;
 
-            self.handle_pagerequests(pgb, tenant_id, timeline_id, ctx)
+            self.handle_pagerequests(pgb, tenant_id, timeline_id, compression, ctx)
                 .await?;
         } else if query_string.starts_with("basebackup ") {
             let (_, params_raw) = query_string.split_at("basebackup ".len());
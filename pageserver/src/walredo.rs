@@ -748,7 +748,7 @@ impl PostgresRedoManager {
         records: &[(Lsn, NeonWalRecord)],
         wal_redo_timeout: Duration,
     ) -> Result<Bytes, std::io::Error> {
-        // Serialize all the messages to send the WAL redo process first.
+        // Serialize the whole request into a single batch message first.
         //
         // This could be problematic if there are millions of records to replay,
         // but in practice the number of records is usually so small that it doesn't
@@ -758,25 +758,7 @@ impl PostgresRedoManager {
         // by some other WAL records. Start with a buffer that can hold that
         // comfortably.
         let mut writebuf: Vec<u8> = Vec::with_capacity((BLCKSZ as usize) * 3);
-        build_begin_redo_for_block_msg(tag, &mut writebuf);
-        if let Some(img) = base_img {
-            build_push_page_msg(tag, img, &mut writebuf);
-        }
-        for (lsn, rec) in records.iter() {
-            if let NeonWalRecord::Postgres {
-                will_init: _,
-                rec: postgres_rec,
-            } = rec
-            {
-                build_apply_record_msg(*lsn, postgres_rec, &mut writebuf);
-            } else {
-                return Err(Error::new(
-                    ErrorKind::Other,
-                    "tried to pass neon wal record to postgres WAL redo",
-                ));
-            }
-        }
-        build_get_page_msg(tag, &mut writebuf);
+        build_apply_batch_msg(tag, base_img, records, &mut writebuf)?;
         WAL_REDO_RECORD_COUNTER.inc_by(records.len() as u64);
 
         let proc = input.as_mut().unwrap();
@@ -1087,48 +1069,56 @@ impl NoLeakChildCommandExt for Command {
     }
 }
 
-// Functions for constructing messages to send to the postgres WAL redo
-// process. See pgxn/neon_walredo/walredoproc.c for
+// Function for constructing the batch message to send to the postgres WAL
+// redo process. See pgxn/neon_walredo/walredoproc.c for
 // explanation of the protocol.
 
-fn build_begin_redo_for_block_msg(tag: BufferTag, buf: &mut Vec<u8>) {
-    let len = 4 + 1 + 4 * 4;
-
-    buf.put_u8(b'B');
-    buf.put_u32(len as u32);
+fn build_apply_batch_msg(
+    tag: BufferTag,
+    base_img: &Option<Bytes>,
+    records: &[(Lsn, NeonWalRecord)],
+    buf: &mut Vec<u8>,
+) -> Result<(), std::io::Error> {
+    buf.put_u8(b'R');
+    let len_offset = buf.len();
+    buf.put_u32(0); // message length, patched below
+    let payload_offset = buf.len();
 
     tag.ser_into(buf)
         .expect("serialize BufferTag should always succeed");
-}
-
-fn build_push_page_msg(tag: BufferTag, base_img: &[u8], buf: &mut Vec<u8>) {
-    assert!(base_img.len() == 8192);
-
-    let len = 4 + 1 + 4 * 4 + base_img.len();
-
-    buf.put_u8(b'P');
-    buf.put_u32(len as u32);
-    tag.ser_into(buf)
-        .expect("serialize BufferTag should always succeed");
-    buf.put(base_img);
-}
-
-fn build_apply_record_msg(endlsn: Lsn, rec: &[u8], buf: &mut Vec<u8>) {
-    let len = 4 + 8 + rec.len();
-
-    buf.put_u8(b'A');
-    buf.put_u32(len as u32);
-    buf.put_u64(endlsn.0);
-    buf.put(rec);
-}
-
-fn build_get_page_msg(tag: BufferTag, buf: &mut Vec<u8>) {
-    let len = 4 + 1 + 4 * 4;
+    buf.put_u8(base_img.is_some() as u8);
+    buf.put_u32(records.len() as u32);
+    if let Some(img) = base_img {
+        assert!(img.len() == 8192);
+        buf.put(&img[..]);
+    }
+    for (lsn, rec) in records.iter() {
+        if let NeonWalRecord::Postgres {
+            will_init: _,
+            rec: postgres_rec,
+        } = rec
+        {
+            // The redo process applies each record in place, so pad every
+            // entry to an 8-byte boundary within the payload; together with
+            // the 16-byte entry header this keeps the record itself aligned.
+            while (buf.len() - payload_offset) % 8 != 0 {
+                buf.put_u8(0);
+            }
+            buf.put_u32(postgres_rec.len() as u32);
+            buf.put_u32(0); // padding
+            buf.put_u64(lsn.0);
+            buf.put(&postgres_rec[..]);
+        } else {
+            return Err(Error::new(
+                ErrorKind::Other,
+                "tried to pass neon wal record to postgres WAL redo",
+            ));
+        }
+    }
 
-    buf.put_u8(b'G');
-    buf.put_u32(len as u32);
-    tag.ser_into(buf)
-        .expect("serialize BufferTag should always succeed");
+    let len = (4 + buf.len() - payload_offset) as u32;
+    buf[len_offset..len_offset + 4].copy_from_slice(&len.to_be_bytes());
+    Ok(())
 }
 
 #[cfg(test)]
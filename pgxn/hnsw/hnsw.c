@@ -2,15 +2,21 @@
 
 #include "access/amapi.h"
 #include "access/generic_xlog.h"
+#include "access/genam.h"
+#include "access/parallel.h"
 #include "access/relation.h"
 #include "access/reloptions.h"
+#include "access/table.h"
 #include "access/tableam.h"
 #include "catalog/index.h"
 #include "commands/vacuum.h"
+#include "miscadmin.h"
 #include "nodes/execnodes.h"
+#include "optimizer/planner.h"
 #include "storage/bufmgr.h"
 #include "utils/guc.h"
 #include "utils/selfuncs.h"
+#include "utils/snapmgr.h"
 
 #include <math.h>
 #include <float.h>
@@ -26,8 +32,16 @@ typedef struct {
 	int efConstruction;
 	int efSearch;
 	int M;
+	int quantization;	/* HnswQuantization */
 } HnswOptions;
 
+static relopt_enum_elt_def hnsw_quantization_values[] = {
+	{"none", HNSW_QUANT_NONE},
+	{"int8", HNSW_QUANT_INT8},
+	{"fp16", HNSW_QUANT_FP16},
+	{(const char *) NULL}		/* list terminator */
+};
+
 static relopt_kind hnsw_relopt_kind;
 
 typedef struct {
@@ -78,12 +92,19 @@ _PG_init(void)
 					  0, 0, INT_MAX, AccessExclusiveLock);
 	add_int_reloption(hnsw_relopt_kind, "maxelements", "Maximal number of elements",
 					  0, 0, INT_MAX, AccessExclusiveLock);
+	/*
+	 * The multi-layer math needs m >= 2: the upper-arena sizing divides by
+	 * m - 1, and the level multiplier is 1/ln(m).
+	 */
 	add_int_reloption(hnsw_relopt_kind, "m", "Number of neighbors of each vertex",
-					  100, 0, INT_MAX, AccessExclusiveLock);
+					  100, 2, INT_MAX, AccessExclusiveLock);
 	add_int_reloption(hnsw_relopt_kind, "efconstruction", "Number of inspected neighbors during index construction",
 					  16, 1, INT_MAX, AccessExclusiveLock);
 	add_int_reloption(hnsw_relopt_kind, "efsearch", "Number of inspected neighbors during index search",
 					  64, 1, INT_MAX, AccessExclusiveLock);
+	add_enum_reloption(hnsw_relopt_kind, "quantization", "Vector storage quantization (none, int8 or fp16)",
+					   hnsw_quantization_values, HNSW_QUANT_NONE,
+					   "Valid values are \"none\", \"int8\" and \"fp16\".", AccessExclusiveLock);
 	hnsw_indexes = hnsw_index_create(TopMemoryContext, INDEX_HASH_SIZE, NULL);
 }
 
@@ -113,13 +134,101 @@ hnsw_build_callback(Relation index, ItemPointer tid, Datum *values,
 	hnsw_add_point(hnsw, (coord_t*)ARR_DATA_PTR(array), label);
 }
 
+/*
+ * Parallel build support. The index lives in a DSM segment addressed by the
+ * index OID, so parallel workers can attach to it independently; all we have
+ * to share through the parallel context is the relation OIDs and the
+ * parallel heap scan descriptor. Insert-side synchronization is done with
+ * striped spinlocks inside HierarchicalNSW itself.
+ */
+#define HNSW_PARALLEL_KEY_SHARED	UINT64CONST(0xD000000000000001)
+
+static HierarchicalNSW* hnsw_get_index(Relation indexRel, Relation heapRel);
+
+typedef struct HnswBuildShared
+{
+	Oid		heaprelid;
+	Oid		indexrelid;
+	/* ParallelTableScanDescData follows */
+} HnswBuildShared;
+
+#define ParallelTableScanFromHnswBuildShared(shared) \
+	((ParallelTableScanDesc) ((char *) (shared) + BUFFERALIGN(sizeof(HnswBuildShared))))
+
+PGDLLEXPORT void hnsw_parallel_build_main(dsm_segment *seg, shm_toc *toc);
+
 static void
-hnsw_populate(HierarchicalNSW* hnsw, Relation indexRel, Relation heapRel)
+hnsw_build_scan(HierarchicalNSW* hnsw, Relation indexRel, Relation heapRel, TableScanDesc scan)
 {
 	IndexInfo* indexInfo = BuildIndexInfo(indexRel);
 	Assert(indexInfo->ii_NumIndexAttrs == 1);
+	indexInfo->ii_Concurrent = false;
 	table_index_build_scan(heapRel, indexRel, indexInfo,
-						   true, true, hnsw_build_callback, (void *) hnsw, NULL);
+						   true, true, hnsw_build_callback, (void *) hnsw, scan);
+}
+
+void
+hnsw_parallel_build_main(dsm_segment *seg, shm_toc *toc)
+{
+	HnswBuildShared* shared = (HnswBuildShared *) shm_toc_lookup(toc, HNSW_PARALLEL_KEY_SHARED, false);
+	Relation heapRel = table_open(shared->heaprelid, ShareLock);
+	Relation indexRel = index_open(shared->indexrelid, AccessExclusiveLock);
+	HierarchicalNSW* hnsw = hnsw_get_index(indexRel, heapRel);
+	TableScanDesc scan = table_beginscan_parallel(heapRel, ParallelTableScanFromHnswBuildShared(shared));
+
+	hnsw_build_scan(hnsw, indexRel, heapRel, scan);
+
+	index_close(indexRel, AccessExclusiveLock);
+	table_close(heapRel, ShareLock);
+}
+
+static void
+hnsw_populate(HierarchicalNSW* hnsw, Relation indexRel, Relation heapRel)
+{
+	int nworkers = plan_create_index_workers(RelationGetRelid(heapRel),
+											 RelationGetRelid(indexRel));
+
+	if (nworkers > 0 && !IsParallelWorker() && !IsInParallelMode())
+	{
+		ParallelContext *pcxt;
+		Size		estshared;
+
+		EnterParallelMode();
+		pcxt = CreateParallelContext("hnsw", "hnsw_parallel_build_main", nworkers);
+		estshared = BUFFERALIGN(sizeof(HnswBuildShared)) +
+			table_parallelscan_estimate(heapRel, SnapshotAny);
+		shm_toc_estimate_chunk(&pcxt->estimator, estshared);
+		shm_toc_estimate_keys(&pcxt->estimator, 1);
+		InitializeParallelDSM(pcxt);
+
+		/* If no DSM segment was available, fall back to a serial build */
+		if (pcxt->seg != NULL)
+		{
+			HnswBuildShared* shared = (HnswBuildShared *) shm_toc_allocate(pcxt->toc, estshared);
+
+			shared->heaprelid = RelationGetRelid(heapRel);
+			shared->indexrelid = RelationGetRelid(indexRel);
+			table_parallelscan_initialize(heapRel,
+										  ParallelTableScanFromHnswBuildShared(shared),
+										  SnapshotAny);
+			shm_toc_insert(pcxt->toc, HNSW_PARALLEL_KEY_SHARED, shared);
+
+			LaunchParallelWorkers(pcxt);
+
+			/* The leader participates in the scan as well */
+			hnsw_build_scan(hnsw, indexRel, heapRel,
+							table_beginscan_parallel(heapRel,
+													 ParallelTableScanFromHnswBuildShared(shared)));
+
+			WaitForParallelWorkersToFinish(pcxt);
+			DestroyParallelContext(pcxt);
+			ExitParallelMode();
+			return;
+		}
+		DestroyParallelContext(pcxt);
+		ExitParallelMode();
+	}
+	hnsw_build_scan(hnsw, indexRel, heapRel, NULL);
 }
 
 #ifdef __APPLE__
@@ -170,9 +279,6 @@ hnsw_get_index(Relation indexRel, Relation heapRel)
 		size_t dims, maxelements;
 		size_t M;
 		size_t maxM;
-		size_t size_links_level0;
-		size_t size_data_per_element;
-		size_t data_size;
 		dsm_handle handle = indexoid << 1; /* make it even */
 		void* impl_private = NULL;
 		void* mapped_address = NULL;
@@ -188,10 +294,7 @@ hnsw_get_index(Relation indexRel, Relation heapRel)
 		maxelements = opts->maxelements;
 		M = opts->M;
 		maxM = M * 2;
-		data_size = dims * sizeof(coord_t);
-		size_links_level0 = (maxM + 1) * sizeof(idx_t);
-		size_data_per_element = size_links_level0 + data_size + sizeof(label_t);
-		shmem_size =  hnsw_sizeof() + maxelements * size_data_per_element;
+		shmem_size = hnsw_sizeof_index(maxelements, dims, M, opts->quantization);
 
 		hnsw_check_available_memory(shmem_size);
 
@@ -223,7 +326,7 @@ hnsw_get_index(Relation indexRel, Relation heapRel)
 
 		if (!exists)
 		{
-			hnsw_init(hnsw, dims, maxelements, M, maxM, opts->efConstruction);
+			hnsw_init(hnsw, dims, maxelements, M, maxM, opts->efConstruction, opts->quantization);
 			hnsw_populate(hnsw, indexRel, heapRel);
 		}
 		entry = hnsw_index_insert(hnsw_indexes, indexoid, &found);
@@ -395,7 +498,8 @@ hnsw_options(Datum reloptions, bool validate)
 		{"maxelements", RELOPT_TYPE_INT, offsetof(HnswOptions, maxelements)},
 		{"efconstruction", RELOPT_TYPE_INT, offsetof(HnswOptions, efConstruction)},
 		{"efsearch", RELOPT_TYPE_INT, offsetof(HnswOptions, efSearch)},
-		{"m", RELOPT_TYPE_INT, offsetof(HnswOptions, M)}
+		{"m", RELOPT_TYPE_INT, offsetof(HnswOptions, M)},
+		{"quantization", RELOPT_TYPE_ENUM, offsetof(HnswOptions, quantization)}
 	};
 
 	return (bytea *) build_reloptions(reloptions, validate,
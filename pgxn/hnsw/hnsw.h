@@ -7,9 +7,18 @@ typedef uint64_t label_t;
 
 typedef struct HierarchicalNSW HierarchicalNSW;
 
+/* How vectors are stored inside the shared-memory arena */
+typedef enum HnswQuantization
+{
+	HNSW_QUANT_NONE = 0,		/* full float32 coordinates */
+	HNSW_QUANT_INT8 = 1,		/* per-vector scalar quantization to 8 bits */
+	HNSW_QUANT_FP16 = 2			/* half-precision floats */
+} HnswQuantization;
+
 bool hnsw_search(HierarchicalNSW* hnsw, const coord_t *point, size_t efSearch, size_t* n_results, label_t** results);
 bool hnsw_add_point(HierarchicalNSW* hnsw, const coord_t *point, label_t label);
-void hnsw_init(HierarchicalNSW* hnsw, size_t dim, size_t maxelements, size_t M, size_t maxM, size_t efConstruction);
+void hnsw_init(HierarchicalNSW* hnsw, size_t dim, size_t maxelements, size_t M, size_t maxM, size_t efConstruction, int quantization);
 int  hnsw_dimensions(HierarchicalNSW* hnsw);
 size_t hnsw_count(HierarchicalNSW* hnsw);
 size_t hnsw_sizeof(void);
+size_t hnsw_sizeof_index(size_t maxelements, size_t dims, size_t M, int quantization);
@@ -1,5 +1,7 @@
 #include "hnswalg.h"
 
+#include <algorithm>
+
 #if defined(__GNUC__)
 #define PORTABLE_ALIGN32 __attribute__((aligned(32)))
 #define PREFETCH(addr,hint) __builtin_prefetch(addr, 0, hint)
@@ -8,10 +10,105 @@
 #define PREFETCH(addr,hint)
 #endif
 
-HierarchicalNSW::HierarchicalNSW(size_t dim_, size_t maxelements_, size_t M_, size_t maxM_, size_t efConstruction_)
+/*
+ * Simple test-and-test-and-set spinlocks. The index lives in shared memory
+ * mapped by multiple backends, so we cannot use std::mutex here; critical
+ * sections are a handful of word writes, so spinning is appropriate.
+ */
+static inline void hnsw_spin_lock(volatile uint32_t *lock)
+{
+    while (__atomic_exchange_n(lock, 1u, __ATOMIC_ACQUIRE))
+        while (__atomic_load_n(lock, __ATOMIC_RELAXED))
+            ;
+}
+
+static inline void hnsw_spin_unlock(volatile uint32_t *lock)
+{
+    __atomic_store_n(lock, 0u, __ATOMIC_RELEASE);
+}
+
+/*
+ * Per-backend search scratch space, reused across searches so the hot path
+ * neither allocates nor zeroes per-call state. The visited set is an array
+ * of epoch tags: an element counts as visited when its tag equals the
+ * current epoch, so starting a new search is a counter bump instead of a
+ * memset; the whole array is cleared only when the 16-bit epoch wraps.
+ * The heaps are plain vectors driven with push_heap/pop_heap, keeping
+ * their capacity from one search to the next.
+ */
+struct HnswSearchContext
+{
+    uint16_t epoch;
+    std::vector<uint16_t> visited;
+    std::vector<std::pair<dist_t, idx_t>> top;			/* max-heap of results */
+    std::vector<std::pair<dist_t, idx_t>> candidates;	/* max-heap of (-dist, id) */
+    std::vector<idx_t>  unvisited;
+    std::vector<dist_t> dists;
+    std::vector<idx_t>  links;
+
+    HnswSearchContext() : epoch(0) {}
+
+    void reset(size_t nelements, size_t nlinks)
+    {
+        if (visited.size() < nelements)
+            visited.resize(nelements, 0);
+        if (++epoch == 0)
+        {
+            /* epoch counter wrapped: invalidate all stale tags */
+            std::fill(visited.begin(), visited.end(), 0);
+            epoch = 1;
+        }
+        top.clear();
+        candidates.clear();
+        if (unvisited.size() < nlinks)
+        {
+            unvisited.resize(nlinks);
+            dists.resize(nlinks);
+        }
+    }
+};
+
+static thread_local HnswSearchContext hnsw_search_ctx;
+
+/*
+ * Expected number of upper-layer link lists is maxelements/(M-1) for the
+ * geometric level distribution with mult=1/ln(M); reserve twice that so
+ * that an unlucky level draw doesn't exhaust the arena.
+ */
+static size_t upper_arena_links(size_t maxelements, size_t M)
+{
+    return (maxelements / (M - 1) + 1) * 2 + 16;
+}
+
+/*
+ * Size of the stored (possibly quantized) representation of one vector,
+ * padded so that the fields following it stay 4-byte aligned. The int8
+ * form is prefixed with the per-vector dequantization scale and offset.
+ */
+static size_t stored_data_size(size_t dim, HnswQuantization quantization)
+{
+    size_t size;
+
+    switch (quantization)
+    {
+      case HNSW_QUANT_INT8:
+        size = 2 * sizeof(float) + dim;
+        break;
+      case HNSW_QUANT_FP16:
+        size = dim * sizeof(uint16_t);
+        break;
+      default:
+        size = dim * sizeof(coord_t);
+        break;
+    }
+    return (size + 3) & ~(size_t)3;
+}
+
+HierarchicalNSW::HierarchicalNSW(size_t dim_, size_t maxelements_, size_t M_, size_t maxM_, size_t efConstruction_, HnswQuantization quantization_)
 {
     dim = dim_;
-    data_size = dim * sizeof(coord_t);
+    quantization = quantization_;
+    data_size = stored_data_size(dim, quantization);
 
     efConstruction = efConstruction_;
 
@@ -19,97 +116,145 @@ HierarchicalNSW::HierarchicalNSW(size_t dim_, size_t maxelements_, size_t M_, si
     M = M_;
     maxM = maxM_;
     size_links_level0 = (maxM + 1) * sizeof(idx_t);
-    size_data_per_element = size_links_level0 + data_size  + sizeof(label_t);
+    size_data_per_element = size_links_level0 + data_size  + sizeof(label_t) + 2 * sizeof(idx_t);
     offset_data = size_links_level0;
 	offset_label = offset_data + data_size;
+	offset_level = offset_label + sizeof(label_t);
+
+    upper_arena_offset = maxelements * size_data_per_element;
+    upper_arena_size = upper_arena_links(maxelements, M) * (M + 1);
+    upper_arena_used = 0;
+
+    level_mult = 1.0 / log((double)M);
+    rng_state = 0x5bd1e995;
+
+    memset((void*)link_locks, 0, sizeof link_locks);
+    global_lock = 0;
+    entry_initialized = 0;
 
     enterpoint_node = 0;
+    maxlevel = 0;
     cur_element_count = 0;
 #ifdef __x86_64__
-    use_avx2 = __builtin_cpu_supports("avx2");
+    if (__builtin_cpu_supports("avx512f"))
+        dist_kernel = DIST_AVX512;
+    else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        dist_kernel = DIST_AVX2_FMA;
+    else
+        dist_kernel = DIST_SSE;
+
+    /* the fp16 SIMD kernel relies on F16C conversions */
+    if (quantization == HNSW_QUANT_FP16 && !__builtin_cpu_supports("f16c"))
+        dist_kernel = DIST_SCALAR;
+#elif defined(__aarch64__)
+    dist_kernel = DIST_NEON;
+#else
+    dist_kernel = DIST_SCALAR;
 #endif
 }
 
-std::priority_queue<std::pair<dist_t, idx_t>> HierarchicalNSW::searchBaseLayer(const coord_t *point, size_t ef)
+void HierarchicalNSW::searchLayer(const coord_t *point, size_t ef, int level, idx_t ep)
 {
-	std::vector<uint32_t> visited;
-	visited.resize((cur_element_count + 31) >> 5);
+	size_t n_snapshot = __atomic_load_n(&cur_element_count, __ATOMIC_ACQUIRE);
+	HnswSearchContext& ctx = hnsw_search_ctx;
+
+	ctx.reset(n_snapshot, maxM + 1);
 
-    std::priority_queue<std::pair<dist_t, idx_t >> topResults;
-    std::priority_queue<std::pair<dist_t, idx_t >> candidateSet;
+	std::vector<std::pair<dist_t, idx_t>>& topResults = ctx.top;
+	std::vector<std::pair<dist_t, idx_t>>& candidateSet = ctx.candidates;
+	std::vector<idx_t>& unvisited = ctx.unvisited;
+	std::vector<dist_t>& dists = ctx.dists;
+	uint16_t epoch = ctx.epoch;
 
-    dist_t dist = fstdistfunc(point, getDataByInternalId(enterpoint_node));
+    dist_t dist = fstdistfunc(point, getDataByInternalId(ep));
 
-    topResults.emplace(dist, enterpoint_node);
-    candidateSet.emplace(-dist, enterpoint_node);
-    visited[enterpoint_node >> 5] = 1 << (enterpoint_node & 31);
+    topResults.emplace_back(dist, ep);
+    candidateSet.emplace_back(-dist, ep);
+    ctx.visited[ep] = epoch;
     dist_t lowerBound = dist;
 
     while (!candidateSet.empty())
     {
-        std::pair<dist_t, idx_t> curr_el_pair = candidateSet.top();
+        std::pair<dist_t, idx_t> curr_el_pair = candidateSet.front();
         if (-curr_el_pair.first > lowerBound)
             break;
 
-        candidateSet.pop();
+        std::pop_heap(candidateSet.begin(), candidateSet.end());
+        candidateSet.pop_back();
         idx_t curNodeNum = curr_el_pair.second;
 
-        idx_t* data = get_linklist0(curNodeNum);
-        size_t size = *data++;
+        size_t n_unvisited = 0;
 
-        PREFETCH(getDataByInternalId(*data), 0);
+        /*
+         * First pass: collect the not-yet-visited neighbors and compute all
+         * distances to them in one batched call, so that the kernel is
+         * dispatched once per adjacency list and the vector data is
+         * prefetched ahead of use. The list is read under its stripe lock so
+         * that a concurrent insert rewriting it cannot hand us a torn list;
+         * elements added after this search started are ignored.
+         */
+        hnsw_spin_lock(linkLock(curNodeNum));
+        {
+            idx_t* data = get_linklist(curNodeNum, level);
+            size_t size = *data++;
 
-        for (size_t j = 0; j < size; ++j) {
-            size_t tnum = *(data + j);
+            for (size_t j = 0; j < size; ++j) {
+                idx_t tnum = *(data + j);
 
-            PREFETCH(getDataByInternalId(*(data + j + 1)), 0);
+                if (tnum >= n_snapshot)
+                    continue;
 
-            if (!(visited[tnum >> 5] & (1 << (tnum & 31)))) {
-				visited[tnum >> 5] |= 1 << (tnum & 31);
-
-                dist = fstdistfunc(point, getDataByInternalId(tnum));
+                if (ctx.visited[tnum] != epoch) {
+					ctx.visited[tnum] = epoch;
+                    unvisited[n_unvisited++] = tnum;
+                }
+            }
+        }
+        hnsw_spin_unlock(linkLock(curNodeNum));
+        fstdistfunc_batch(point, unvisited.data(), n_unvisited, dists.data());
 
-                if (topResults.top().first > dist || topResults.size() < ef) {
-                    candidateSet.emplace(-dist, tnum);
+        for (size_t j = 0; j < n_unvisited; ++j) {
+            idx_t tnum = unvisited[j];
+            dist = dists[j];
 
-                    PREFETCH(get_linklist0(candidateSet.top().second), 0);
-                    topResults.emplace(dist, tnum);
+            if (topResults.front().first > dist || topResults.size() < ef) {
+                candidateSet.emplace_back(-dist, tnum);
+                std::push_heap(candidateSet.begin(), candidateSet.end());
 
-                    if (topResults.size() > ef)
-                        topResults.pop();
+                PREFETCH(get_linklist(candidateSet.front().second, level), 0);
+                topResults.emplace_back(dist, tnum);
+                std::push_heap(topResults.begin(), topResults.end());
 
-                    lowerBound = topResults.top().first;
+                if (topResults.size() > ef) {
+                    std::pop_heap(topResults.begin(), topResults.end());
+                    topResults.pop_back();
                 }
+
+                lowerBound = topResults.front().first;
             }
         }
     }
-    return topResults;
 }
 
 
-void HierarchicalNSW::getNeighborsByHeuristic(std::priority_queue<std::pair<dist_t, idx_t>> &topResults, size_t NN)
+/*
+ * Prune topResults down to at most NN diverse neighbors; on return the
+ * vector is ordered by ascending distance to the query.
+ */
+void HierarchicalNSW::getNeighborsByHeuristic(std::vector<std::pair<dist_t, idx_t>> &topResults, size_t NN)
 {
-    if (topResults.size() < NN)
-        return;
-
-    std::priority_queue<std::pair<dist_t, idx_t>> resultSet;
     std::vector<std::pair<dist_t, idx_t>> returnlist;
 
-    while (topResults.size() > 0) {
-        resultSet.emplace(-topResults.top().first, topResults.top().second);
-        topResults.pop();
-    }
+    std::sort(topResults.begin(), topResults.end());
+    if (topResults.size() < NN)
+        return;
 
-    while (resultSet.size()) {
-        if (returnlist.size() >= NN)
-            break;
-        std::pair<dist_t, idx_t> curen = resultSet.top();
-        dist_t dist_to_query = -curen.first;
-        resultSet.pop();
+    for (size_t i = 0; i < topResults.size() && returnlist.size() < NN; i++) {
+        std::pair<dist_t, idx_t> curen = topResults[i];
+        dist_t dist_to_query = curen.first;
         bool good = true;
         for (std::pair<dist_t, idx_t> curen2 : returnlist) {
-            dist_t curdist = fstdistfunc(getDataByInternalId(curen2.second),
-                                         getDataByInternalId(curen.second));
+            dist_t curdist = fstdistfunc_stored(curen2.second, curen.second);
             if (curdist < dist_to_query) {
                 good = false;
                 break;
@@ -117,44 +262,64 @@ void HierarchicalNSW::getNeighborsByHeuristic(std::priority_queue<std::pair<dist
         }
         if (good) returnlist.push_back(curen);
     }
-    for (std::pair<dist_t, idx_t> elem : returnlist)
-        topResults.emplace(-elem.first, elem.second);
+    topResults.swap(returnlist);
 }
 
-void HierarchicalNSW::mutuallyConnectNewElement(const coord_t *point, idx_t cur_c,
-                               std::priority_queue<std::pair<dist_t, idx_t>> topResults)
+idx_t HierarchicalNSW::mutuallyConnectNewElement(const coord_t *point, idx_t cur_c,
+                               std::vector<std::pair<dist_t, idx_t>> &topResults, int level)
 {
     getNeighborsByHeuristic(topResults, M);
 
     std::vector<idx_t> res;
     res.reserve(M);
-    while (topResults.size() > 0) {
-        res.push_back(topResults.top().second);
-        topResults.pop();
-    }
+    for (size_t i = 0; i < topResults.size(); i++)
+        res.push_back(topResults[i].second);
+    hnsw_spin_lock(linkLock(cur_c));
     {
-        idx_t* data = get_linklist0(cur_c);
-        if (*data)
-            throw std::runtime_error("Should be blank");
+        /*
+         * Concurrent inserters may already have added backlinks to this
+         * element's list; keep those that fit after our own selection
+         * instead of expecting the list to be blank.
+         */
+        size_t cap = level == 0 ? maxM : M;
+        idx_t* data = get_linklist(cur_c, level);
+        std::vector<idx_t> prior(data + 1, data + 1 + *data);
+        size_t cnt = 0;
 
-        *data++ = res.size();
+        for (size_t idx = 0; idx < res.size(); idx++)
+            data[1 + cnt++] = res[idx];
 
-        for (size_t idx = 0; idx < res.size(); idx++) {
-            if (data[idx])
-                throw std::runtime_error("Should be blank");
-            data[idx] = res[idx];
+        for (size_t idx = 0; idx < prior.size() && cnt < cap; idx++) {
+            bool dup = false;
+            for (size_t j = 0; j < res.size(); j++) {
+                if (res[j] == prior[idx]) {
+                    dup = true;
+                    break;
+                }
+            }
+            if (!dup)
+                data[1 + cnt++] = prior[idx];
         }
+        *data = cnt;
     }
+    hnsw_spin_unlock(linkLock(cur_c));
+
     for (size_t idx = 0; idx < res.size(); idx++) {
         if (res[idx] == cur_c)
             throw std::runtime_error("Connection to the same element");
 
-        size_t resMmax = maxM;
-        idx_t *ll_other = get_linklist0(res[idx]);
+        size_t resMmax = level == 0 ? maxM : M;
+
+        /* One stripe lock at a time, so no lock ordering concerns */
+        hnsw_spin_lock(linkLock(res[idx]));
+
+        idx_t *ll_other = get_linklist(res[idx], level);
         idx_t sz_link_list_other = *ll_other;
 
-        if (sz_link_list_other > resMmax || sz_link_list_other < 0)
+        if (sz_link_list_other > resMmax || sz_link_list_other < 0) {
+            hnsw_spin_unlock(linkLock(res[idx]));
             throw std::runtime_error("Bad sz_link_list_other");
+        }
 
         if (sz_link_list_other < resMmax) {
             idx_t *data = ll_other + 1;
@@ -163,57 +328,189 @@ void HierarchicalNSW::mutuallyConnectNewElement(const coord_t *point, idx_t cur_
         } else {
             // finding the "weakest" element to replace it with the new one
             idx_t *data = ll_other + 1;
-            dist_t d_max = fstdistfunc(getDataByInternalId(cur_c), getDataByInternalId(res[idx]));
+            dist_t d_max = fstdistfunc_stored(cur_c, res[idx]);
             // Heuristic:
-            std::priority_queue<std::pair<dist_t, idx_t>> candidates;
-            candidates.emplace(d_max, cur_c);
+            std::vector<std::pair<dist_t, idx_t>> candidates;
+            candidates.reserve(sz_link_list_other + 1);
+            candidates.emplace_back(d_max, cur_c);
 
             for (size_t j = 0; j < sz_link_list_other; j++)
-                candidates.emplace(fstdistfunc(getDataByInternalId(data[j]), getDataByInternalId(res[idx])), data[j]);
+                candidates.emplace_back(fstdistfunc_stored(data[j], res[idx]), data[j]);
 
             getNeighborsByHeuristic(candidates, resMmax);
 
-            size_t indx = 0;
-            while (!candidates.empty()) {
-                data[indx] = candidates.top().second;
-                candidates.pop();
-                indx++;
+            for (size_t j = 0; j < candidates.size(); j++)
+                data[j] = candidates[j].second;
+            *ll_other = candidates.size();
+        }
+        hnsw_spin_unlock(linkLock(res[idx]));
+    }
+    /* res is ordered by ascending distance, so the closest neighbor is first */
+    return res.front();
+}
+
+/*
+ * Draw a level from the geometric distribution with mult=1/ln(M)
+ * using a xorshift PRNG whose state lives in the shared index.
+ */
+int HierarchicalNSW::randomLevel(void)
+{
+    uint32_t x = rng_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    rng_state = x;
+
+    double r = ((x >> 8) + 1) / (double)(0x1000000 + 1);
+    int level = (int)(-log(r) * level_mult);
+    return level < HNSW_MAX_LEVEL ? level : HNSW_MAX_LEVEL;
+}
+
+/*
+ * Greedy search on the upper layers: starting from ep at level_from,
+ * repeatedly move to the closest neighbor until no improvement, then
+ * drop one level, stopping above level_to.
+ */
+idx_t HierarchicalNSW::greedyDescent(const coord_t *point, idx_t ep, int level_from, int level_to)
+{
+    idx_t  currObj = ep;
+    dist_t curdist = fstdistfunc(point, getDataByInternalId(currObj));
+    std::vector<idx_t>& links = hnsw_search_ctx.links;
+
+    if (links.size() < M + 1)
+        links.resize(M + 1);
+
+    for (int level = level_from; level > level_to; level--)
+    {
+        bool changed = true;
+        while (changed)
+        {
+            size_t size;
+
+            /* copy the adjacency list under its stripe lock */
+            hnsw_spin_lock(linkLock(currObj));
+            {
+                idx_t* data = get_linklist(currObj, level);
+                size = *data++;
+                memcpy(links.data(), data, size * sizeof(idx_t));
+            }
+            hnsw_spin_unlock(linkLock(currObj));
+
+            changed = false;
+            for (size_t j = 0; j < size; j++)
+            {
+                dist_t d = fstdistfunc(point, getDataByInternalId(links[j]));
+                if (d < curdist)
+                {
+                    curdist = d;
+                    currObj = links[j];
+                    changed = true;
+                }
             }
-            *ll_other = indx;
         }
     }
+    return currObj;
 }
 
 void HierarchicalNSW::addPoint(const coord_t *point, label_t label)
 {
-    if (cur_element_count >= maxelements) {
+    idx_t cur_c = (idx_t)__atomic_fetch_add(&cur_element_count, 1, __ATOMIC_ACQ_REL);
+    int level;
+    idx_t upper_offset = 0;
+    int ent_level = 0;
+
+    if (cur_c >= maxelements) {
+        __atomic_fetch_sub(&cur_element_count, 1, __ATOMIC_ACQ_REL);
         throw std::runtime_error("The number of elements exceeds the specified limit");
     }
-    idx_t cur_c = cur_element_count++;
+
+    /* Draw the level and allocate upper links */
+    hnsw_spin_lock(&global_lock);
+    level = randomLevel();
+    if (level > 0) {
+        size_t need = (size_t)level * (M + 1);
+        if (upper_arena_used + need <= upper_arena_size) {
+            upper_offset = upper_arena_used;
+            upper_arena_used += need;
+        } else {
+            /* arena exhausted: keep the node at the base layer */
+            level = 0;
+        }
+    }
+    hnsw_spin_unlock(&global_lock);
+
+    if (level > 0)
+        memset((char *)&data_level0_memory[upper_arena_offset] + upper_offset * sizeof(idx_t),
+               0, (size_t)level * (M + 1) * sizeof(idx_t));
     memset((char *) get_linklist0(cur_c), 0, size_data_per_element);
-    memcpy(getDataByInternalId(cur_c), point, data_size);
+    encodePoint(point, cur_c);
     memcpy(getExternalLabel(cur_c), &label, sizeof label);
+    getLevelHeader(cur_c)[0] = level;
+    getLevelHeader(cur_c)[1] = upper_offset;
 
     // Do nothing for the first element
     if (cur_c != 0) {
-        std::priority_queue <std::pair<dist_t, idx_t>> topResults = searchBaseLayer(point, efConstruction);
-        mutuallyConnectNewElement(point, cur_c, topResults);
+        idx_t currObj;
+
+        /*
+         * Concurrent inserters may overtake the insert of the very first
+         * element; wait until the entry point is usable.
+         */
+        while (!__atomic_load_n(&entry_initialized, __ATOMIC_ACQUIRE))
+            ;
+
+        hnsw_spin_lock(&global_lock);
+        ent_level = maxlevel;
+        currObj = enterpoint_node;
+        hnsw_spin_unlock(&global_lock);
+        if (level < ent_level)
+            currObj = greedyDescent(point, currObj, ent_level, level);
+
+        for (int lev = level < ent_level ? level : ent_level; lev >= 0; lev--) {
+            searchLayer(point, efConstruction, lev, currObj);
+            currObj = mutuallyConnectNewElement(point, cur_c, hnsw_search_ctx.top, lev);
+        }
+    }
+    if (level > ent_level || cur_c == 0) {
+        hnsw_spin_lock(&global_lock);
+        if (level > maxlevel || cur_c == 0) {
+            enterpoint_node = cur_c;
+            maxlevel = level;
+        }
+        hnsw_spin_unlock(&global_lock);
     }
+    if (cur_c == 0)
+        __atomic_store_n(&entry_initialized, 1u, __ATOMIC_RELEASE);
 };
 
 std::priority_queue<std::pair<dist_t, label_t>> HierarchicalNSW::searchKnn(const coord_t *query, size_t k)
 {
 	std::priority_queue<std::pair<dist_t, label_t>> topResults;
-	auto topCandidates = searchBaseLayer(query, k);
+	idx_t ent_point;
+	int ent_level;
+
+	/*
+	 * Snapshot the entry point and its level together, as addPoint does:
+	 * a concurrent inserter can promote the entry point, and mixing the new
+	 * maxlevel with the old enterpoint_node would make greedyDescent walk
+	 * levels that node does not own.
+	 */
+	hnsw_spin_lock(&global_lock);
+	ent_level = maxlevel;
+	ent_point = enterpoint_node;
+	hnsw_spin_unlock(&global_lock);
+
+	idx_t ep = greedyDescent(query, ent_point, ent_level, 0);
+	searchLayer(query, k, 0, ep);
+	std::vector<std::pair<dist_t, idx_t>>& topCandidates = hnsw_search_ctx.top;
     while (topCandidates.size() > k) {
-        topCandidates.pop();
+        std::pop_heap(topCandidates.begin(), topCandidates.end());
+        topCandidates.pop_back();
 	}
-	while (!topCandidates.empty()) {
-		std::pair<dist_t, idx_t> rez = topCandidates.top();
+	for (std::pair<dist_t, idx_t> rez : topCandidates) {
 		label_t label;
 		memcpy(&label, getExternalLabel(rez.second), sizeof(label));
 		topResults.push(std::pair<dist_t, label_t>(rez.first, label));
-		topCandidates.pop();
 	}
 
     return topResults;
@@ -235,8 +532,8 @@ dist_t fstdistfunc_scalar(const coord_t *x, const coord_t *y, size_t n)
 #ifdef __x86_64__
 #include <immintrin.h>
 
-__attribute__((target("avx2")))
-dist_t fstdistfunc_avx2(const coord_t *x, const coord_t *y, size_t n)
+__attribute__((target("avx2,fma")))
+dist_t fstdistfunc_avx2_fma(const coord_t *x, const coord_t *y, size_t n)
 {
     const size_t TmpResSz = sizeof(__m256) / sizeof(float);
     float PORTABLE_ALIGN32 TmpRes[TmpResSz];
@@ -251,18 +548,37 @@ dist_t fstdistfunc_avx2(const coord_t *x, const coord_t *y, size_t n)
         v2 = _mm256_loadu_ps(y);
         y += 8;
         diff = _mm256_sub_ps(v1, v2);
-        sum = _mm256_add_ps(sum, _mm256_mul_ps(diff, diff));
+        sum = _mm256_fmadd_ps(diff, diff, sum);
 
         v1 = _mm256_loadu_ps(x);
         x += 8;
         v2 = _mm256_loadu_ps(y);
         y += 8;
         diff = _mm256_sub_ps(v1, v2);
-        sum = _mm256_add_ps(sum, _mm256_mul_ps(diff, diff));
+        sum = _mm256_fmadd_ps(diff, diff, sum);
     }
     _mm256_store_ps(TmpRes, sum);
     float res = TmpRes[0] + TmpRes[1] + TmpRes[2] + TmpRes[3] + TmpRes[4] + TmpRes[5] + TmpRes[6] + TmpRes[7];
-    return (res);
+    return res + fstdistfunc_scalar(x, y, n - qty16 * 16);
+}
+
+__attribute__((target("avx512f")))
+dist_t fstdistfunc_avx512(const coord_t *x, const coord_t *y, size_t n)
+{
+    size_t qty16 = n / 16;
+    const float *pEnd1 = x + (qty16 * 16);
+    __m512 diff, v1, v2;
+    __m512 sum = _mm512_set1_ps(0);
+
+    while (x < pEnd1) {
+        v1 = _mm512_loadu_ps(x);
+        x += 16;
+        v2 = _mm512_loadu_ps(y);
+        y += 16;
+        diff = _mm512_sub_ps(v1, v2);
+        sum = _mm512_fmadd_ps(diff, diff, sum);
+    }
+    return _mm512_reduce_add_ps(sum) + fstdistfunc_scalar(x, y, n - qty16 * 16);
 }
 
 dist_t fstdistfunc_sse(const coord_t *x, const coord_t *y, size_t n)
@@ -306,20 +622,385 @@ dist_t fstdistfunc_sse(const coord_t *x, const coord_t *y, size_t n)
     }
     _mm_store_ps(TmpRes, sum);
     float res = TmpRes[0] + TmpRes[1] + TmpRes[2] + TmpRes[3];
-    return res;
+    return res + fstdistfunc_scalar(x, y, n - qty16 * 16);
 }
 #endif
 
-dist_t HierarchicalNSW::fstdistfunc(const coord_t *x, const coord_t *y)
+#ifdef __aarch64__
+#include <arm_neon.h>
+
+dist_t fstdistfunc_neon(const coord_t *x, const coord_t *y, size_t n)
 {
-#ifndef __x86_64__
-    return fstdistfunc_scalar(x, y, dim);
-#else
-    if(use_avx2)
-        return fstdistfunc_avx2(x, y, dim);
+    size_t qty8 = n / 8;
+    const float *pEnd1 = x + (qty8 * 8);
+    float32x4_t diff, v1, v2;
+    float32x4_t sum0 = vdupq_n_f32(0);
+    float32x4_t sum1 = vdupq_n_f32(0);
+
+    while (x < pEnd1) {
+        v1 = vld1q_f32(x);
+        x += 4;
+        v2 = vld1q_f32(y);
+        y += 4;
+        diff = vsubq_f32(v1, v2);
+        sum0 = vfmaq_f32(sum0, diff, diff);
 
-    return fstdistfunc_sse(x, y, dim);
+        v1 = vld1q_f32(x);
+        x += 4;
+        v2 = vld1q_f32(y);
+        y += 4;
+        diff = vsubq_f32(v1, v2);
+        sum1 = vfmaq_f32(sum1, diff, diff);
+    }
+    return vaddvq_f32(vaddq_f32(sum0, sum1)) + fstdistfunc_scalar(x, y, n - qty8 * 8);
+}
 #endif
+
+/*
+ * Software half-precision conversions, used for encoding and as fallback
+ * when no F16C-capable kernel is available.
+ */
+static inline float half_to_float(uint16_t h)
+{
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t bits;
+    float f;
+
+    if (exp == 0)
+    {
+        if (mant == 0)
+            bits = sign;
+        else
+        {
+            /* subnormal: renormalize */
+            exp = 127 - 15 + 1;
+            while (!(mant & 0x400))
+            {
+                mant <<= 1;
+                exp--;
+            }
+            mant &= 0x3ff;
+            bits = sign | (exp << 23) | (mant << 13);
+        }
+    }
+    else if (exp == 31)
+        bits = sign | 0x7f800000 | (mant << 13);
+    else
+        bits = sign | ((exp - 15 + 127) << 23) | (mant << 13);
+
+    memcpy(&f, &bits, sizeof f);
+    return f;
+}
+
+static inline uint16_t float_to_half(float f)
+{
+    uint32_t bits;
+    uint32_t sign;
+    int32_t  exp;
+    uint32_t mant;
+
+    memcpy(&bits, &f, sizeof bits);
+    sign = (bits >> 16) & 0x8000;
+    exp = (int32_t)((bits >> 23) & 0xff) - 127 + 15;
+    mant = bits & 0x7fffff;
+
+    if (exp >= 31)
+        return sign | 0x7c00;	/* overflow -> infinity */
+    if (exp <= 0)
+    {
+        if (exp < -10)
+            return sign;		/* underflow -> zero */
+        mant |= 0x800000;
+        return sign | (mant >> (14 - exp));
+    }
+    return sign | ((uint32_t)exp << 10) | (mant >> 13);
+}
+
+/*
+ * Quantized distance kernels. All stored-form kernels share the
+ * hnsw_dist_func_t signature so that one resolved pointer can drive a
+ * whole batch. The int8 form is [scale][offset][codes...]; the value of
+ * coordinate i is offset + scale * code[i].
+ */
+static dist_t dist_int8_tail(const coord_t *x, const uint8_t *code, float scale, float offset, size_t n)
+{
+    dist_t distance = 0.0;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        dist_t diff = x[i] - (offset + scale * (float)code[i]);
+        distance += diff * diff;
+    }
+    return distance;
+}
+
+static dist_t dist_int8_scalar(const coord_t *x, const char *stored, size_t n)
+{
+    const float *params = (const float *)stored;
+
+    return dist_int8_tail(x, (const uint8_t *)(stored + 2 * sizeof(float)), params[0], params[1], n);
+}
+
+static dist_t dist_fp16_tail(const coord_t *x, const uint16_t *half, size_t n)
+{
+    dist_t distance = 0.0;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        dist_t diff = x[i] - half_to_float(half[i]);
+        distance += diff * diff;
+    }
+    return distance;
+}
+
+static dist_t dist_fp16_scalar(const coord_t *x, const char *stored, size_t n)
+{
+    return dist_fp16_tail(x, (const uint16_t *)stored, n);
+}
+
+static dist_t dist_f32_scalar(const coord_t *x, const char *stored, size_t n)
+{
+    return fstdistfunc_scalar(x, (const coord_t *)stored, n);
+}
+
+#ifdef __x86_64__
+static dist_t dist_f32_sse(const coord_t *x, const char *stored, size_t n)
+{
+    return fstdistfunc_sse(x, (const coord_t *)stored, n);
+}
+
+static dist_t dist_f32_avx2(const coord_t *x, const char *stored, size_t n)
+{
+    return fstdistfunc_avx2_fma(x, (const coord_t *)stored, n);
+}
+
+static dist_t dist_f32_avx512(const coord_t *x, const char *stored, size_t n)
+{
+    return fstdistfunc_avx512(x, (const coord_t *)stored, n);
+}
+
+__attribute__((target("avx2,fma")))
+static dist_t dist_int8_avx2(const coord_t *x, const char *stored, size_t n)
+{
+    const size_t TmpResSz = sizeof(__m256) / sizeof(float);
+    float PORTABLE_ALIGN32 TmpRes[TmpResSz];
+    const float *params = (const float *)stored;
+    const uint8_t *code = (const uint8_t *)(stored + 2 * sizeof(float));
+    __m256 vscale = _mm256_set1_ps(params[0]);
+    __m256 voffset = _mm256_set1_ps(params[1]);
+    __m256 sum = _mm256_set1_ps(0);
+    size_t qty8 = n / 8;
+    const float *pEnd1 = x + qty8 * 8;
+
+    while (x < pEnd1) {
+        __m256i c = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)code));
+        __m256 y = _mm256_fmadd_ps(_mm256_cvtepi32_ps(c), vscale, voffset);
+        __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(x), y);
+        sum = _mm256_fmadd_ps(diff, diff, sum);
+        x += 8;
+        code += 8;
+    }
+    _mm256_store_ps(TmpRes, sum);
+    float res = TmpRes[0] + TmpRes[1] + TmpRes[2] + TmpRes[3] + TmpRes[4] + TmpRes[5] + TmpRes[6] + TmpRes[7];
+    return res + dist_int8_tail(x, code, params[0], params[1], n - qty8 * 8);
+}
+
+__attribute__((target("avx2,fma,f16c")))
+static dist_t dist_fp16_avx2(const coord_t *x, const char *stored, size_t n)
+{
+    const size_t TmpResSz = sizeof(__m256) / sizeof(float);
+    float PORTABLE_ALIGN32 TmpRes[TmpResSz];
+    const uint16_t *half = (const uint16_t *)stored;
+    __m256 sum = _mm256_set1_ps(0);
+    size_t qty8 = n / 8;
+    const float *pEnd1 = x + qty8 * 8;
+
+    while (x < pEnd1) {
+        __m256 y = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)half));
+        __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(x), y);
+        sum = _mm256_fmadd_ps(diff, diff, sum);
+        x += 8;
+        half += 8;
+    }
+    _mm256_store_ps(TmpRes, sum);
+    float res = TmpRes[0] + TmpRes[1] + TmpRes[2] + TmpRes[3] + TmpRes[4] + TmpRes[5] + TmpRes[6] + TmpRes[7];
+    return res + dist_fp16_tail(x, half, n - qty8 * 8);
+}
+#endif
+
+#ifdef __aarch64__
+static dist_t dist_f32_neon(const coord_t *x, const char *stored, size_t n)
+{
+    return fstdistfunc_neon(x, (const coord_t *)stored, n);
+}
+
+static dist_t dist_int8_neon(const coord_t *x, const char *stored, size_t n)
+{
+    const float *params = (const float *)stored;
+    const uint8_t *code = (const uint8_t *)(stored + 2 * sizeof(float));
+    float32x4_t vscale = vdupq_n_f32(params[0]);
+    float32x4_t voffset = vdupq_n_f32(params[1]);
+    float32x4_t sum = vdupq_n_f32(0);
+    size_t qty8 = n / 8;
+    const float *pEnd1 = x + qty8 * 8;
+
+    while (x < pEnd1) {
+        uint16x8_t c16 = vmovl_u8(vld1_u8(code));
+        float32x4_t y0 = vfmaq_f32(voffset, vcvtq_f32_u32(vmovl_u16(vget_low_u16(c16))), vscale);
+        float32x4_t y1 = vfmaq_f32(voffset, vcvtq_f32_u32(vmovl_u16(vget_high_u16(c16))), vscale);
+        float32x4_t d0 = vsubq_f32(vld1q_f32(x), y0);
+        float32x4_t d1 = vsubq_f32(vld1q_f32(x + 4), y1);
+        sum = vfmaq_f32(sum, d0, d0);
+        sum = vfmaq_f32(sum, d1, d1);
+        x += 8;
+        code += 8;
+    }
+    return vaddvq_f32(sum) + dist_int8_tail(x, code, params[0], params[1], n - qty8 * 8);
+}
+#endif
+
+hnsw_dist_func_t HierarchicalNSW::resolveKernel(void)
+{
+    switch (quantization)
+    {
+      case HNSW_QUANT_INT8:
+#ifdef __x86_64__
+        if (dist_kernel == DIST_AVX512 || dist_kernel == DIST_AVX2_FMA)
+            return dist_int8_avx2;
+#endif
+#ifdef __aarch64__
+        if (dist_kernel == DIST_NEON)
+            return dist_int8_neon;
+#endif
+        return dist_int8_scalar;
+
+      case HNSW_QUANT_FP16:
+#ifdef __x86_64__
+        /* the constructor falls back to DIST_SCALAR when F16C is missing */
+        if (dist_kernel == DIST_AVX512 || dist_kernel == DIST_AVX2_FMA)
+            return dist_fp16_avx2;
+#endif
+        return dist_fp16_scalar;
+
+      default:
+        switch (dist_kernel)
+        {
+#ifdef __x86_64__
+          case DIST_AVX512:
+            return dist_f32_avx512;
+          case DIST_AVX2_FMA:
+            return dist_f32_avx2;
+          case DIST_SSE:
+            return dist_f32_sse;
+#endif
+#ifdef __aarch64__
+          case DIST_NEON:
+            return dist_f32_neon;
+#endif
+          default:
+            return dist_f32_scalar;
+        }
+    }
+}
+
+void HierarchicalNSW::encodePoint(const coord_t *point, idx_t internal_id)
+{
+    char *dst = getDataByInternalId(internal_id);
+
+    switch (quantization)
+    {
+      case HNSW_QUANT_INT8:
+      {
+          float lo = point[0];
+          float hi = point[0];
+          float *params = (float *)dst;
+          uint8_t *code = (uint8_t *)(dst + 2 * sizeof(float));
+
+          for (size_t i = 1; i < dim; i++)
+          {
+              if (point[i] < lo)
+                  lo = point[i];
+              if (point[i] > hi)
+                  hi = point[i];
+          }
+          params[0] = hi > lo ? (hi - lo) / 255.0f : 0.0f;
+          params[1] = lo;
+          for (size_t i = 0; i < dim; i++)
+              code[i] = params[0] > 0.0f ? (uint8_t)((point[i] - lo) / params[0] + 0.5f) : 0;
+          break;
+      }
+      case HNSW_QUANT_FP16:
+      {
+          uint16_t *half = (uint16_t *)dst;
+
+          for (size_t i = 0; i < dim; i++)
+              half[i] = float_to_half(point[i]);
+          break;
+      }
+      default:
+        memcpy(dst, point, dim * sizeof(coord_t));
+        break;
+    }
+}
+
+void HierarchicalNSW::decodeStored(idx_t internal_id, coord_t *out)
+{
+    const char *src = getDataByInternalId(internal_id);
+
+    switch (quantization)
+    {
+      case HNSW_QUANT_INT8:
+      {
+          const float *params = (const float *)src;
+          const uint8_t *code = (const uint8_t *)(src + 2 * sizeof(float));
+
+          for (size_t i = 0; i < dim; i++)
+              out[i] = params[1] + params[0] * (float)code[i];
+          break;
+      }
+      case HNSW_QUANT_FP16:
+      {
+          const uint16_t *half = (const uint16_t *)src;
+
+          for (size_t i = 0; i < dim; i++)
+              out[i] = half_to_float(half[i]);
+          break;
+      }
+      default:
+        memcpy(out, src, dim * sizeof(coord_t));
+        break;
+    }
+}
+
+dist_t HierarchicalNSW::fstdistfunc(const coord_t *x, const char *stored)
+{
+    return resolveKernel()(x, stored, dim);
+}
+
+dist_t HierarchicalNSW::fstdistfunc_stored(idx_t a, idx_t b)
+{
+    if (quantization == HNSW_QUANT_NONE)
+        return fstdistfunc((const coord_t *)getDataByInternalId(a), getDataByInternalId(b));
+
+    /* decode one side; only used on the construction path */
+    std::vector<coord_t> buf(dim);
+    decodeStored(a, buf.data());
+    return fstdistfunc(buf.data(), getDataByInternalId(b));
+}
+
+void HierarchicalNSW::fstdistfunc_batch(const coord_t *x, const idx_t *ids, size_t n, dist_t *dists)
+{
+    /* Resolve the kernel once for the whole batch */
+    hnsw_dist_func_t func = resolveKernel();
+
+    for (size_t i = 0; i < n; i++)
+    {
+        if (i + 1 < n)
+            PREFETCH(getDataByInternalId(ids[i + 1]), 1);
+        dists[i] = func(x, getDataByInternalId(ids[i]), dim);
+    }
 }
 
 bool hnsw_search(HierarchicalNSW* hnsw, const coord_t *point, size_t efSearch, size_t* n_results, label_t** results)
@@ -357,9 +1038,9 @@ bool hnsw_add_point(HierarchicalNSW* hnsw, const coord_t *point, label_t label)
 	}
 }
 
-void hnsw_init(HierarchicalNSW* hnsw, size_t dims, size_t maxelements, size_t M, size_t maxM, size_t efConstruction)
+void hnsw_init(HierarchicalNSW* hnsw, size_t dims, size_t maxelements, size_t M, size_t maxM, size_t efConstruction, int quantization)
 {
-	new ((void*)hnsw) HierarchicalNSW(dims, maxelements, M, maxM, efConstruction);
+	new ((void*)hnsw) HierarchicalNSW(dims, maxelements, M, maxM, efConstruction, (HnswQuantization)quantization);
 }
 
 
@@ -377,3 +1058,19 @@ size_t hnsw_sizeof(void)
 {
 	return sizeof(HierarchicalNSW);
 }
+
+/*
+ * Total shared memory needed for an index with the given parameters.
+ * Must agree with the layout computed in the constructor.
+ */
+size_t hnsw_sizeof_index(size_t maxelements, size_t dims, size_t M, int quantization)
+{
+	size_t maxM = M * 2;
+	size_t data_size = stored_data_size(dims, (HnswQuantization)quantization);
+	size_t size_links_level0 = (maxM + 1) * sizeof(idx_t);
+	size_t size_data_per_element = size_links_level0 + data_size + sizeof(label_t) + 2 * sizeof(idx_t);
+
+	return sizeof(HierarchicalNSW)
+		+ maxelements * size_data_per_element
+		+ upper_arena_links(maxelements, M) * (M + 1) * sizeof(idx_t);
+}
@@ -9,42 +9,93 @@
 #include <map>
 #include <cmath>
 #include <queue>
+#include <vector>
 #include <stdexcept>
 
 extern "C" {
 #include "hnsw.h"
 }
 
+/* Cap on node levels: bounds the greedy descent and the upper-link arena */
+#define HNSW_MAX_LEVEL 16
+
+/* Number of spinlock stripes protecting link lists during concurrent build */
+#define HNSW_LOCK_STRIPES 1024
+
+/*
+ * Distance kernel selected once at index initialization based on the CPU
+ * the postmaster is running on. We store an identifier rather than a
+ * function pointer because the index lives in shared memory and the
+ * library may be mapped at different addresses in different backends.
+ */
+typedef enum DistKernel
+{
+	DIST_SCALAR,
+	DIST_SSE,
+	DIST_AVX2_FMA,
+	DIST_AVX512,
+	DIST_NEON
+} DistKernel;
+
+/* Distance from a full-precision query to one stored element */
+typedef dist_t (*hnsw_dist_func_t)(const coord_t *x, const char *stored, size_t n);
+
 struct HierarchicalNSW
 {
 	size_t maxelements;
 	size_t cur_element_count;
 
 	idx_t  enterpoint_node;
+	int    maxlevel;
 
 	size_t dim;
 	size_t data_size;
 	size_t offset_data;
 	size_t offset_label;
+	size_t offset_level;
 	size_t size_data_per_element;
 	size_t M;
 	size_t maxM;
 	size_t size_links_level0;
 	size_t efConstruction;
 
-#ifdef __x86_64__
-	bool	use_avx2;
-#endif
+	/*
+	 * Upper-layer link lists live in a bump-allocated arena placed after the
+	 * level-0 element blocks. A node of level l owns l consecutive lists of
+	 * M+1 ids each; its offset into the arena (in idx_t units) is stored in
+	 * the per-element header. Sizes are in idx_t units as well.
+	 */
+	size_t upper_arena_offset;
+	size_t upper_arena_size;
+	size_t upper_arena_used;
+
+	double   level_mult;
+	uint32_t rng_state;
+
+	DistKernel dist_kernel;
+	HnswQuantization quantization;
+
+	/*
+	 * Spinlocks for concurrent insertion: a node's link lists are guarded
+	 * by the stripe its id hashes to; global_lock covers the entry point,
+	 * maxlevel, the level PRNG and the upper-link arena allocator.
+	 */
+	uint32_t link_locks[HNSW_LOCK_STRIPES];
+	uint32_t global_lock;
+	uint32_t entry_initialized;	/* set once the first element is in place */
 
 	char   data_level0_memory[0]; // varying size
 
   public:
-	HierarchicalNSW(size_t dim, size_t maxelements, size_t M, size_t maxM, size_t efConstruction);
+	HierarchicalNSW(size_t dim, size_t maxelements, size_t M, size_t maxM, size_t efConstruction, HnswQuantization quantization);
 	~HierarchicalNSW();
 
-
-	inline coord_t *getDataByInternalId(idx_t internal_id) const {
-		return (coord_t *)&data_level0_memory[internal_id * size_data_per_element + offset_data];
+	/*
+	 * Stored representation of an element: float32 coordinates when
+	 * quantization is off, otherwise the encoded form (see encodePoint).
+	 */
+	inline char *getDataByInternalId(idx_t internal_id) const {
+		return (char *)&data_level0_memory[internal_id * size_data_per_element + offset_data];
 	}
 
 	inline idx_t *get_linklist0(idx_t internal_id) const {
@@ -55,15 +106,63 @@ struct HierarchicalNSW
 		return (label_t *)&data_level0_memory[internal_id * size_data_per_element + offset_label];
 	}
 
-	std::priority_queue<std::pair<dist_t, idx_t>> searchBaseLayer(const coord_t *x, size_t ef);
+	/* Per-element header: [0] = node level, [1] = offset in upper-link arena */
+	inline idx_t *getLevelHeader(idx_t internal_id) const {
+		return (idx_t *)&data_level0_memory[internal_id * size_data_per_element + offset_level];
+	}
 
-	void getNeighborsByHeuristic(std::priority_queue<std::pair<dist_t, idx_t>> &topResults, size_t NN);
+	inline int getLevel(idx_t internal_id) const {
+		return (int)getLevelHeader(internal_id)[0];
+	}
 
-	void mutuallyConnectNewElement(const coord_t *x, idx_t id, std::priority_queue<std::pair<dist_t, idx_t>> topResults);
+	inline uint32_t *linkLock(idx_t internal_id) {
+		return &link_locks[internal_id & (HNSW_LOCK_STRIPES - 1)];
+	}
+
+	inline idx_t *get_linklist(idx_t internal_id, int level) const {
+		if (level == 0)
+			return get_linklist0(internal_id);
+		return (idx_t *)&data_level0_memory[upper_arena_offset]
+			+ getLevelHeader(internal_id)[1] + (level - 1) * (M + 1);
+	}
+
+	int  randomLevel(void);
+
+	/*
+	 * Leaves the ef closest elements as a max-heap in the per-backend
+	 * search context (see HnswSearchContext in hnswalg.cpp).
+	 */
+	void searchLayer(const coord_t *x, size_t ef, int level, idx_t ep);
+
+	idx_t greedyDescent(const coord_t *x, idx_t ep, int level_from, int level_to);
+
+	void getNeighborsByHeuristic(std::vector<std::pair<dist_t, idx_t>> &topResults, size_t NN);
+
+	idx_t mutuallyConnectNewElement(const coord_t *x, idx_t id, std::vector<std::pair<dist_t, idx_t>> &topResults, int level);
 
 	void addPoint(const coord_t *point, label_t label);
 
 	std::priority_queue<std::pair<dist_t, label_t>> searchKnn(const coord_t *query_data, size_t k);
 
-	dist_t fstdistfunc(const coord_t *x, const coord_t *y);
+	/* Encode a full-precision vector into the element's storage slot */
+	void encodePoint(const coord_t *point, idx_t internal_id);
+
+	/* Reconstruct a full-precision vector from the stored representation */
+	void decodeStored(idx_t internal_id, coord_t *out);
+
+	/* Pick the kernel matching this index's quantization and the host CPU */
+	hnsw_dist_func_t resolveKernel(void);
+
+	/* Distance from a full-precision query to the stored representation */
+	dist_t fstdistfunc(const coord_t *x, const char *stored);
+
+	/* Distance between two stored elements (decodes one side if quantized) */
+	dist_t fstdistfunc_stored(idx_t a, idx_t b);
+
+	/*
+	 * Compute distances from one query to n stored elements in one call.
+	 * Amortizes kernel dispatch over the whole adjacency list and prefetches
+	 * the next element's data while the current one is being processed.
+	 */
+	void fstdistfunc_batch(const coord_t *x, const idx_t *ids, size_t n, dist_t *dists);
 };
@@ -0,0 +1,21 @@
+SET enable_seqscan = off;
+
+CREATE TABLE tq (val real[]);
+INSERT INTO tq (val) VALUES ('{0,0,0}'), ('{1,2,3}'), ('{1,1,1}'), (NULL);
+CREATE INDEX ON tq USING hnsw (val) WITH (maxelements = 10, dims=3, m=3, quantization=int8);
+
+INSERT INTO tq (val) VALUES (array[1,2,4]);
+
+SELECT * FROM tq ORDER BY val <-> array[3,3,3];
+
+DROP TABLE tq;
+
+CREATE TABLE th (val real[]);
+INSERT INTO th (val) VALUES ('{0,0,0}'), ('{1,2,3}'), ('{1,1,1}'), (NULL);
+CREATE INDEX ON th USING hnsw (val) WITH (maxelements = 10, dims=3, m=3, quantization=fp16);
+
+INSERT INTO th (val) VALUES (array[1,2,4]);
+
+SELECT * FROM th ORDER BY val <-> array[3,3,3];
+
+DROP TABLE th;
@@ -13,6 +13,12 @@
  *        accumulate changes. On subtransaction commit, the top of the stack
  *        is merged with the table below it.
  *
+ *        The commit hook only serializes the accumulated changes and puts
+ *        them in a shared-memory queue; the HTTP delivery, with its retries
+ *        and timeouts, is done by the DDL forwarder background worker, so
+ *        a slow console does not add to DDL commit latency. When the queue
+ *        is full the commit falls back to sending synchronously.
+ *
  * IDENTIFICATION
  *	 contrib/neon/control_plane_connector.c
  *
@@ -26,6 +32,14 @@
 #include "utils/memutils.h"
 #include "commands/defrem.h"
 #include "miscadmin.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/procsignal.h"
+#include "storage/shmem.h"
 #include "utils/acl.h"
 #include "fmgr.h"
 #include "utils/guc.h"
@@ -39,6 +53,35 @@ static ProcessUtility_hook_type PreviousProcessUtilityHook = NULL;
 /* GUCs */
 static char *ConsoleURL = NULL;
 static bool ForwardDDL = true;
+static int	DdlQueueSize = 128; /* KB */
+
+/*
+ * Shared-memory queue feeding the DDL forwarder background worker. It is a
+ * byte ring of length-prefixed JSON messages; the positions only grow and
+ * are taken modulo the ring size. The head message is consumed only after
+ * it has been delivered, so a restart of the worker retries it instead of
+ * losing it.
+ */
+typedef struct DdlForwardQueue
+{
+	Latch	   *worker_latch;	/* to wake the worker, NULL if not running */
+	uint64		write_pos;		/* next byte to fill */
+	uint64		read_pos;		/* next byte to consume */
+	char		data[FLEXIBLE_ARRAY_MEMBER];
+}			DdlForwardQueue;
+
+static DdlForwardQueue * DdlQueue;
+static LWLockId DdlQueueLock;
+
+#define DDL_RETRY_MIN_BACKOFF_MS 1000
+#define DDL_RETRY_MAX_BACKOFF_MS 60000
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+static void DdlQueueShmemRequest(void);
+#endif
+void		DdlForwarderMain(Datum main_arg);
 
 /* Curl structures for sending the HTTP requests */
 static CURL * CurlHandle;
@@ -222,21 +265,16 @@ ErrorWriteCallback(char *ptr, size_t size, size_t nmemb, void *userdata)
 	return nmemb;
 }
 
-static void
-SendDeltasToControlPlane()
+/*
+ * Perform one HTTP request to the console. On failure (including a non-200
+ * answer) the reason is logged and false is returned; the caller decides
+ * whether and when to retry.
+ */
+static bool
+SendDeltaMessage(const char *message)
 {
-	if (!RootTable.db_table && !RootTable.role_table)
-		return;
-	if (!ConsoleURL)
-	{
-		elog(LOG, "ConsoleURL not set, skipping forwarding");
-		return;
-	}
-	if (!ForwardDDL)
-		return;
-
-	char	   *message = ConstructDeltaMessage();
 	ErrorString str = {};
+	long		response_code;
 
 	curl_easy_setopt(CurlHandle, CURLOPT_CUSTOMREQUEST, "PATCH");
 	curl_easy_setopt(CurlHandle, CURLOPT_HTTPHEADER, ContentHeader);
@@ -247,46 +285,181 @@ SendDeltasToControlPlane()
 	curl_easy_setopt(CurlHandle, CURLOPT_WRITEDATA, &str);
 	curl_easy_setopt(CurlHandle, CURLOPT_WRITEFUNCTION, ErrorWriteCallback);
 
-	const int	num_retries = 5;
-	int			curl_status;
-
-	for (int i = 0; i < num_retries; i++)
+	if (curl_easy_perform(CurlHandle) != 0)
 	{
-		if ((curl_status = curl_easy_perform(CurlHandle)) == 0)
-			break;
-		elog(LOG, "Curl request failed on attempt %d: %s", i, CurlErrorBuf);
-		pg_usleep(1000 * 1000);
+		elog(LOG, "Curl request failed: %s", CurlErrorBuf);
+		return false;
 	}
-	if (curl_status != 0)
+	if (curl_easy_getinfo(CurlHandle, CURLINFO_RESPONSE_CODE, &response_code) != CURLE_UNKNOWN_OPTION
+		&& response_code != 200)
 	{
-		elog(ERROR, "Failed to perform curl request: %s", CurlErrorBuf);
+		if (str.size != 0)
+			elog(LOG,
+				 "Received HTTP code %ld from control plane: %s",
+				 response_code,
+				 str.str);
+		else
+			elog(LOG,
+				 "Received HTTP code %ld from control plane",
+				 response_code);
+		return false;
 	}
-	else
+	return true;
+}
+
+static Size
+DdlQueueBytes(void)
+{
+	return (Size) DdlQueueSize * 1024;
+}
+
+/* Copy into/out of the ring, handling the wraparound */
+static void
+DdlQueueCopyIn(uint64 pos, const char *src, Size len)
+{
+	Size		offs = pos % DdlQueueBytes();
+	Size		chunk = Min(len, DdlQueueBytes() - offs);
+
+	memcpy(DdlQueue->data + offs, src, chunk);
+	memcpy(DdlQueue->data, src + chunk, len - chunk);
+}
+
+static void
+DdlQueueCopyOut(char *dst, uint64 pos, Size len)
+{
+	Size		offs = pos % DdlQueueBytes();
+	Size		chunk = Min(len, DdlQueueBytes() - offs);
+
+	memcpy(dst, DdlQueue->data + offs, chunk);
+	memcpy(dst + chunk, DdlQueue->data, len - chunk);
+}
+
+/*
+ * Hand the message over to the DDL forwarder. Returns false if it does not
+ * fit in the queue or the worker is not running, in which case the caller
+ * sends it itself.
+ */
+static bool
+EnqueueDeltaMessage(const char *message)
+{
+	Size		len = strlen(message) + 1;
+	uint32		len32 = (uint32) len;
+	bool		enqueued = false;
+
+	if (!DdlQueue)
+		return false;
+
+	LWLockAcquire(DdlQueueLock, LW_EXCLUSIVE);
+	if (DdlQueue->worker_latch != NULL &&
+		sizeof(uint32) + len <= DdlQueueBytes() - (DdlQueue->write_pos - DdlQueue->read_pos))
 	{
-		long		response_code;
+		DdlQueueCopyIn(DdlQueue->write_pos, (char *) &len32, sizeof(uint32));
+		DdlQueueCopyIn(DdlQueue->write_pos + sizeof(uint32), message, len);
+		DdlQueue->write_pos += sizeof(uint32) + len;
+		SetLatch(DdlQueue->worker_latch);
+		enqueued = true;
+	}
+	LWLockRelease(DdlQueueLock);
+	return enqueued;
+}
+
+/*
+ * DDL forwarder: delivers queued messages to the console, retrying with
+ * exponential backoff while it has trouble. The head message is consumed
+ * only after a successful delivery.
+ */
+void
+DdlForwarderMain(Datum main_arg)
+{
+	long		backoff_ms = 0;
+
+	/* Establish signal handlers. */
+	pqsignal(SIGUSR1, procsignal_sigusr1_handler);
+	pqsignal(SIGHUP, SignalHandlerForConfigReload);
+	pqsignal(SIGTERM, SignalHandlerForShutdownRequest);
+	BackgroundWorkerUnblockSignals();
+
+	LWLockAcquire(DdlQueueLock, LW_EXCLUSIVE);
+	DdlQueue->worker_latch = MyLatch;
+	LWLockRelease(DdlQueueLock);
 
-		if (curl_easy_getinfo(CurlHandle, CURLINFO_RESPONSE_CODE, &response_code) != CURLE_UNKNOWN_OPTION)
+	while (!ShutdownRequestPending)
+	{
+		char	   *message = NULL;
+		uint32		len = 0;
+
+		LWLockAcquire(DdlQueueLock, LW_SHARED);
+		if (DdlQueue->read_pos != DdlQueue->write_pos)
 		{
-			bool		error_exists = str.size != 0;
+			DdlQueueCopyOut((char *) &len, DdlQueue->read_pos, sizeof(uint32));
+			message = palloc(len);
+			DdlQueueCopyOut(message, DdlQueue->read_pos + sizeof(uint32), len);
+		}
+		LWLockRelease(DdlQueueLock);
 
-			if (response_code != 200)
-			{
-				if (error_exists)
-				{
-					elog(ERROR,
-						 "Received HTTP code %ld from control plane: %s",
-						 response_code,
-						 str.str);
-				}
-				else
-				{
-					elog(ERROR,
-						 "Received HTTP code %ld from control plane",
-						 response_code);
-				}
-			}
+		if (message == NULL)
+		{
+			(void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+							 1000, PG_WAIT_EXTENSION);
+			ResetLatch(MyLatch);
+			continue;
+		}
+
+		if (SendDeltaMessage(message))
+		{
+			LWLockAcquire(DdlQueueLock, LW_EXCLUSIVE);
+			DdlQueue->read_pos += sizeof(uint32) + len;
+			LWLockRelease(DdlQueueLock);
+			backoff_ms = 0;
+		}
+		else
+		{
+			backoff_ms = backoff_ms == 0
+				? DDL_RETRY_MIN_BACKOFF_MS
+				: Min(backoff_ms * 2, DDL_RETRY_MAX_BACKOFF_MS);
+			(void) WaitLatch(MyLatch, WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+							 backoff_ms, PG_WAIT_EXTENSION);
 		}
+		pfree(message);
+	}
+
+	LWLockAcquire(DdlQueueLock, LW_EXCLUSIVE);
+	DdlQueue->worker_latch = NULL;
+	LWLockRelease(DdlQueueLock);
+}
+
+static void
+SendDeltasToControlPlane()
+{
+	if (!RootTable.db_table && !RootTable.role_table)
+		return;
+	if (!ConsoleURL)
+	{
+		elog(LOG, "ConsoleURL not set, skipping forwarding");
+		return;
+	}
+	if (!ForwardDDL)
+		return;
+
+	char	   *message = ConstructDeltaMessage();
+
+	/*
+	 * Hand the message to the DDL forwarder so that commit latency does not
+	 * depend on the console. If the queue is full or the worker is not
+	 * running, fall back to sending synchronously, as we used to.
+	 */
+	if (EnqueueDeltaMessage(message))
+		return;
+
+	const int	num_retries = 5;
+
+	for (int i = 0; i < num_retries; i++)
+	{
+		if (SendDeltaMessage(message))
+			return;
+		pg_usleep(1000 * 1000);
 	}
+	elog(ERROR, "Failed to forward DDL to the control plane after %d attempts", num_retries);
 }
 
 static void
@@ -781,6 +954,60 @@ NeonProcessUtility(
 	}
 }
 
+static void
+DdlQueueShmemStartup(void)
+{
+	bool		found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	DdlQueueLock = (LWLockId) GetNamedLWLockTranche("neon_ddl_queue");
+	DdlQueue = (DdlForwardQueue *)
+		ShmemInitStruct("neon_ddl_queue",
+						offsetof(DdlForwardQueue, data) + DdlQueueBytes(),
+						&found);
+	if (!found)
+	{
+		DdlQueue->worker_latch = NULL;
+		DdlQueue->write_pos = 0;
+		DdlQueue->read_pos = 0;
+	}
+	LWLockRelease(AddinShmemInitLock);
+}
+
+#if PG_VERSION_NUM >= 150000
+static void
+DdlQueueShmemRequest(void)
+{
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+
+	RequestAddinShmemSpace(offsetof(DdlForwardQueue, data) + DdlQueueBytes());
+	RequestNamedLWLockTranche("neon_ddl_queue", 1);
+}
+#endif
+
+static void
+RegisterDdlForwarder(void)
+{
+	BackgroundWorker bgw;
+
+	memset(&bgw, 0, sizeof(bgw));
+	bgw.bgw_flags = BGWORKER_SHMEM_ACCESS;
+	bgw.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	snprintf(bgw.bgw_library_name, BGW_MAXLEN, "neon");
+	snprintf(bgw.bgw_function_name, BGW_MAXLEN, "DdlForwarderMain");
+	snprintf(bgw.bgw_name, BGW_MAXLEN, "DDL forwarder");
+	snprintf(bgw.bgw_type, BGW_MAXLEN, "DDL forwarder");
+	bgw.bgw_restart_time = 5;
+	bgw.bgw_notify_pid = 0;
+	bgw.bgw_main_arg = (Datum) 0;
+
+	RegisterBackgroundWorker(&bgw);
+}
+
 extern void
 InitControlPlaneConnector()
 {
@@ -813,6 +1040,36 @@ InitControlPlaneConnector()
 							 NULL,
 							 NULL);
 
+	DefineCustomIntVariable(
+							"neon.ddl_queue_size",
+							"Size of the queue for asynchronous forwarding of DDL to the control plane",
+							"Zero makes transactions forward their changes synchronously at commit",
+							&DdlQueueSize,
+							128,
+							0,
+							1024 * 1024,
+							PGC_POSTMASTER,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	if (DdlQueueSize > 0)
+	{
+		RegisterDdlForwarder();
+
+#if PG_VERSION_NUM >= 150000
+		prev_shmem_request_hook = shmem_request_hook;
+		shmem_request_hook = DdlQueueShmemRequest;
+#else
+		RequestAddinShmemSpace(offsetof(DdlForwardQueue, data) + DdlQueueBytes());
+		RequestNamedLWLockTranche("neon_ddl_queue", 1);
+#endif
+
+		prev_shmem_startup_hook = shmem_startup_hook;
+		shmem_startup_hook = DdlQueueShmemStartup;
+	}
+
 	const char *jwt_token = getenv("NEON_CONTROL_PLANE_TOKEN");
 
 	if (!jwt_token)
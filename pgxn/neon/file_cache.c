@@ -14,7 +14,9 @@
  */
 
 #include <sys/file.h>
+#include <sys/stat.h>
 #include <sys/statvfs.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <fcntl.h>
 
@@ -24,6 +26,9 @@
 #include "pgstat.h"
 #include "pagestore_client.h"
 #include "access/parallel.h"
+#include "access/xlog.h"
+#include "catalog/pg_control.h"
+#include "common/controldata_utils.h"
 #include "postmaster/bgworker.h"
 #include "storage/relfilenode.h"
 #include "storage/buf_internals.h"
@@ -42,13 +47,13 @@
 /*
  * Local file cache is used to temporary store relations pages in local file system.
  * All blocks of all relations are stored inside one file and addressed using shared hash map.
- * Currently LRU eviction policy based on L2 list is used as replacement algorithm.
- * As far as manipulation of L2-list requires global critical section, we are not using partitioned hash.
- * Also we are using exclusive lock even for read operation because LRU requires relinking element in L2 list.
- * If this lock become a bottleneck, we can consider other eviction strategies, for example clock algorithm.
+ * Chunks are replaced with a second-chance (clock) scheme: a hit only sets the entry's
+ * reference bit, so the read path never relinks list elements, and the per-partition
+ * circular list is swept for victims only when a new chunk has to be allocated.
  *
- * Cache is always reconstructed at node startup, so we do not need to save mapping somewhere and worry about
- * its consistency.
+ * By default cache is reconstructed at node startup, so we do not need to save mapping somewhere and worry about
+ * its consistency. When neon.file_cache_persistent is enabled, the chunk directory is dumped to a sidecar file
+ * at shutdown and restored at startup if it can be proven valid against the control file (see lfc_restore_state).
  */
 
 /* Local file storage allocation chunk.
@@ -66,30 +71,120 @@
 #define MAX_MONITOR_INTERVAL_USEC 1000000 /* 1 second */
 #define MAX_DISK_WRITE_RATE       1000 /* MB/sec */
 
+/*
+ * The hash is partitioned the same way as the buffer mapping table: entries
+ * are spread over LFC_N_PARTITIONS by their hash value and each partition is
+ * protected by its own LWLock, so backends touching chunks in different
+ * partitions never serialize. Each partition also keeps its own clock ring
+ * and chunk accounting; only allocation of new chunks at the end of the cache
+ * file is shared, through an atomic counter.
+ */
+#define LFC_N_PARTITIONS    32
+#define LFC_PARTITION(hash) ((hash) % LFC_N_PARTITIONS)
+
 typedef struct FileCacheEntry
 {
 	BufferTag	key;
 	uint32		offset;
 	uint32		access_count;
+	bool		referenced; /* clock reference bit, set on hit */
 	uint32		bitmap[BLOCKS_PER_CHUNK/32];
-	dlist_node	lru_node; /* LRU list node */
+	dlist_node	clock_node; /* node in the partition's clock ring */
 } FileCacheEntry;
 
+typedef struct FileCachePartition
+{
+	dlist_head clock; /* circular list of all entries, swept for victims second-chance style */
+	uint32 used; /* number of used chunks in this partition */
+
+	/*
+	 * Statistics, updated under the partition lock that the operation holds
+	 * anyway and summed over the partitions by neon_get_lfc_stats.
+	 */
+	uint64 hits;
+	uint64 misses;
+	uint64 writes;
+	uint64 evictions;
+} FileCachePartition;
+
 typedef struct FileCacheControl
 {
-	uint32 size; /* size of cache file in chunks */
-	uint32 used; /* number of used chunks */
-	dlist_head lru; /* double linked list for LRU replacement algorithm */
+	pg_atomic_uint32 size; /* size of cache file in chunks */
+	bool frozen; /* stop populating cache: set before dumping state at shutdown */
+	uint32 stage_seqno; /* sequence number for staging slot allocation */
+	Latch* writer_latch; /* latch of the file cache writer, if it is running */
+	FileCachePartition partitions[LFC_N_PARTITIONS];
 } FileCacheControl;
 
+/*
+ * Persistent cache state: sidecar file written next to the cache file at
+ * shutdown, describing which chunks of the cache file hold which blocks.
+ * Entry offsets reference the cache file as it was at dump time, so the cache
+ * file itself must not be unlinked at startup when restore succeeds.
+ */
+#define LFC_STATE_MAGIC   0x4C464331 /* "LFC1" */
+#define LFC_STATE_VERSION 1
+
+typedef struct FileCacheStateHeader
+{
+	uint32		magic;
+	uint32		version;
+	uint64		system_identifier;
+	XLogRecPtr	lsn;	  /* WAL insert position at dump time */
+	uint32		size;	  /* size of cache file in chunks at dump time */
+	uint32		n_entries;
+} FileCacheStateHeader;
+
+typedef struct FileCacheStateEntry
+{
+	BufferTag	key;
+	uint32		offset;
+	uint32		bitmap[BLOCKS_PER_CHUNK/32];
+} FileCacheStateEntry;
+
+/*
+ * Asynchronous writeback: instead of doing a synchronous pwrite on the buffer
+ * eviction path, backends memcpy the page into a shared staging buffer and
+ * the file cache writer flushes whole 1Mb chunks with a single vectored
+ * pwritev. A chunk entry stays pinned (access_count) while a staging buffer
+ * is attached to it, so its file offset can not be recycled under the writer.
+ * Valid bits in the entry bitmap are set only after the data reached the
+ * cache file; until then reads of a staged block are served directly from the
+ * staging buffer.
+ *
+ * All staging state is protected by a single lfc_staging_lock; lock order is
+ * partition lock first, staging lock second.
+ */
+typedef enum FileCacheStageState
+{
+	LFC_STAGE_FREE,		/* slot is unused */
+	LFC_STAGE_FILLING,	/* slot is attached to a chunk and accepts new blocks */
+	LFC_STAGE_WRITING	/* writer is flushing the slot: no more appends */
+} FileCacheStageState;
+
+typedef struct FileCacheStagingSlot
+{
+	FileCacheStageState state;
+	BufferTag	key;	  /* chunk tag (blockNum is chunk-aligned) */
+	uint32		offset;	  /* chunk offset in cache file */
+	uint32		seqno;	  /* allocation order: slots are flushed FIFO */
+	uint32		staged[BLOCKS_PER_CHUNK/32]; /* blocks present in this slot */
+} FileCacheStagingSlot;
+
 static HTAB* lfc_hash;
 static int   lfc_desc;
-static LWLockId lfc_lock;
+static LWLockId lfc_locks[LFC_N_PARTITIONS];
+static LWLockId lfc_staging_lock;
 static int   lfc_max_size;
 static int   lfc_size_limit;
 static int   lfc_free_space_watermark;
+static bool  lfc_persistent;
+static bool  lfc_chunk_readahead;
+static int   lfc_write_buffers;
 static char* lfc_path;
 static  FileCacheControl* lfc_ctl;
+static FileCacheStagingSlot* lfc_staging;
+static char* lfc_staging_data;
 static shmem_startup_hook_type prev_shmem_startup_hook;
 #if PG_VERSION_NUM>=150000
 static shmem_request_hook_type prev_shmem_request_hook;
@@ -97,6 +192,231 @@ static shmem_request_hook_type prev_shmem_request_hook;
 static int   lfc_shrinking_factor; /* power of two by which local cache size will be shrinked when lfc_free_space_watermark is reached */
 
 void FileCacheMonitorMain(Datum main_arg);
+void FileCacheWriterMain(Datum main_arg);
+
+#define LFC_STAGING_SLOT_DATA(i) (lfc_staging_data + (size_t)(i)*BLOCKS_PER_CHUNK*BLCKSZ)
+
+/*
+ * The configured cache size is split evenly between the partitions. Round up
+ * to one chunk so that a tiny but nonzero limit doesn't disable caching.
+ */
+static inline uint32
+lfc_partition_limit(void)
+{
+	return Max(1, SIZE_MB_TO_CHUNKS(lfc_size_limit) / LFC_N_PARTITIONS);
+}
+
+/*
+ * Sweep the partition's clock ring for an eviction victim: an unpinned entry
+ * whose reference bit is not set. Entries passed over get their reference bit
+ * cleared and are moved behind the hand (tail of the list). The sweep is
+ * bounded so that a partition full of pinned entries can not loop forever;
+ * NULL is then returned and the caller allocates a new chunk instead.
+ * The victim is unlinked from the ring; caller must hold the partition lock.
+ */
+static FileCacheEntry*
+lfc_clock_sweep(FileCachePartition* part)
+{
+	int n_scanned = 0;
+
+	while (!dlist_is_empty(&part->clock) && n_scanned++ < part->used*2)
+	{
+		FileCacheEntry* victim = dlist_container(FileCacheEntry, clock_node, dlist_pop_head_node(&part->clock));
+
+		if (victim->access_count == 0 && !victim->referenced)
+			return victim;
+		victim->referenced = false;
+		dlist_push_tail(&part->clock, &victim->clock_node);
+	}
+	return NULL;
+}
+
+static char*
+lfc_state_path(void)
+{
+	return psprintf("%s.state", lfc_path);
+}
+
+/*
+ * Try to rebuild the cache directory from the sidecar state file.
+ * Called from lfc_shmem_startup in postmaster, before any backend can touch
+ * the cache, so no locking is needed here.
+ *
+ * Cached page images are trusted only if we can prove they are not stale:
+ * the control file must record a clean shutdown (so the basebackup this
+ * compute was started from contains exactly the WAL the previous instance
+ * generated) and the state must have been dumped at an LSN not past the
+ * shutdown checkpoint. The state is dumped by the free space monitor after
+ * regular backends have exited, so the only WAL generated between the dump
+ * and the shutdown checkpoint is the checkpoint itself: page writes done by
+ * the checkpointer after the dump update chunks in place with newer (but
+ * still pre-checkpoint) images, which is harmless. New chunks can not be
+ * allocated after the dump because the cache is frozen first (see lfc_write).
+ *
+ * Returns true if the cache file content is valid and the hash was rebuilt.
+ * The state file is consumed (unlinked) in any case: it only describes one
+ * incarnation of the cache file.
+ */
+static bool
+lfc_restore_state(void)
+{
+	char* state_path = lfc_state_path();
+	int fd;
+	FileCacheStateHeader hdr;
+	ControlFileData* controlFile;
+	bool crc_ok;
+	bool ok = false;
+	uint32 n_restored = 0;
+	struct stat st;
+
+	fd = BasicOpenFile(state_path, O_RDONLY);
+	if (fd < 0)
+	{
+		if (errno != ENOENT)
+			elog(LOG, "Failed to open file cache state %s: %m", state_path);
+		pfree(state_path);
+		return false;
+	}
+
+	controlFile = get_controlfile(DataDir, &crc_ok);
+
+	if (read(fd, &hdr, sizeof hdr) != sizeof hdr
+		|| hdr.magic != LFC_STATE_MAGIC
+		|| hdr.version != LFC_STATE_VERSION)
+		elog(LOG, "File cache state %s is incomplete or incompatible: cold start", state_path);
+	else if (!crc_ok
+			 || hdr.system_identifier != controlFile->system_identifier
+			 || controlFile->state != DB_SHUTDOWNED
+			 || hdr.lsn > controlFile->checkPointCopy.redo)
+		elog(LOG, "File cache state %s does not match a clean shutdown at this LSN: cold start", state_path);
+	else if (hdr.size > SIZE_MB_TO_CHUNKS(lfc_max_size))
+		elog(LOG, "File cache state %s does not fit in neon.max_file_cache_size: cold start", state_path);
+	else if (stat(lfc_path, &st) < 0
+			 || st.st_size < (off_t)hdr.size*BLOCKS_PER_CHUNK*BLCKSZ)
+		elog(LOG, "File cache %s is missing or shorter than its saved state: cold start", lfc_path);
+	else
+	{
+		FileCacheStateEntry fse;
+
+		while (n_restored < hdr.n_entries
+			   && read(fd, &fse, sizeof fse) == sizeof fse
+			   && fse.offset < hdr.size)
+		{
+			uint32 hash = get_hash_value(lfc_hash, &fse.key);
+			uint32 part = LFC_PARTITION(hash);
+			bool found;
+			FileCacheEntry* entry = hash_search_with_hash_value(lfc_hash, &fse.key, hash, HASH_ENTER, &found);
+
+			if (!found)
+			{
+				entry->offset = fse.offset;
+				entry->access_count = 0;
+				entry->referenced = false;
+				memcpy(entry->bitmap, fse.bitmap, sizeof entry->bitmap);
+				dlist_push_tail(&lfc_ctl->partitions[part].clock, &entry->clock_node);
+				lfc_ctl->partitions[part].used += 1;
+			}
+			n_restored += 1;
+		}
+		ok = n_restored == hdr.n_entries;
+		if (ok)
+		{
+			pg_atomic_write_u32(&lfc_ctl->size, hdr.size);
+			elog(LOG, "Restored %u chunks of local file cache from %s", n_restored, state_path);
+		}
+		else
+		{
+			/* Truncated or corrupt state: drop whatever was inserted and start cold */
+			HASH_SEQ_STATUS status;
+			FileCacheEntry* entry;
+
+			elog(LOG, "File cache state %s is truncated: restored %u of %u entries",
+				 state_path, n_restored, hdr.n_entries);
+			hash_seq_init(&status, lfc_hash);
+			while ((entry = hash_seq_search(&status)) != NULL)
+				hash_search(lfc_hash, &entry->key, HASH_REMOVE, NULL);
+			for (int i = 0; i < LFC_N_PARTITIONS; i++)
+			{
+				lfc_ctl->partitions[i].used = 0;
+				dlist_init(&lfc_ctl->partitions[i].clock);
+			}
+		}
+	}
+	pfree(controlFile);
+	close(fd);
+	(void)unlink(state_path);
+	pfree(state_path);
+	return ok;
+}
+
+/*
+ * Dump the cache directory to the sidecar state file. Called from the free
+ * space monitor on shutdown, after the cache has been frozen: entries can
+ * still be updated in place, but no chunk can be allocated or recycled, so
+ * the dumped offsets stay valid until the postmaster exits.
+ */
+static void
+lfc_save_state(void)
+{
+	char* state_path = lfc_state_path();
+	char* temp_path = psprintf("%s.tmp", state_path);
+	int fd;
+	FileCacheStateHeader hdr;
+	HASH_SEQ_STATUS status;
+	FileCacheEntry* entry;
+	bool failed = false;
+
+	fd = BasicOpenFile(temp_path, O_RDWR|O_CREAT|O_TRUNC);
+	if (fd < 0)
+	{
+		elog(LOG, "Failed to create file cache state %s: %m", temp_path);
+		pfree(temp_path);
+		pfree(state_path);
+		return;
+	}
+
+	hdr.magic = LFC_STATE_MAGIC;
+	hdr.version = LFC_STATE_VERSION;
+	hdr.system_identifier = GetSystemIdentifier();
+	hdr.lsn = GetXLogInsertRecPtr();
+	hdr.size = pg_atomic_read_u32(&lfc_ctl->size);
+	hdr.n_entries = 0;
+	for (int i = 0; i < LFC_N_PARTITIONS; i++)
+		hdr.n_entries += lfc_ctl->partitions[i].used;
+
+	if (write(fd, &hdr, sizeof hdr) != sizeof hdr)
+		failed = true;
+
+	hash_seq_init(&status, lfc_hash);
+	while (!failed && (entry = hash_seq_search(&status)) != NULL)
+	{
+		FileCacheStateEntry fse;
+
+		fse.key = entry->key;
+		fse.offset = entry->offset;
+		memcpy(fse.bitmap, entry->bitmap, sizeof fse.bitmap);
+		if (write(fd, &fse, sizeof fse) != sizeof fse)
+		{
+			failed = true;
+			hash_seq_term(&status);
+		}
+	}
+
+	if (failed || pg_fsync(fd) < 0)
+	{
+		elog(LOG, "Failed to write file cache state %s: %m", temp_path);
+		close(fd);
+		(void)unlink(temp_path);
+	}
+	else
+	{
+		close(fd);
+		if (durable_rename(temp_path, state_path, LOG) == 0)
+			elog(LOG, "Saved %u chunks of local file cache state to %s", hdr.n_entries, state_path);
+	}
+	pfree(temp_path);
+	pfree(state_path);
+}
 
 static void
 lfc_shmem_startup(void)
@@ -115,20 +435,44 @@ lfc_shmem_startup(void)
 	if (!found)
 	{
 		uint32 lfc_size = SIZE_MB_TO_CHUNKS(lfc_max_size);
-		lfc_lock = (LWLockId)GetNamedLWLockTranche("lfc_lock");
+		LWLockPadded *locks = GetNamedLWLockTranche("lfc_lock");
+
+		for (int i = 0; i < LFC_N_PARTITIONS; i++)
+			lfc_locks[i] = &locks[i].lock;
+		lfc_staging_lock = &GetNamedLWLockTranche("lfc_staging_lock")[0].lock;
 		info.keysize = sizeof(BufferTag);
 		info.entrysize = sizeof(FileCacheEntry);
+		info.num_partitions = LFC_N_PARTITIONS;
 		lfc_hash = ShmemInitHash("lfc_hash",
 								 /* lfc_size+1 because we add new element to hash table before eviction of victim */
 								 lfc_size+1, lfc_size+1,
 								 &info,
-								 HASH_ELEM | HASH_BLOBS);
-		lfc_ctl->size = 0;
-		lfc_ctl->used = 0;
-		dlist_init(&lfc_ctl->lru);
+								 HASH_ELEM | HASH_BLOBS | HASH_PARTITION);
+		pg_atomic_init_u32(&lfc_ctl->size, 0);
+		lfc_ctl->frozen = false;
+		lfc_ctl->stage_seqno = 0;
+		lfc_ctl->writer_latch = NULL;
+		for (int i = 0; i < LFC_N_PARTITIONS; i++)
+		{
+			FileCachePartition *part = &lfc_ctl->partitions[i];
+
+			part->used = 0;
+			dlist_init(&part->clock);
+			part->hits = part->misses = part->writes = part->evictions = 0;
+		}
+		if (lfc_write_buffers > 0)
+		{
+			lfc_staging = (FileCacheStagingSlot*)ShmemInitStruct("lfc_staging",
+																 sizeof(FileCacheStagingSlot)*lfc_write_buffers, &found);
+			lfc_staging_data = (char*)ShmemInitStruct("lfc_staging_data",
+													  (size_t)lfc_write_buffers*BLOCKS_PER_CHUNK*BLCKSZ, &found);
+			for (int i = 0; i < lfc_write_buffers; i++)
+				lfc_staging[i].state = LFC_STAGE_FREE;
+		}
 
-		/* Remove file cache on restart */
-		(void)unlink(lfc_path);
+		/* Remove file cache on restart unless its saved state could be restored */
+		if (!lfc_persistent || !lfc_restore_state())
+			(void)unlink(lfc_path);
 	}
 	LWLockRelease(AddinShmemInitLock);
 }
@@ -142,7 +486,10 @@ lfc_shmem_request(void)
 #endif
 
 	RequestAddinShmemSpace(sizeof(FileCacheControl) + hash_estimate_size(SIZE_MB_TO_CHUNKS(lfc_max_size)+1, sizeof(FileCacheEntry)));
-	RequestNamedLWLockTranche("lfc_lock", 1);
+	if (lfc_write_buffers > 0)
+		RequestAddinShmemSpace(lfc_write_buffers*(sizeof(FileCacheStagingSlot) + (size_t)BLOCKS_PER_CHUNK*BLCKSZ));
+	RequestNamedLWLockTranche("lfc_lock", LFC_N_PARTITIONS);
+	RequestNamedLWLockTranche("lfc_staging_lock", 1);
 }
 
 static bool
@@ -177,21 +524,41 @@ lfc_change_limit_hook(int newval, void *extra)
 			return;
 		}
 	}
-	LWLockAcquire(lfc_lock, LW_EXCLUSIVE);
-	while (new_size < lfc_ctl->used && !dlist_is_empty(&lfc_ctl->lru))
+	/*
+	 * Shrink each partition to its share of the new limit in turn. A forced
+	 * shrink ignores reference bits and discards any unpinned chunk in clock
+	 * order; entries pinned by in-flight IO are skipped (the scan is bounded
+	 * so that a partition full of pinned entries can not loop forever) and
+	 * survive, just as before partitioning.
+	 */
+	for (int i = 0; i < LFC_N_PARTITIONS; i++)
 	{
-		/* Shrink cache by throwing away least recently accessed chunks and returning their space to file system */
-		FileCacheEntry* victim = dlist_container(FileCacheEntry, lru_node, dlist_pop_head_node(&lfc_ctl->lru));
-		Assert(victim->access_count == 0);
+		FileCachePartition *part = &lfc_ctl->partitions[i];
+		uint32 n_scanned = 0;
+
+		LWLockAcquire(lfc_locks[i], LW_EXCLUSIVE);
+		while (part->used > new_size / LFC_N_PARTITIONS && !dlist_is_empty(&part->clock)
+			   && n_scanned++ < part->used*2)
+		{
+			/* Shrink cache by throwing away chunks and returning their space to file system */
+			FileCacheEntry* victim = dlist_container(FileCacheEntry, clock_node, dlist_pop_head_node(&part->clock));
+
+			if (victim->access_count > 0)
+			{
+				dlist_push_tail(&part->clock, &victim->clock_node);
+				continue;
+			}
 #ifdef FALLOC_FL_PUNCH_HOLE
-		if (fallocate(lfc_desc, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, (off_t)victim->offset*BLOCKS_PER_CHUNK*BLCKSZ, BLOCKS_PER_CHUNK*BLCKSZ) < 0)
-			elog(LOG, "Failed to punch hole in file: %m");
+			if (fallocate(lfc_desc, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, (off_t)victim->offset*BLOCKS_PER_CHUNK*BLCKSZ, BLOCKS_PER_CHUNK*BLCKSZ) < 0)
+				elog(LOG, "Failed to punch hole in file: %m");
 #endif
-		hash_search(lfc_hash, &victim->key, HASH_REMOVE, NULL);
-		lfc_ctl->used -= 1;
+			hash_search(lfc_hash, &victim->key, HASH_REMOVE, NULL);
+			part->used -= 1;
+			part->evictions += 1;
+		}
+		LWLockRelease(lfc_locks[i]);
 	}
 	elog(DEBUG1, "set local file cache limit to %d", new_size);
-	LWLockRelease(lfc_lock);
 }
 
 /*
@@ -215,7 +582,9 @@ FileCacheMonitorMain(Datum main_arg)
 	 * Choose file system state monitor interval so that space can not be exosted
 	 * during this period but not longer than  MAX_MONITOR_INTERVAL (10 sec)
 	 */
-	uint64 monitor_interval = Min(MAX_MONITOR_INTERVAL_USEC, lfc_free_space_watermark*MB/MAX_DISK_WRITE_RATE);
+	uint64 monitor_interval = lfc_free_space_watermark != 0
+		? Min(MAX_MONITOR_INTERVAL_USEC, lfc_free_space_watermark*MB/MAX_DISK_WRITE_RATE)
+		: MAX_MONITOR_INTERVAL_USEC; /* worker kept alive only to dump cache state at shutdown */
 
 	/* Establish signal handlers. */
 	pqsignal(SIGUSR1, procsignal_sigusr1_handler);
@@ -248,6 +617,239 @@ FileCacheMonitorMain(Datum main_arg)
 		}
 		pg_usleep(monitor_interval);
 	}
+
+	/*
+	 * Dump cache state for the next incarnation of this compute. Freeze the
+	 * cache first so that the checkpointer, which flushes dirty buffers after
+	 * this worker exits, can not reshuffle chunks behind the dump's back.
+	 */
+	if (lfc_persistent && lfc_size_limit != 0 && lfc_ctl)
+	{
+		for (int i = 0; i < LFC_N_PARTITIONS; i++)
+			LWLockAcquire(lfc_locks[i], LW_EXCLUSIVE);
+		lfc_ctl->frozen = true;
+		lfc_save_state();
+		for (int i = 0; i < LFC_N_PARTITIONS; i++)
+			LWLockRelease(lfc_locks[i]);
+	}
+}
+
+/*
+ * Flush one staging slot to the cache file with a vectored write per run of
+ * consecutive staged blocks, then publish the valid bits and release both the
+ * slot and its pin on the chunk entry. The slot was already marked WRITING by
+ * the caller, so no new blocks can be appended, but a concurrent lfc_evict
+ * can still clear staged bits: the bits published in the entry bitmap are
+ * re-read after the write so that an evicted block is never marked valid.
+ */
+static void
+lfc_flush_staging_slot(FileCacheStagingSlot* slot)
+{
+	char* base = LFC_STAGING_SLOT_DATA(slot - lfc_staging);
+	uint32 staged[BLOCKS_PER_CHUNK/32];
+	uint32 hash;
+	uint32 part;
+	FileCacheEntry* entry;
+	bool ok = true;
+
+	LWLockAcquire(lfc_staging_lock, LW_SHARED);
+	memcpy(staged, slot->staged, sizeof staged);
+	LWLockRelease(lfc_staging_lock);
+
+	/* Open cache file if not done yet */
+	if (lfc_desc == 0)
+	{
+		lfc_desc = BasicOpenFile(lfc_path, O_RDWR|O_CREAT);
+		if (lfc_desc < 0) {
+			elog(LOG, "Failed to open file cache %s: %m", lfc_path);
+			lfc_size_limit = 0; /* disable file cache */
+		}
+	}
+	if (lfc_desc > 0)
+	{
+		struct iovec iov[BLOCKS_PER_CHUNK];
+		int i = 0;
+
+		while (i < BLOCKS_PER_CHUNK && ok)
+		{
+			int j;
+
+			if (!(staged[i >> 5] & (1 << (i & 31))))
+			{
+				i += 1;
+				continue;
+			}
+			/* Coalesce run of consecutive staged blocks into one vectored write */
+			for (j = i; j < BLOCKS_PER_CHUNK && (staged[j >> 5] & (1 << (j & 31))); j++)
+			{
+				iov[j-i].iov_base = base + (size_t)j*BLCKSZ;
+				iov[j-i].iov_len = BLCKSZ;
+			}
+			if (pwritev(lfc_desc, iov, j-i, ((off_t)slot->offset*BLOCKS_PER_CHUNK + i)*BLCKSZ) != (ssize_t)(j-i)*BLCKSZ)
+			{
+				elog(INFO, "Failed to write file cache: %m");
+				lfc_size_limit = 0; /* disable file cache */
+				ok = false;
+			}
+			i = j;
+		}
+	}
+	else
+		ok = false;
+
+	hash = get_hash_value(lfc_hash, &slot->key);
+	part = LFC_PARTITION(hash);
+	LWLockAcquire(lfc_locks[part], LW_EXCLUSIVE);
+	LWLockAcquire(lfc_staging_lock, LW_EXCLUSIVE);
+	/* The slot's pin guarantees that the entry is still there */
+	entry = hash_search_with_hash_value(lfc_hash, &slot->key, hash, HASH_FIND, NULL);
+	Assert(entry != NULL);
+	if (ok)
+	{
+		for (int i = 0; i < BLOCKS_PER_CHUNK/32; i++)
+			entry->bitmap[i] |= slot->staged[i];
+	}
+	slot->state = LFC_STAGE_FREE;
+	LWLockRelease(lfc_staging_lock);
+	Assert(entry->access_count > 0);
+	entry->access_count -= 1;
+	LWLockRelease(lfc_locks[part]);
+}
+
+/*
+ * Local file cache writer: flushes staging slots filled by lfc_write.
+ * Slots are flushed in allocation order, so when the same block was staged
+ * twice (in two slots of the same chunk) the newer version reaches the cache
+ * file last.
+ */
+void
+FileCacheWriterMain(Datum main_arg)
+{
+	/* Establish signal handlers. */
+	pqsignal(SIGUSR1, procsignal_sigusr1_handler);
+	pqsignal(SIGHUP, SignalHandlerForConfigReload);
+	pqsignal(SIGTERM, SignalHandlerForShutdownRequest);
+	BackgroundWorkerUnblockSignals();
+
+	LWLockAcquire(lfc_staging_lock, LW_EXCLUSIVE);
+	lfc_ctl->writer_latch = MyLatch;
+	LWLockRelease(lfc_staging_lock);
+
+	for (;;)
+	{
+		FileCacheStagingSlot* slot = NULL;
+
+		LWLockAcquire(lfc_staging_lock, LW_EXCLUSIVE);
+		for (int i = 0; i < lfc_write_buffers; i++)
+		{
+			FileCacheStagingSlot* s = &lfc_staging[i];
+			if (s->state == LFC_STAGE_FILLING
+				&& (slot == NULL || (int32)(s->seqno - slot->seqno) < 0))
+				slot = s;
+		}
+		if (slot)
+			slot->state = LFC_STAGE_WRITING;
+		LWLockRelease(lfc_staging_lock);
+
+		if (slot)
+		{
+			lfc_flush_staging_slot(slot);
+			continue; /* drain remaining slots before sleeping */
+		}
+		if (ShutdownRequestPending)
+			break;
+		(void)WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+						100, PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+	}
+
+	LWLockAcquire(lfc_staging_lock, LW_EXCLUSIVE);
+	lfc_ctl->writer_latch = NULL;
+	LWLockRelease(lfc_staging_lock);
+}
+
+/*
+ * Put page in a staging slot for the file cache writer instead of writing it
+ * to the cache file synchronously. Returns false if all staging slots are
+ * busy, in which case the caller falls back to a synchronous write.
+ * On success *new_slot is set when a slot was attached to the chunk: the slot
+ * then holds its own pin on the entry, released by lfc_flush_staging_slot.
+ * On failure *conflict is set if an older version of this very block is
+ * still staged: it is cancelled here, but its write to the cache file may
+ * already be in flight and could land after a synchronous write of the new
+ * version, so the caller must then skip the cache file write altogether.
+ */
+static bool
+lfc_stage_write(BufferTag const* tag, uint32 offset, int chunk_offs, char const* buffer, bool* new_slot, bool* conflict)
+{
+	FileCacheStagingSlot* slot = NULL;
+	FileCacheStagingSlot* free_slot = NULL;
+
+	*new_slot = false;
+	*conflict = false;
+	LWLockAcquire(lfc_staging_lock, LW_EXCLUSIVE);
+	for (int i = 0; i < lfc_write_buffers; i++)
+	{
+		FileCacheStagingSlot* s = &lfc_staging[i];
+		if (s->state == LFC_STAGE_FILLING && BUFFERTAGS_EQUAL(s->key, *tag))
+		{
+			/* Append to the newest open slot of this chunk */
+			if (slot == NULL || (int32)(s->seqno - slot->seqno) > 0)
+				slot = s;
+		}
+		else if (s->state == LFC_STAGE_FREE && free_slot == NULL)
+			free_slot = s;
+	}
+	if (slot == NULL)
+	{
+		if (free_slot == NULL)
+		{
+			for (int i = 0; i < lfc_write_buffers; i++)
+			{
+				FileCacheStagingSlot* s = &lfc_staging[i];
+				if (s->state != LFC_STAGE_FREE && BUFFERTAGS_EQUAL(s->key, *tag)
+					&& (s->staged[chunk_offs >> 5] & (1 << (chunk_offs & 31))))
+				{
+					s->staged[chunk_offs >> 5] &= ~(1 << (chunk_offs & 31));
+					*conflict = true;
+				}
+			}
+			LWLockRelease(lfc_staging_lock);
+			return false;
+		}
+		slot = free_slot;
+		slot->state = LFC_STAGE_FILLING;
+		slot->key = *tag;
+		slot->offset = offset;
+		slot->seqno = lfc_ctl->stage_seqno++;
+		memset(slot->staged, 0, sizeof slot->staged);
+		*new_slot = true;
+	}
+	Assert(slot->offset == offset);
+	memcpy(LFC_STAGING_SLOT_DATA(slot - lfc_staging) + (size_t)chunk_offs*BLCKSZ, buffer, BLCKSZ);
+	slot->staged[chunk_offs >> 5] |= 1 << (chunk_offs & 31);
+	if (lfc_ctl->writer_latch)
+		SetLatch(lfc_ctl->writer_latch);
+	LWLockRelease(lfc_staging_lock);
+	return true;
+}
+
+static void
+lfc_register_writer(void)
+{
+	BackgroundWorker bgw;
+	memset(&bgw, 0, sizeof(bgw));
+	bgw.bgw_flags = BGWORKER_SHMEM_ACCESS;
+	bgw.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	snprintf(bgw.bgw_library_name, BGW_MAXLEN, "neon");
+	snprintf(bgw.bgw_function_name, BGW_MAXLEN, "FileCacheWriterMain");
+	snprintf(bgw.bgw_name, BGW_MAXLEN, "Local file cache writer");
+	snprintf(bgw.bgw_type, BGW_MAXLEN, "Local file cache writer");
+	bgw.bgw_restart_time = 5;
+	bgw.bgw_notify_pid = 0;
+	bgw.bgw_main_arg = (Datum) 0;
+
+	RegisterBackgroundWorker(&bgw);
 }
 
 static void
@@ -317,6 +919,41 @@ lfc_init(void)
 							NULL,
 							NULL);
 
+	DefineCustomIntVariable("neon.file_cache_write_buffers",
+							"Number of 1Mb staging buffers for asynchronous writes to Neon local file cache",
+							"Zero makes backends write to the cache file synchronously",
+							&lfc_write_buffers,
+							8,
+							0,
+							128,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("neon.file_cache_chunk_readahead",
+							 "Fetch the remaining blocks of a partially cached chunk on a file cache miss",
+							 "The missing range is requested from the pageserver with one batched request.",
+							 &lfc_chunk_readahead,
+							 true,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("neon.file_cache_persistent",
+							 "Save local file cache state at shutdown and restore it at startup",
+							 NULL,
+							 &lfc_persistent,
+							 false,
+							 PGC_POSTMASTER,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
 	DefineCustomStringVariable("neon.file_cache_path",
 							   "Path to local file cache (can be raw device)",
 							   NULL,
@@ -331,9 +968,13 @@ lfc_init(void)
 	if (lfc_max_size == 0)
 		return;
 
-	if (lfc_free_space_watermark != 0)
+	/* The monitor also dumps persistent cache state at shutdown */
+	if (lfc_free_space_watermark != 0 || lfc_persistent)
 		lfc_register_free_space_monitor();
 
+	if (lfc_write_buffers > 0)
+		lfc_register_writer();
+
 	prev_shmem_startup_hook = shmem_startup_hook;
 	shmem_startup_hook = lfc_shmem_startup;
 #if PG_VERSION_NUM>=150000
@@ -356,6 +997,7 @@ lfc_cache_contains(RelFileNode rnode, ForkNumber forkNum, BlockNumber blkno)
 	int chunk_offs = blkno & (BLOCKS_PER_CHUNK-1);
 	bool found;
 	uint32 hash;
+	uint32 part;
 
 	if (lfc_size_limit == 0) /* fast exit if file cache is disabled */
 		return false;
@@ -364,14 +1006,72 @@ lfc_cache_contains(RelFileNode rnode, ForkNumber forkNum, BlockNumber blkno)
 	tag.forkNum = forkNum;
 	tag.blockNum = blkno & ~(BLOCKS_PER_CHUNK-1);
 	hash = get_hash_value(lfc_hash, &tag);
+	part = LFC_PARTITION(hash);
 
-	LWLockAcquire(lfc_lock, LW_SHARED);
+	LWLockAcquire(lfc_locks[part], LW_SHARED);
 	entry = hash_search_with_hash_value(lfc_hash, &tag, hash, HASH_FIND, NULL);
 	found = entry != NULL && (entry->bitmap[chunk_offs >> 5] & (1 << (chunk_offs & 31))) != 0;
-	LWLockRelease(lfc_lock);
+	LWLockRelease(lfc_locks[part]);
 	return found;
 }
 
+/*
+ * Whole-chunk readahead support: if the chunk containing blkno is partially
+ * cached, set *start to the block following blkno and return the number of
+ * consecutive missing blocks from there to the next cached block (or the end
+ * of the chunk). The caller requests that range from the pageserver in one
+ * batched request, whose receive path installs the pages through lfc_write,
+ * so sequential re-scans of partially evicted data stop missing block by
+ * block. Returns 0 if the cache or chunk readahead is disabled, or if the
+ * chunk is absent, empty or fully cached.
+ */
+int
+lfc_chunk_promote_range(RelFileNode rnode, ForkNumber forkNum, BlockNumber blkno, BlockNumber* start)
+{
+	BufferTag tag;
+	FileCacheEntry* entry;
+	int chunk_offs = blkno & (BLOCKS_PER_CHUNK-1);
+	uint32 hash;
+	uint32 part;
+	int n = 0;
+
+	if (lfc_size_limit == 0 || !lfc_chunk_readahead)
+		return 0;
+
+	tag.rnode = rnode;
+	tag.forkNum = forkNum;
+	tag.blockNum = blkno & ~(BLOCKS_PER_CHUNK-1);
+	hash = get_hash_value(lfc_hash, &tag);
+	part = LFC_PARTITION(hash);
+
+	LWLockAcquire(lfc_locks[part], LW_SHARED);
+	entry = hash_search_with_hash_value(lfc_hash, &tag, hash, HASH_FIND, NULL);
+	if (entry != NULL)
+	{
+		bool any_cached = false;
+
+		for (int i = 0; i < BLOCKS_PER_CHUNK/32; i++)
+		{
+			if (entry->bitmap[i] != 0)
+			{
+				any_cached = true;
+				break;
+			}
+		}
+		if (any_cached)
+		{
+			for (int i = chunk_offs + 1;
+				 i < BLOCKS_PER_CHUNK && !(entry->bitmap[i >> 5] & (1 << (i & 31)));
+				 i++)
+				n += 1;
+		}
+	}
+	LWLockRelease(lfc_locks[part]);
+
+	*start = blkno + 1;
+	return n;
+}
+
 /*
  * Evict a page (if present) from the local file cache
  */
@@ -383,6 +1083,7 @@ lfc_evict(RelFileNode rnode, ForkNumber forkNum, BlockNumber blkno)
 	bool found;
 	int chunk_offs = blkno & (BLOCKS_PER_CHUNK-1);
 	uint32 hash;
+	uint32 part;
 
 	if (lfc_size_limit == 0) /* fast exit if file cache is disabled */
 		return;
@@ -390,27 +1091,41 @@ lfc_evict(RelFileNode rnode, ForkNumber forkNum, BlockNumber blkno)
 	INIT_BUFFERTAG(tag, rnode, forkNum, (blkno & ~(BLOCKS_PER_CHUNK-1)));
 
 	hash = get_hash_value(lfc_hash, &tag);
+	part = LFC_PARTITION(hash);
 
-	LWLockAcquire(lfc_lock, LW_EXCLUSIVE);
+	LWLockAcquire(lfc_locks[part], LW_EXCLUSIVE);
 	entry = hash_search_with_hash_value(lfc_hash, &tag, hash, HASH_FIND, &found);
 
 	if (!found)
 	{
 		/* nothing to do */
-		LWLockRelease(lfc_lock);
+		LWLockRelease(lfc_locks[part]);
 		return;
 	}
 
 	/* remove the page from the cache */
 	entry->bitmap[chunk_offs >> 5] &= ~(1 << (chunk_offs & (32 - 1)));
 
+	/* Also cancel any pending writeback of this page */
+	if (lfc_write_buffers > 0)
+	{
+		LWLockAcquire(lfc_staging_lock, LW_EXCLUSIVE);
+		for (int i = 0; i < lfc_write_buffers; i++)
+		{
+			FileCacheStagingSlot* s = &lfc_staging[i];
+			if (s->state != LFC_STAGE_FREE && BUFFERTAGS_EQUAL(s->key, tag))
+				s->staged[chunk_offs >> 5] &= ~(1 << (chunk_offs & 31));
+		}
+		LWLockRelease(lfc_staging_lock);
+	}
+
 	/*
 	 * If the chunk has no live entries, we can position the chunk to be
 	 * recycled first.
 	 */
 	if (entry->bitmap[chunk_offs >> 5] == 0)
 	{
-		bool has_remaining_pages;
+		bool has_remaining_pages = false;
 
 		for (int i = 0; i < (BLOCKS_PER_CHUNK / 32); i++) {
 			if (entry->bitmap[i] != 0)
@@ -421,22 +1136,24 @@ lfc_evict(RelFileNode rnode, ForkNumber forkNum, BlockNumber blkno)
 		}
 
 		/*
-		 * Put the entry at the position that is first to be reclaimed when
-		 * we have no cached pages remaining in the chunk
+		 * Put the entry right under the clock hand and clear its reference
+		 * bit, so that it is first to be reclaimed when we have no cached
+		 * pages remaining in the chunk
 		 */
 		if (!has_remaining_pages)
 		{
-			dlist_delete(&entry->lru_node);
-			dlist_push_head(&lfc_ctl->lru, &entry->lru_node);
+			dlist_delete(&entry->clock_node);
+			dlist_push_head(&lfc_ctl->partitions[part].clock, &entry->clock_node);
+			entry->referenced = false;
 		}
 	}
 
 	/*
-	 * Done: apart from empty chunks, we don't move chunks in the LRU when
-	 * they're empty because eviction isn't usage.
+	 * Done: apart from empty chunks, we don't move chunks in the clock ring
+	 * when they're emptied because eviction isn't usage.
 	 */
 
-	LWLockRelease(lfc_lock);
+	LWLockRelease(lfc_locks[part]);
 }
 
 /*
@@ -454,6 +1171,7 @@ lfc_read(RelFileNode rnode, ForkNumber forkNum, BlockNumber blkno,
 	int chunk_offs = blkno & (BLOCKS_PER_CHUNK-1);
 	bool result = true;
 	uint32 hash;
+	uint32 part;
 
 	if (lfc_size_limit == 0) /* fast exit if file cache is disabled */
 		return false;
@@ -462,19 +1180,54 @@ lfc_read(RelFileNode rnode, ForkNumber forkNum, BlockNumber blkno,
 	tag.forkNum = forkNum;
 	tag.blockNum = blkno & ~(BLOCKS_PER_CHUNK-1);
 	hash = get_hash_value(lfc_hash, &tag);
+	part = LFC_PARTITION(hash);
 
-	LWLockAcquire(lfc_lock, LW_EXCLUSIVE);
+	LWLockAcquire(lfc_locks[part], LW_EXCLUSIVE);
 	entry = hash_search_with_hash_value(lfc_hash, &tag, hash, HASH_FIND, NULL);
+	if (lfc_write_buffers > 0 && entry != NULL)
+	{
+		/*
+		 * A version of this page newer than the one in the cache file may
+		 * still sit in a staging slot, so the staging area must be probed
+		 * before the file. Take the copy from the newest slot holding it.
+		 */
+		int best = -1;
+
+		LWLockAcquire(lfc_staging_lock, LW_SHARED);
+		for (int i = 0; i < lfc_write_buffers; i++)
+		{
+			FileCacheStagingSlot* s = &lfc_staging[i];
+			if (s->state != LFC_STAGE_FREE && BUFFERTAGS_EQUAL(s->key, tag)
+				&& (s->staged[chunk_offs >> 5] & (1 << (chunk_offs & 31)))
+				&& (best < 0 || (int32)(s->seqno - lfc_staging[best].seqno) > 0))
+				best = i;
+		}
+		if (best >= 0)
+			memcpy(buffer, LFC_STAGING_SLOT_DATA(best) + (size_t)chunk_offs*BLCKSZ, BLCKSZ);
+		LWLockRelease(lfc_staging_lock);
+		if (best >= 0)
+		{
+			entry->referenced = true;
+			lfc_ctl->partitions[part].hits += 1;
+			LWLockRelease(lfc_locks[part]);
+			return true;
+		}
+	}
 	if (entry == NULL || (entry->bitmap[chunk_offs >> 5] & (1 << (chunk_offs & 31))) == 0)
 	{
 		/* Page is not cached */
-		LWLockRelease(lfc_lock);
+		lfc_ctl->partitions[part].misses += 1;
+		LWLockRelease(lfc_locks[part]);
 		return false;
 	}
-	/* Unlink entry from LRU list to pin it for the duration of IO operation */
-	if (entry->access_count++ == 0)
-		dlist_delete(&entry->lru_node);
-	LWLockRelease(lfc_lock);
+	/*
+	 * Pin the entry for the duration of the IO operation and set its clock
+	 * reference bit; a hit does not touch the clock ring.
+	 */
+	entry->access_count += 1;
+	entry->referenced = true;
+	lfc_ctl->partitions[part].hits += 1;
+	LWLockRelease(lfc_locks[part]);
 
 	/* Open cache file if not done yet */
 	if (lfc_desc == 0)
@@ -498,12 +1251,11 @@ lfc_read(RelFileNode rnode, ForkNumber forkNum, BlockNumber blkno,
 		}
 	}
 
-	/* Place entry to the head of LRU list */
-	LWLockAcquire(lfc_lock, LW_EXCLUSIVE);
+	/* Unpin the entry; it stays at its position in the clock ring */
+	LWLockAcquire(lfc_locks[part], LW_EXCLUSIVE);
 	Assert(entry->access_count > 0);
-	if (--entry->access_count == 0)
-		dlist_push_tail(&lfc_ctl->lru, &entry->lru_node);
-	LWLockRelease(lfc_lock);
+	entry->access_count -= 1;
+	LWLockRelease(lfc_locks[part]);
 
 	return result;
 }
@@ -522,6 +1274,8 @@ lfc_write(RelFileNode rnode, ForkNumber forkNum, BlockNumber blkno,
 	bool found;
 	int chunk_offs = blkno & (BLOCKS_PER_CHUNK-1);
 	uint32 hash;
+	uint32 part;
+	FileCachePartition* lfc_part;
 
 	if (lfc_size_limit == 0) /* fast exit if file cache is disabled */
 		return;
@@ -530,15 +1284,33 @@ lfc_write(RelFileNode rnode, ForkNumber forkNum, BlockNumber blkno,
 	tag.forkNum = forkNum;
 	tag.blockNum = blkno & ~(BLOCKS_PER_CHUNK-1);
 	hash = get_hash_value(lfc_hash, &tag);
+	part = LFC_PARTITION(hash);
+	lfc_part = &lfc_ctl->partitions[part];
 
-	LWLockAcquire(lfc_lock, LW_EXCLUSIVE);
-	entry = hash_search_with_hash_value(lfc_hash, &tag, hash, HASH_ENTER, &found);
+	LWLockAcquire(lfc_locks[part], LW_EXCLUSIVE);
+	if (lfc_ctl->frozen)
+	{
+		/*
+		 * Cache state was already dumped for shutdown: allow in-place updates
+		 * of present chunks, but no allocation or recycling that would
+		 * invalidate the dumped offsets.
+		 */
+		entry = hash_search_with_hash_value(lfc_hash, &tag, hash, HASH_FIND, &found);
+		if (!found)
+		{
+			LWLockRelease(lfc_locks[part]);
+			return;
+		}
+	}
+	else
+		entry = hash_search_with_hash_value(lfc_hash, &tag, hash, HASH_ENTER, &found);
 
+	lfc_part->writes += 1;
 	if (found)
 	{
-		/* Unlink entry from LRU list to pin it for the duration of IO operation */
-		if (entry->access_count++ == 0)
-			dlist_delete(&entry->lru_node);
+		/* Pin entry for the duration of IO operation and mark the chunk as used */
+		entry->access_count += 1;
+		entry->referenced = true;
 	}
 	else
 	{
@@ -550,24 +1322,66 @@ lfc_write(RelFileNode rnode, ForkNumber forkNum, BlockNumber blkno,
 		 * there are should be very large number of concurrent IO operations and them are limited by max_connections,
 		 * we prefer not to complicate code and use second approach.
 		 */
-		if (lfc_ctl->used >= SIZE_MB_TO_CHUNKS(lfc_size_limit) && !dlist_is_empty(&lfc_ctl->lru))
+		FileCacheEntry* victim = lfc_part->used >= lfc_partition_limit()
+			? lfc_clock_sweep(lfc_part) : NULL;
+
+		if (victim != NULL)
 		{
-			/* Cache overflow: evict least recently used chunk */
-			FileCacheEntry* victim = dlist_container(FileCacheEntry, lru_node, dlist_pop_head_node(&lfc_ctl->lru));
-			Assert(victim->access_count == 0);
+			/* Cache overflow: reuse the chunk of a swept-out entry of this partition */
 			entry->offset = victim->offset; /* grab victim's chunk */
 			hash_search(lfc_hash, &victim->key, HASH_REMOVE, NULL);
+			lfc_part->evictions += 1;
 			elog(LOG, "Swap file cache page");
 		}
 		else
 		{
-			lfc_ctl->used += 1;
-			entry->offset = lfc_ctl->size++; /* allocate new chunk at end of file */
+			lfc_part->used += 1;
+			/* allocate new chunk at end of file */
+			entry->offset = pg_atomic_fetch_add_u32(&lfc_ctl->size, 1);
 		}
 		entry->access_count = 1;
+		entry->referenced = false;
 		memset(entry->bitmap, 0, sizeof entry->bitmap);
+		dlist_push_tail(&lfc_part->clock, &entry->clock_node);
+	}
+	LWLockRelease(lfc_locks[part]);
+
+	if (lfc_write_buffers > 0)
+	{
+		bool new_slot;
+		bool conflict;
+
+		if (lfc_stage_write(&tag, entry->offset, chunk_offs, buffer, &new_slot, &conflict))
+		{
+			/*
+			 * Page is parked in a staging slot: the writer will copy it into
+			 * the cache file and set the valid bit in the bitmap. Transfer
+			 * the pin to the slot if one was attached to this chunk.
+			 */
+			LWLockAcquire(lfc_locks[part], LW_EXCLUSIVE);
+			if (new_slot)
+				entry->access_count += 1;
+			Assert(entry->access_count > 0);
+			entry->access_count -= 1;
+			LWLockRelease(lfc_locks[part]);
+			return;
+		}
+		if (conflict)
+		{
+			/*
+			 * An in-flight write of an older version of this block could
+			 * overtake a synchronous write of the new one, so don't cache
+			 * this page version at all: the stale valid bit was cancelled.
+			 */
+			LWLockAcquire(lfc_locks[part], LW_EXCLUSIVE);
+			entry->bitmap[chunk_offs >> 5] &= ~(1 << (chunk_offs & 31));
+			Assert(entry->access_count > 0);
+			entry->access_count -= 1;
+			LWLockRelease(lfc_locks[part]);
+			return;
+		}
+		/* All staging slots are busy: fall back to synchronous write */
 	}
-	LWLockRelease(lfc_lock);
 
 	/* Open cache file if not done yet */
 	if (lfc_desc == 0)
@@ -587,14 +1401,67 @@ lfc_write(RelFileNode rnode, ForkNumber forkNum, BlockNumber blkno,
 			lfc_size_limit = 0; /* disable file cache */
 		}
 	}
-	/* Place entry to the head of LRU list */
-	LWLockAcquire(lfc_lock, LW_EXCLUSIVE);
+	/* Unpin the entry and publish the valid bit */
+	LWLockAcquire(lfc_locks[part], LW_EXCLUSIVE);
 	Assert(entry->access_count > 0);
-	if (--entry->access_count == 0)
-		dlist_push_tail(&lfc_ctl->lru, &entry->lru_node);
+	entry->access_count -= 1;
 	if (lfc_size_limit != 0)
 		entry->bitmap[chunk_offs >> 5] |= (1 << (chunk_offs & 31));
-	LWLockRelease(lfc_lock);
+	LWLockRelease(lfc_locks[part]);
+}
+
+/*
+ * Aggregate the per-partition cache statistics into one row.
+ */
+PG_FUNCTION_INFO_V1(neon_get_lfc_stats);
+
+Datum
+neon_get_lfc_stats(PG_FUNCTION_ARGS)
+{
+	uint64		hits = 0;
+	uint64		misses = 0;
+	uint64		writes = 0;
+	uint64		evictions = 0;
+	uint64		used = 0;
+	Datum		values[6];
+	bool		nulls[6] = {false, false, false, false, false, false};
+	TupleDesc	tupdesc;
+
+	/*
+	 * Read the counters without the partition locks: they are monotonic and
+	 * only statistics, so a slightly inconsistent snapshot is fine.
+	 */
+	if (lfc_ctl)
+	{
+		for (int i = 0; i < LFC_N_PARTITIONS; i++)
+		{
+			FileCachePartition *part = &lfc_ctl->partitions[i];
+
+			hits += part->hits;
+			misses += part->misses;
+			writes += part->writes;
+			evictions += part->evictions;
+			used += part->used;
+		}
+	}
+
+	tupdesc = CreateTemplateTupleDesc(6);
+	TupleDescInitEntry(tupdesc, (AttrNumber) 1, "file_cache_hits", INT8OID, -1, 0);
+	TupleDescInitEntry(tupdesc, (AttrNumber) 2, "file_cache_misses", INT8OID, -1, 0);
+	TupleDescInitEntry(tupdesc, (AttrNumber) 3, "file_cache_writes", INT8OID, -1, 0);
+	TupleDescInitEntry(tupdesc, (AttrNumber) 4, "file_cache_evictions", INT8OID, -1, 0);
+	TupleDescInitEntry(tupdesc, (AttrNumber) 5, "file_cache_used_chunks", INT8OID, -1, 0);
+	TupleDescInitEntry(tupdesc, (AttrNumber) 6, "file_cache_size_chunks", INT8OID, -1, 0);
+	tupdesc = BlessTupleDesc(tupdesc);
+
+	values[0] = Int64GetDatum((int64) hits);
+	values[1] = Int64GetDatum((int64) misses);
+	values[2] = Int64GetDatum((int64) writes);
+	values[3] = Int64GetDatum((int64) evictions);
+	values[4] = Int64GetDatum((int64) used);
+	values[5] = Int64GetDatum((int64) (lfc_ctl ? pg_atomic_read_u32(&lfc_ctl->size) : 0));
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
 }
 
 /*
@@ -686,7 +1553,12 @@ local_cache_pages(PG_FUNCTION_ARGS)
 
 		fctx->tupdesc = BlessTupleDesc(tupledesc);
 
-		LWLockAcquire(lfc_lock, LW_SHARED);
+		/*
+		 * Take all partition locks in order to get a stable view of the
+		 * whole table for the scan.
+		 */
+		for (int i = 0; i < LFC_N_PARTITIONS; i++)
+			LWLockAcquire(lfc_locks[i], LW_SHARED);
 
         hash_seq_init(&status, lfc_hash);
         while ((entry = hash_seq_search(&status)) != NULL)
@@ -707,11 +1579,9 @@ local_cache_pages(PG_FUNCTION_ARGS)
 
 		/*
 		 * Scan through all the buffers, saving the relevant fields in the
-		 * fctx->record structure.
-		 *
-		 * We don't hold the partition locks, so we don't get a consistent
-		 * snapshot across all buffers, but we do grab the buffer header
-		 * locks, so the information of each buffer is self-consistent.
+		 * fctx->record structure. We still hold all the partition locks, so
+		 * the table cannot change between the counting pass above and this
+		 * one.
 		 */
 		n_pages = 0;
         hash_seq_init(&status, lfc_hash);
@@ -733,7 +1603,8 @@ local_cache_pages(PG_FUNCTION_ARGS)
 			}
 		}
 		Assert(n_pages == funcctx->max_calls);
-		LWLockRelease(lfc_lock);
+		for (int i = 0; i < LFC_N_PARTITIONS; i++)
+			LWLockRelease(lfc_locks[i]);
 	}
 
 	funcctx = SRF_PERCALL_SETUP();
@@ -0,0 +1,356 @@
+/*-------------------------------------------------------------------------
+ *
+ * getpage_dedup.c
+ *      Cross-backend deduplication of GetPage requests.
+ *
+ * Each backend keeps its own prefetch ring, so when many backends scan the
+ * same hot relation they all send identical GetPage requests for the same
+ * block to the pageserver. This module maintains a small shared-memory table
+ * of in-flight and recently received demand GetPage requests, keyed by
+ * buffer tag. The first backend to request a block becomes the leader and
+ * performs the request; concurrent backends requesting the same block wait
+ * on a condition variable and copy the page from the table when the leader
+ * publishes it, instead of multiplying load on the pageserver.
+ *
+ * Deduplication is only attempted for latest-mode requests outside of
+ * recovery: in that mode the request LSN is merely a lower bound on the
+ * page version the pageserver may return, so one response can satisfy every
+ * request whose LSN is not above the LSN the leader asked for. Completed
+ * entries linger in the table until the slot is needed again, so closely
+ * spaced requests can reuse a response without waiting at all.
+ *
+ * Portions Copyright (c) 1996-2021, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, Regents of the University of California
+ *
+ *
+ * IDENTIFICATION
+ *	  pgxn/neon/getpage_dedup.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "pagestore_client.h"
+#include "storage/buf_internals.h"
+#include "storage/condition_variable.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/procarray.h"
+#include "storage/shmem.h"
+#include "utils/dynahash.h"
+#include "utils/guc.h"
+
+typedef enum GetPageDedupState
+{
+	GP_DEDUP_INFLIGHT,			/* leader's request is on the wire */
+	GP_DEDUP_VALID,				/* page[] holds the response */
+	GP_DEDUP_ABORTED,			/* leader failed; waiters must request
+								 * themselves */
+} GetPageDedupState;
+
+typedef struct GetPageDedupEntry
+{
+	BufferTag	tag;			/* hash key */
+	XLogRecPtr	lsn;			/* request LSN the response satisfies */
+	GetPageDedupState state;
+	int			leader_pid;		/* backend performing the request */
+	int			n_waiters;		/* backends waiting on cv */
+	ConditionVariable cv;
+	char		page[BLCKSZ];
+} GetPageDedupEntry;
+
+/*
+ * Don't wait forever on a leader: if the response hasn't arrived within this
+ * time, fall back to sending our own request. This bounds the damage if a
+ * leader stalls or its entry leaks.
+ */
+#define GETPAGE_DEDUP_TIMEOUT_MS	1000
+
+static HTAB *getpage_dedup_hash;
+static LWLockId getpage_dedup_lock;
+static int	getpage_dedup_size;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+static void getpage_dedup_shmem_request(void);
+#endif
+
+/*
+ * An entry is a bit over BLCKSZ, so the default of 128 entries costs about
+ * 1 MB of shared memory. The table only needs to cover requests that are
+ * in flight (or just landed) at the same moment, not the working set.
+ */
+#define DEFAULT_GETPAGE_DEDUP_SIZE	128
+
+static void
+getpage_dedup_shmem_startup(void)
+{
+	static HASHCTL info;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	getpage_dedup_lock = (LWLockId) GetNamedLWLockTranche("neon_getpage_dedup");
+	info.keysize = sizeof(BufferTag);
+	info.entrysize = sizeof(GetPageDedupEntry);
+	getpage_dedup_hash = ShmemInitHash("neon_getpage_dedup",
+									   getpage_dedup_size, getpage_dedup_size,
+									   &info,
+									   HASH_ELEM | HASH_BLOBS);
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Claim 'entry' for a new request led by this backend. The caller must hold
+ * getpage_dedup_lock exclusively.
+ */
+static void
+getpage_dedup_claim(GetPageDedupEntry *entry, XLogRecPtr lsn)
+{
+	entry->lsn = lsn;
+	entry->state = GP_DEDUP_INFLIGHT;
+	entry->leader_pid = MyProcPid;
+}
+
+/*
+ * Make room for a new entry by discarding a completed response nobody is
+ * waiting on. Returns false if every entry is busy. The caller must hold
+ * getpage_dedup_lock exclusively.
+ */
+static bool
+getpage_dedup_evict(void)
+{
+	HASH_SEQ_STATUS seq;
+	GetPageDedupEntry *entry;
+
+	hash_seq_init(&seq, getpage_dedup_hash);
+	while ((entry = hash_seq_search(&seq)) != NULL)
+	{
+		if (entry->state != GP_DEDUP_INFLIGHT && entry->n_waiters == 0)
+		{
+			hash_search(getpage_dedup_hash, &entry->tag, HASH_REMOVE, NULL);
+			hash_seq_term(&seq);
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Look up (tag, lsn) in the deduplication table.
+ *
+ * GETPAGE_DEDUP_HIT: 'buffer' has been filled with the page; the caller is
+ * done. GETPAGE_DEDUP_LEADER: the caller must send the request itself and
+ * then call getpage_dedup_complete() with the page, or getpage_dedup_abort()
+ * if the request fails. GETPAGE_DEDUP_BYPASS: the caller must send the
+ * request itself and the table wants to hear nothing more about it.
+ */
+GetPageDedupResult
+getpage_dedup_begin(BufferTag tag, XLogRecPtr lsn, char *buffer)
+{
+	GetPageDedupEntry *entry;
+	bool		found;
+	GetPageDedupResult result;
+
+	if (getpage_dedup_size == 0)
+		return GETPAGE_DEDUP_BYPASS;
+
+	LWLockAcquire(getpage_dedup_lock, LW_EXCLUSIVE);
+
+	entry = hash_search(getpage_dedup_hash, &tag, HASH_ENTER_NULL, &found);
+	if (entry == NULL && getpage_dedup_evict())
+		entry = hash_search(getpage_dedup_hash, &tag, HASH_ENTER_NULL, &found);
+	if (entry == NULL)
+	{
+		LWLockRelease(getpage_dedup_lock);
+		return GETPAGE_DEDUP_BYPASS;
+	}
+
+	if (!found)
+	{
+		ConditionVariableInit(&entry->cv);
+		entry->n_waiters = 0;
+		getpage_dedup_claim(entry, lsn);
+		LWLockRelease(getpage_dedup_lock);
+		return GETPAGE_DEDUP_LEADER;
+	}
+
+	if (entry->state == GP_DEDUP_VALID && entry->lsn >= lsn)
+	{
+		memcpy(buffer, entry->page, BLCKSZ);
+		LWLockRelease(getpage_dedup_lock);
+		return GETPAGE_DEDUP_HIT;
+	}
+
+	if (entry->state != GP_DEDUP_INFLIGHT)
+	{
+		/* stale or aborted response: reuse the slot for our request */
+		getpage_dedup_claim(entry, lsn);
+		LWLockRelease(getpage_dedup_lock);
+		return GETPAGE_DEDUP_LEADER;
+	}
+
+	/*
+	 * A request is in flight. If its LSN is below ours, its response might
+	 * predate the page version we need, so we can't use it; and if the
+	 * leader has died its response will never arrive. In both cases take
+	 * over if our LSN allows it (the existing waiters are satisfied by any
+	 * response at or above the LSN they found in the entry, so raising it is
+	 * safe), otherwise just bypass the table.
+	 */
+	if (entry->lsn < lsn || BackendPidGetProc(entry->leader_pid) == NULL)
+	{
+		if (entry->lsn <= lsn)
+		{
+			getpage_dedup_claim(entry, lsn);
+			LWLockRelease(getpage_dedup_lock);
+			return GETPAGE_DEDUP_LEADER;
+		}
+		LWLockRelease(getpage_dedup_lock);
+		return GETPAGE_DEDUP_BYPASS;
+	}
+
+	/*
+	 * Wait for the leader. The entry cannot be removed or recycled while
+	 * n_waiters is nonzero, so the pointer stays valid across the sleep.
+	 */
+	entry->n_waiters++;
+	ConditionVariablePrepareToSleep(&entry->cv);
+	LWLockRelease(getpage_dedup_lock);
+
+	for (;;)
+	{
+		bool		timeout;
+
+		timeout = ConditionVariableTimedSleep(&entry->cv,
+											  GETPAGE_DEDUP_TIMEOUT_MS,
+											  PG_WAIT_EXTENSION);
+		LWLockAcquire(getpage_dedup_lock, LW_EXCLUSIVE);
+		if (entry->state != GP_DEDUP_INFLIGHT || timeout)
+			break;
+		LWLockRelease(getpage_dedup_lock);
+	}
+	ConditionVariableCancelSleep();
+
+	if (entry->state == GP_DEDUP_VALID && entry->lsn >= lsn)
+	{
+		memcpy(buffer, entry->page, BLCKSZ);
+		result = GETPAGE_DEDUP_HIT;
+	}
+	else
+		result = GETPAGE_DEDUP_BYPASS;
+
+	entry->n_waiters--;
+	if (entry->state == GP_DEDUP_ABORTED && entry->n_waiters == 0)
+		hash_search(getpage_dedup_hash, &tag, HASH_REMOVE, NULL);
+	LWLockRelease(getpage_dedup_lock);
+
+	return result;
+}
+
+/*
+ * Publish the page the leader received, waking any waiters. The entry stays
+ * in the table as a recent response until the slot is reclaimed.
+ */
+void
+getpage_dedup_complete(BufferTag tag, const char *page)
+{
+	GetPageDedupEntry *entry;
+
+	LWLockAcquire(getpage_dedup_lock, LW_EXCLUSIVE);
+	entry = hash_search(getpage_dedup_hash, &tag, HASH_FIND, NULL);
+
+	/*
+	 * The entry may have been taken over by another backend if we stalled
+	 * long enough to be presumed dead; in that case the response is theirs
+	 * to publish.
+	 */
+	if (entry != NULL && entry->state == GP_DEDUP_INFLIGHT &&
+		entry->leader_pid == MyProcPid)
+	{
+		memcpy(entry->page, page, BLCKSZ);
+		entry->state = GP_DEDUP_VALID;
+
+		/*
+		 * Broadcast before releasing the lock: once the lock is released
+		 * the entry may be evicted and its condition variable recycled.
+		 */
+		ConditionVariableBroadcast(&entry->cv);
+	}
+	LWLockRelease(getpage_dedup_lock);
+}
+
+/*
+ * The leader's request failed: release any waiters so they can send their
+ * own requests.
+ */
+void
+getpage_dedup_abort(BufferTag tag)
+{
+	GetPageDedupEntry *entry;
+
+	LWLockAcquire(getpage_dedup_lock, LW_EXCLUSIVE);
+	entry = hash_search(getpage_dedup_hash, &tag, HASH_FIND, NULL);
+	if (entry != NULL && entry->state == GP_DEDUP_INFLIGHT &&
+		entry->leader_pid == MyProcPid)
+	{
+		if (entry->n_waiters == 0)
+			hash_search(getpage_dedup_hash, &tag, HASH_REMOVE, NULL);
+		else
+		{
+			entry->state = GP_DEDUP_ABORTED;
+			ConditionVariableBroadcast(&entry->cv);
+		}
+	}
+	LWLockRelease(getpage_dedup_lock);
+}
+
+void
+getpage_dedup_init(void)
+{
+	DefineCustomIntVariable("neon.getpage_dedup_size",
+							"Sets the number of shared GetPage deduplication entries",
+							"Concurrent backends requesting the same block share "
+							"one pageserver request through this table. "
+							"Set to 0 to disable deduplication.",
+							&getpage_dedup_size,
+							DEFAULT_GETPAGE_DEDUP_SIZE,
+							0,
+							INT_MAX,
+							PGC_POSTMASTER,
+							0,
+							NULL, NULL, NULL);
+
+	if (getpage_dedup_size > 0)
+	{
+#if PG_VERSION_NUM >= 150000
+		prev_shmem_request_hook = shmem_request_hook;
+		shmem_request_hook = getpage_dedup_shmem_request;
+#else
+		RequestAddinShmemSpace(hash_estimate_size(getpage_dedup_size, sizeof(GetPageDedupEntry)));
+		RequestNamedLWLockTranche("neon_getpage_dedup", 1);
+#endif
+
+		prev_shmem_startup_hook = shmem_startup_hook;
+		shmem_startup_hook = getpage_dedup_shmem_startup;
+	}
+}
+
+#if PG_VERSION_NUM >= 150000
+/*
+ * shmem_request hook: request additional shared resources.  We'll allocate
+ * or attach to the shared resources in getpage_dedup_shmem_startup().
+ */
+static void
+getpage_dedup_shmem_request(void)
+{
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+
+	RequestAddinShmemSpace(hash_estimate_size(getpage_dedup_size, sizeof(GetPageDedupEntry)));
+	RequestNamedLWLockTranche("neon_getpage_dedup", 1);
+}
+#endif
@@ -14,7 +14,10 @@
  */
 #include "postgres.h"
 
+#include <sys/socket.h>
+
 #include "pagestore_client.h"
+#include "neon_perf_counters.h"
 #include "fmgr.h"
 #include "access/xlog.h"
 #include "access/xlogutils.h"
@@ -26,6 +29,7 @@
 
 #include "miscadmin.h"
 #include "pgstat.h"
+#include "port/pg_bswap.h"
 #include "utils/guc.h"
 
 #include "neon.h"
@@ -36,16 +40,16 @@
 
 #define RECONNECT_INTERVAL_USEC 1000000
 
-bool		connected = false;
-PGconn	   *pageserver_conn = NULL;
+bool		connected[NUM_PS_CHANNELS];
+PGconn	   *pageserver_conn[NUM_PS_CHANNELS];
 
 /*
- * WaitEventSet containing:
- * - WL_SOCKET_READABLE on pageserver_conn,
+ * Per-channel WaitEventSet containing:
+ * - WL_SOCKET_READABLE on pageserver_conn[chan],
  * - WL_LATCH_SET on MyLatch, and
  * - WL_EXIT_ON_PM_DEATH.
  */
-WaitEventSet *pageserver_conn_wes = NULL;
+WaitEventSet *pageserver_conn_wes[NUM_PS_CHANNELS];
 
 /* GUCs */
 char	   *neon_timeline;
@@ -55,25 +59,300 @@ char	   *page_server_connstring;
 char	   *neon_auth_token;
 
 int			readahead_buffer_size = 128;
+int			readahead_getpage_batch_size = 16;
 int			flush_every_n_requests = 8;
 
+bool		compress_getpage_responses = false;
+
+/*
+ * Whether each channel's connection negotiated compressed GetPage responses,
+ * and whether the pageserver understands the option at all (cleared when a
+ * handshake with it is rejected, so we don't retry on every reconnect).
+ */
+static bool conn_compressed[NUM_PS_CHANNELS];
+static bool ps_compression_supported = true;
+
+/*
+ * Channels whose socket was adopted from the connection broker are not
+ * managed by libpq: the broker completed the TCP/auth/pagestream handshake
+ * in its own PGconn and passed us the bare file descriptor (see
+ * pagestore_broker.c). On those we speak the CopyBoth subprotocol directly,
+ * with our own framing buffers.
+ */
+static bool conn_brokered[NUM_PS_CHANNELS];
+static pgsocket brokered_sock[NUM_PS_CHANNELS];
+static StringInfoData brokered_inbuf[NUM_PS_CHANNELS];
+static StringInfoData brokered_outbuf[NUM_PS_CHANNELS];
+
 int			n_reconnect_attempts = 0;
 int			max_reconnect_attempts = 60;
 
 bool	(*old_redo_read_buffer_filter) (XLogReaderState *record, uint8 block_id) = NULL;
 
-static bool pageserver_flush(void);
+static bool pageserver_flush(PsChannel chan);
+
+/*
+ * Queue one CopyData frame on a brokered channel. Like PQputCopyData, this
+ * only buffers; the bytes reach the socket in brokered_flush().
+ */
+static void
+brokered_put_copydata(PsChannel chan, const char *data, int len)
+{
+	StringInfo	outbuf = &brokered_outbuf[chan];
+	uint32		n32 = pg_hton32((uint32) len + 4);
+
+	appendStringInfoChar(outbuf, 'd');
+	appendBinaryStringInfo(outbuf, (char *) &n32, 4);
+	appendBinaryStringInfo(outbuf, data, len);
+}
+
+/*
+ * Push the queued frames of a brokered channel to the socket. Consumed
+ * bytes are removed from the buffer as we go, so an error thrown while
+ * waiting for a writable socket leaves the stream resumable.
+ */
+static bool
+brokered_flush(PsChannel chan)
+{
+	StringInfo	outbuf = &brokered_outbuf[chan];
+
+	while (outbuf->len > 0)
+	{
+		ssize_t		rc;
+
+		rc = send(brokered_sock[chan], outbuf->data, outbuf->len, 0);
+		if (rc > 0)
+		{
+			if (rc == outbuf->len)
+			{
+				resetStringInfo(outbuf);
+				break;
+			}
+			memmove(outbuf->data, outbuf->data + rc, outbuf->len - rc);
+			outbuf->len -= rc;
+			continue;
+		}
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			WaitEvent	event;
+
+			/* the socket is at position 2 of the channel's wait set */
+			ModifyWaitEvent(pageserver_conn_wes[chan], 2, WL_SOCKET_WRITEABLE, NULL);
+			(void) WaitEventSetWait(pageserver_conn_wes[chan], -1L, &event, 1, PG_WAIT_EXTENSION);
+			ModifyWaitEvent(pageserver_conn_wes[chan], 2, WL_SOCKET_READABLE, NULL);
+			ResetLatch(MyLatch);
+			CHECK_FOR_INTERRUPTS();
+			continue;
+		}
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Find a field of an ErrorResponse/NoticeResponse payload. The payload is a
+ * sequence of (field code byte, null-terminated string) pairs, terminated
+ * by a zero byte.
+ */
+static const char *
+brokered_error_field(const char *payload, int len, char field)
+{
+	const char *p = payload;
+	const char *end = payload + len;
+
+	while (p < end && *p != '\0')
+	{
+		char		code = *p++;
+		const char *val = p;
+
+		while (p < end && *p != '\0')
+			p++;
+		if (p >= end)
+			break;
+		if (code == field)
+			return val;
+		p++;
+	}
+	return NULL;
+}
+
+/*
+ * Read one CopyData payload from a brokered channel, the equivalent of
+ * call_PQgetCopyData. On success *buffer is a palloc'd copy of the payload
+ * and its length is returned; -1 means the connection is broken and the
+ * caller must disconnect.
+ */
+static int
+brokered_get_copydata(PsChannel chan, char **buffer)
+{
+	StringInfo	inbuf = &brokered_inbuf[chan];
+
+	for (;;)
+	{
+		/* Do we have one complete protocol message buffered? */
+		if (inbuf->len - inbuf->cursor >= 5)
+		{
+			char		msgtype = inbuf->data[inbuf->cursor];
+			uint32		msglen;
+
+			memcpy(&msglen, inbuf->data + inbuf->cursor + 1, 4);
+			msglen = pg_ntoh32(msglen);
+
+			if (msglen < 4 || msglen > PQ_LARGE_MESSAGE_LIMIT)
+			{
+				neon_log(LOG, "invalid message length %u on brokered pageserver connection", msglen);
+				return -1;
+			}
+
+			if ((uint32) (inbuf->len - inbuf->cursor) >= 1 + msglen)
+			{
+				const char *payload = inbuf->data + inbuf->cursor + 5;
+				int			payload_len = msglen - 4;
+				const char *errmsg;
+
+				inbuf->cursor += 1 + msglen;
+
+				switch (msgtype)
+				{
+					case 'd':	/* CopyData */
+						*buffer = palloc(payload_len);
+						memcpy(*buffer, payload, payload_len);
+						return payload_len;
+
+					case 'N':	/* NoticeResponse */
+						errmsg = brokered_error_field(payload, payload_len, 'M');
+						neon_log(LOG, "notice from pageserver: %s",
+								 errmsg ? errmsg : "(no message)");
+						continue;
+
+					case 'E':	/* ErrorResponse */
+						errmsg = brokered_error_field(payload, payload_len, 'M');
+						neon_log(LOG, "error from pageserver: %s",
+								 errmsg ? errmsg : "(no message)");
+						return -1;
+
+					default:
+						neon_log(LOG, "unexpected message type '%c' on brokered pageserver connection", msgtype);
+						return -1;
+				}
+			}
+		}
+
+		/* discard consumed bytes before appending more */
+		if (inbuf->cursor > 0)
+		{
+			memmove(inbuf->data, inbuf->data + inbuf->cursor, inbuf->len - inbuf->cursor);
+			inbuf->len -= inbuf->cursor;
+			inbuf->cursor = 0;
+		}
+
+		{
+			char		chunk[8192];
+			ssize_t		rc;
+
+			rc = recv(brokered_sock[chan], chunk, sizeof(chunk), 0);
+			if (rc > 0)
+			{
+				appendBinaryStringInfo(inbuf, chunk, rc);
+				continue;
+			}
+			if (rc == 0)
+			{
+				neon_log(LOG, "brokered pageserver connection closed by peer");
+				return -1;
+			}
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				WaitEvent	event;
+
+				/* Sleep until there's something to do */
+				(void) WaitEventSetWait(pageserver_conn_wes[chan], -1L, &event, 1, PG_WAIT_EXTENSION);
+				ResetLatch(MyLatch);
+
+				CHECK_FOR_INTERRUPTS();
+				continue;
+			}
+			neon_log(LOG, "could not read from brokered pageserver connection: %m");
+			return -1;
+		}
+	}
+}
+
+/*
+ * Try to adopt a pre-established connection from the broker instead of
+ * paying the full handshake in pageserver_connect.
+ */
+static bool
+pageserver_adopt_brokered(PsChannel chan)
+{
+	bool		compressed = false;
+	int			sock;
+
+	sock = broker_request_conn(&compressed);
+	if (sock < 0)
+		return false;
+
+	if (!pg_set_noblock(sock))
+	{
+		close(sock);
+		return false;
+	}
+
+	if (brokered_inbuf[chan].data == NULL)
+	{
+		MemoryContext old = MemoryContextSwitchTo(TopMemoryContext);
+
+		initStringInfo(&brokered_inbuf[chan]);
+		initStringInfo(&brokered_outbuf[chan]);
+		MemoryContextSwitchTo(old);
+	}
+	else
+	{
+		resetStringInfo(&brokered_inbuf[chan]);
+		resetStringInfo(&brokered_outbuf[chan]);
+	}
+
+	pageserver_conn_wes[chan] = CreateWaitEventSet(TopMemoryContext, 3);
+	AddWaitEventToSet(pageserver_conn_wes[chan], WL_LATCH_SET, PGINVALID_SOCKET,
+			  MyLatch, NULL);
+	AddWaitEventToSet(pageserver_conn_wes[chan], WL_EXIT_ON_PM_DEATH, PGINVALID_SOCKET,
+			  NULL, NULL);
+	AddWaitEventToSet(pageserver_conn_wes[chan], WL_SOCKET_READABLE, sock, NULL, NULL);
+
+	brokered_sock[chan] = sock;
+	conn_brokered[chan] = true;
+	conn_compressed[chan] = compressed;
+	connected[chan] = true;
+
+	neon_log(LOG, "libpagestore: adopted a warm pageserver connection from the broker");
+	return true;
+}
 
 static bool
-pageserver_connect(int elevel)
+pageserver_connect(PsChannel chan, int elevel)
 {
 	char	   *query;
 	int			ret;
 	const char *keywords[3];
 	const char *values[3];
 	int			n;
+	PGconn	   *conn;
+	bool		try_compress;
+
+	Assert(!connected[chan]);
+
+	/*
+	 * Prefer a pre-established connection from the broker: it has already
+	 * paid the TCP, authentication and pagestream round trips.
+	 */
+	if (ps_broker_pool_size > 0 && pageserver_adopt_brokered(chan))
+		return true;
 
-	Assert(!connected);
+	try_compress = compress_getpage_responses && ps_compression_supported;
 
 	/*
 	 * Connect using the connection string we got from the
@@ -99,14 +378,13 @@ pageserver_connect(int elevel)
 	keywords[n] = NULL;
 	values[n] = NULL;
 	n++;
-	pageserver_conn = PQconnectdbParams(keywords, values, 1);
+	conn = PQconnectdbParams(keywords, values, 1);
 
-	if (PQstatus(pageserver_conn) == CONNECTION_BAD)
+	if (PQstatus(conn) == CONNECTION_BAD)
 	{
-		char	   *msg = pchomp(PQerrorMessage(pageserver_conn));
+		char	   *msg = pchomp(PQerrorMessage(conn));
 
-		PQfinish(pageserver_conn);
-		pageserver_conn = NULL;
+		PQfinish(conn);
 
 		ereport(elevel,
 				(errcode(ERRCODE_SQLCLIENT_UNABLE_TO_ESTABLISH_SQLCONNECTION),
@@ -115,29 +393,29 @@ pageserver_connect(int elevel)
 		return false;
 	}
 
-	query = psprintf("pagestream %s %s", neon_tenant, neon_timeline);
-	ret = PQsendQuery(pageserver_conn, query);
+	query = psprintf("pagestream %s %s%s", neon_tenant, neon_timeline,
+					 try_compress ? " compress=zlib" : "");
+	ret = PQsendQuery(conn, query);
 	if (ret != 1)
 	{
-		PQfinish(pageserver_conn);
-		pageserver_conn = NULL;
+		PQfinish(conn);
 		neon_log(elevel, "could not send pagestream command to pageserver");
 		return false;
 	}
 
-	pageserver_conn_wes = CreateWaitEventSet(TopMemoryContext, 3);
-	AddWaitEventToSet(pageserver_conn_wes, WL_LATCH_SET, PGINVALID_SOCKET,
+	pageserver_conn_wes[chan] = CreateWaitEventSet(TopMemoryContext, 3);
+	AddWaitEventToSet(pageserver_conn_wes[chan], WL_LATCH_SET, PGINVALID_SOCKET,
 			  MyLatch, NULL);
-	AddWaitEventToSet(pageserver_conn_wes, WL_EXIT_ON_PM_DEATH, PGINVALID_SOCKET,
+	AddWaitEventToSet(pageserver_conn_wes[chan], WL_EXIT_ON_PM_DEATH, PGINVALID_SOCKET,
 			  NULL, NULL);
-	AddWaitEventToSet(pageserver_conn_wes, WL_SOCKET_READABLE, PQsocket(pageserver_conn), NULL, NULL);
+	AddWaitEventToSet(pageserver_conn_wes[chan], WL_SOCKET_READABLE, PQsocket(conn), NULL, NULL);
 
-	while (PQisBusy(pageserver_conn))
+	while (PQisBusy(conn))
 	{
 		WaitEvent	event;
 
 		/* Sleep until there's something to do */
-		(void) WaitEventSetWait(pageserver_conn_wes, -1L, &event, 1, PG_WAIT_EXTENSION);
+		(void) WaitEventSetWait(pageserver_conn_wes[chan], -1L, &event, 1, PG_WAIT_EXTENSION);
 		ResetLatch(MyLatch);
 
 		CHECK_FOR_INTERRUPTS();
@@ -145,14 +423,13 @@ pageserver_connect(int elevel)
 		/* Data available in socket? */
 		if (event.events & WL_SOCKET_READABLE)
 		{
-			if (!PQconsumeInput(pageserver_conn))
+			if (!PQconsumeInput(conn))
 			{
-				char	   *msg = pchomp(PQerrorMessage(pageserver_conn));
+				char	   *msg = pchomp(PQerrorMessage(conn));
 
-				PQfinish(pageserver_conn);
-				pageserver_conn = NULL;
-				FreeWaitEventSet(pageserver_conn_wes);
-				pageserver_conn_wes = NULL;
+				PQfinish(conn);
+				FreeWaitEventSet(pageserver_conn_wes[chan]);
+				pageserver_conn_wes[chan] = NULL;
 
 				neon_log(elevel, "could not complete handshake with pageserver: %s",
 						 msg);
@@ -161,9 +438,35 @@ pageserver_connect(int elevel)
 		}
 	}
 
+	/*
+	 * If we asked for compression, check that the pageserver accepted the
+	 * pagestream command: an older pageserver rejects the extra option. In
+	 * that case redo the handshake without it, and remember the verdict so
+	 * later reconnects don't repeat the round trip.
+	 */
+	if (try_compress)
+	{
+		PGresult   *res = PQgetResult(conn);
+
+		if (PQresultStatus(res) != PGRES_COPY_BOTH)
+		{
+			PQclear(res);
+			PQfinish(conn);
+			FreeWaitEventSet(pageserver_conn_wes[chan]);
+			pageserver_conn_wes[chan] = NULL;
+
+			ps_compression_supported = false;
+			neon_log(LOG, "pageserver does not support compressed responses, reconnecting without compression");
+			return pageserver_connect(chan, elevel);
+		}
+		PQclear(res);
+	}
+
 	neon_log(LOG, "libpagestore: connected to '%s'", page_server_connstring);
 
-	connected = true;
+	pageserver_conn[chan] = conn;
+	connected[chan] = true;
+	conn_compressed[chan] = try_compress;
 	return true;
 }
 
@@ -171,19 +474,19 @@ pageserver_connect(int elevel)
  * A wrapper around PQgetCopyData that checks for interrupts while sleeping.
  */
 static int
-call_PQgetCopyData(char **buffer)
+call_PQgetCopyData(PsChannel chan, char **buffer)
 {
 	int			ret;
 
 retry:
-	ret = PQgetCopyData(pageserver_conn, buffer, 1 /* async */ );
+	ret = PQgetCopyData(pageserver_conn[chan], buffer, 1 /* async */ );
 
 	if (ret == 0)
 	{
 		WaitEvent	event;
 
 		/* Sleep until there's something to do */
-		(void) WaitEventSetWait(pageserver_conn_wes, -1L, &event, 1, PG_WAIT_EXTENSION);
+		(void) WaitEventSetWait(pageserver_conn_wes[chan], -1L, &event, 1, PG_WAIT_EXTENSION);
 		ResetLatch(MyLatch);
 
 		CHECK_FOR_INTERRUPTS();
@@ -191,9 +494,9 @@ retry:
 		/* Data available in socket? */
 		if (event.events & WL_SOCKET_READABLE)
 		{
-			if (!PQconsumeInput(pageserver_conn))
+			if (!PQconsumeInput(pageserver_conn[chan]))
 			{
-				char	   *msg = pchomp(PQerrorMessage(pageserver_conn));
+				char	   *msg = pchomp(PQerrorMessage(pageserver_conn[chan]));
 				neon_log(LOG, "could not get response from pageserver: %s", msg);
 				pfree(msg);
 				return -1;
@@ -208,7 +511,7 @@ retry:
 
 
 static void
-pageserver_disconnect(void)
+pageserver_disconnect(PsChannel chan)
 {
 	/*
 	 * If anything goes wrong while we were sending a request, it's not clear
@@ -217,32 +520,47 @@ pageserver_disconnect(void)
 	 * time later after we have already sent a new unrelated request. Close
 	 * the connection to avoid getting confused.
 	 */
-	if (connected)
+	if (connected[chan])
 	{
 		neon_log(LOG, "dropping connection to page server due to error");
-		PQfinish(pageserver_conn);
-		pageserver_conn = NULL;
-		connected = false;
-
-		prefetch_on_ps_disconnect();
+		if (conn_brokered[chan])
+		{
+			close(brokered_sock[chan]);
+			brokered_sock[chan] = PGINVALID_SOCKET;
+			conn_brokered[chan] = false;
+		}
+		else
+		{
+			PQfinish(pageserver_conn[chan]);
+			pageserver_conn[chan] = NULL;
+		}
+		connected[chan] = false;
+
+		/*
+		 * Only the loss of the prefetch channel invalidates in-flight
+		 * prefetches; the synchronous channel carries no pipelined state.
+		 */
+		if (chan == PS_CHANNEL_PREFETCH)
+			prefetch_on_ps_disconnect();
 	}
-	if (pageserver_conn_wes != NULL)
+	if (pageserver_conn_wes[chan] != NULL)
 	{
-		FreeWaitEventSet(pageserver_conn_wes);
-		pageserver_conn_wes = NULL;
+		FreeWaitEventSet(pageserver_conn_wes[chan]);
+		pageserver_conn_wes[chan] = NULL;
 	}
 }
 
 static bool
-pageserver_send(NeonRequest * request)
+pageserver_send(PsChannel chan, NeonRequest * request)
 {
 	StringInfoData req_buff;
 
 	/* If the connection was lost for some reason, reconnect */
-	if (connected && PQstatus(pageserver_conn) == CONNECTION_BAD)
+	if (connected[chan] && !conn_brokered[chan] &&
+		PQstatus(pageserver_conn[chan]) == CONNECTION_BAD)
 	{
 		neon_log(LOG, "pageserver_send disconnect bad connection");
-		pageserver_disconnect();
+		pageserver_disconnect(chan);
 	}
 
 	req_buff = nm_pack_request(request);
@@ -254,9 +572,9 @@ pageserver_send(NeonRequest * request)
 	 * See https://github.com/neondatabase/neon/issues/1138
 	 * So try to reestablish connection in case of failure.
 	 */
-	if (!connected)
+	if (!connected[chan])
 	{
-		while (!pageserver_connect(n_reconnect_attempts < max_reconnect_attempts ? LOG : ERROR))
+		while (!pageserver_connect(chan, n_reconnect_attempts < max_reconnect_attempts ? LOG : ERROR))
 		{
 			n_reconnect_attempts += 1;
 			pg_usleep(RECONNECT_INTERVAL_USEC);
@@ -272,10 +590,12 @@ pageserver_send(NeonRequest * request)
 	 * practice, our requests are small enough to always fit in the output and
 	 * TCP buffer.
 	 */
-	if (PQputCopyData(pageserver_conn, req_buff.data, req_buff.len) <= 0)
+	if (conn_brokered[chan])
+		brokered_put_copydata(chan, req_buff.data, req_buff.len);
+	else if (PQputCopyData(pageserver_conn[chan], req_buff.data, req_buff.len) <= 0)
 	{
-		char	   *msg = pchomp(PQerrorMessage(pageserver_conn));
-		pageserver_disconnect();
+		char	   *msg = pchomp(PQerrorMessage(pageserver_conn[chan]));
+		pageserver_disconnect(chan);
 		neon_log(LOG, "pageserver_send disconnect because failed to send page request (try to reconnect): %s", msg);
 		pfree(msg);
 		pfree(req_buff.data);
@@ -295,12 +615,12 @@ pageserver_send(NeonRequest * request)
 }
 
 static NeonResponse *
-pageserver_receive(void)
+pageserver_receive(PsChannel chan, char *dest_page)
 {
 	StringInfoData resp_buff;
 	NeonResponse *resp;
 
-	if (!connected)
+	if (!connected[chan])
 		return NULL;
 
 	PG_TRY();
@@ -308,13 +628,20 @@ pageserver_receive(void)
 		/* read response */
 		int			rc;
 
-		rc = call_PQgetCopyData(&resp_buff.data);
+		if (conn_brokered[chan])
+			rc = brokered_get_copydata(chan, &resp_buff.data);
+		else
+			rc = call_PQgetCopyData(chan, &resp_buff.data);
 		if (rc >= 0)
 		{
 			resp_buff.len = rc;
 			resp_buff.cursor = 0;
-			resp = nm_unpack_response(&resp_buff);
-			PQfreemem(resp_buff.data);
+			resp = nm_unpack_response(&resp_buff, dest_page,
+									  conn_compressed[chan]);
+			if (conn_brokered[chan])
+				pfree(resp_buff.data);
+			else
+				PQfreemem(resp_buff.data);
 
 			if (message_level_is_interesting(PageStoreTrace))
 			{
@@ -326,26 +653,29 @@ pageserver_receive(void)
 		}
 		else if (rc == -1)
 		{
-			neon_log(LOG, "pageserver_receive disconnect because call_PQgetCopyData returns -1: %s", pchomp(PQerrorMessage(pageserver_conn)));
-			pageserver_disconnect();
+			if (conn_brokered[chan])
+				neon_log(LOG, "pageserver_receive disconnect because the brokered connection failed");
+			else
+				neon_log(LOG, "pageserver_receive disconnect because call_PQgetCopyData returns -1: %s", pchomp(PQerrorMessage(pageserver_conn[chan])));
+			pageserver_disconnect(chan);
 			resp = NULL;
 		}
 		else if (rc == -2)
 		{
-			char* msg = pchomp(PQerrorMessage(pageserver_conn));
-			pageserver_disconnect();
+			char* msg = pchomp(PQerrorMessage(pageserver_conn[chan]));
+			pageserver_disconnect(chan);
 			neon_log(ERROR, "pageserver_receive disconnect because could not read COPY data: %s", msg);
 		}
 		else
 		{
-			pageserver_disconnect();
+			pageserver_disconnect(chan);
 			neon_log(ERROR, "pageserver_receive disconnect because unexpected PQgetCopyData return value: %d", rc);
 		}
 	}
 	PG_CATCH();
 	{
 		neon_log(LOG, "pageserver_receive disconnect due to caught exception");
-		pageserver_disconnect();
+		pageserver_disconnect(chan);
 		PG_RE_THROW();
 	}
 	PG_END_TRY();
@@ -355,18 +685,27 @@ pageserver_receive(void)
 
 
 static bool
-pageserver_flush(void)
+pageserver_flush(PsChannel chan)
 {
-	if (!connected)
+	if (!connected[chan])
 	{
 		neon_log(WARNING, "Tried to flush while disconnected");
 	}
+	else if (conn_brokered[chan])
+	{
+		if (!brokered_flush(chan))
+		{
+			neon_log(LOG, "pageserver_flush disconnect because failed to flush brokered connection: %m");
+			pageserver_disconnect(chan);
+			return false;
+		}
+	}
 	else
 	{
-		if (PQflush(pageserver_conn))
+		if (PQflush(pageserver_conn[chan]))
 		{
-			char	   *msg = pchomp(PQerrorMessage(pageserver_conn));
-			pageserver_disconnect();
+			char	   *msg = pchomp(PQerrorMessage(pageserver_conn[chan]));
+			pageserver_disconnect(chan);
 			neon_log(LOG, "pageserver_flush disconnect because failed to flush page requests: %s", msg);
 			pfree(msg);
 			return false;
@@ -459,8 +798,29 @@ pg_init_libpagestore(void)
 							PGC_USERSET,
 							0,	/* no flags required */
 							NULL, (GucIntAssignHook) &readahead_buffer_resize, NULL);
+	DefineCustomBoolVariable("neon.compress_getpage_responses",
+							 "Ask the pageserver to compress GetPage responses",
+							 "Trades CPU for network bandwidth on cold reads. "
+							 "Takes effect on the next pageserver connection.",
+							 &compress_getpage_responses,
+							 false,
+							 PGC_USERSET,
+							 0,	/* no flags required */
+							 NULL, NULL, NULL);
+	DefineCustomIntVariable("neon.readahead_getpage_batch_size",
+							"maximum number of pages requested with one vectored GetPage request",
+							"Sequential scans request up to this many blocks "
+							"ahead of the scan position in a single request. "
+							"Set to 1 to disable vectored readahead.",
+							&readahead_getpage_batch_size,
+							16, 1, 128,
+							PGC_USERSET,
+							0,	/* no flags required */
+							NULL, NULL, NULL);
 
 	relsize_hash_init();
+	getpage_dedup_init();
+	neon_perf_counters_init();
 
 	if (page_server != NULL)
 		neon_log(ERROR, "libpagestore already loaded");
@@ -482,5 +842,6 @@ pg_init_libpagestore(void)
 		old_redo_read_buffer_filter = redo_read_buffer_filter;
 		redo_read_buffer_filter = neon_redo_read_buffer_filter;
 	}
+	pg_init_pagestore_broker();
 	lfc_init();
 }
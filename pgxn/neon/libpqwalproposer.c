@@ -397,28 +397,30 @@ walprop_async_write(WalProposerConn *conn, void const *buf, size_t size)
 }
 
 /*
- * This function is very similar to walprop_async_write. For more
- * information, refer to the comments there.
+ * Queue a CopyData message without flushing, so that a batch of messages can
+ * be pushed to the socket with a single walprop_flush. Returns false on
+ * connection failure.
  */
 bool
-walprop_blocking_write(WalProposerConn *conn, void const *buf, size_t size)
+walprop_async_write_noflush(WalProposerConn *conn, void const *buf, size_t size)
 {
 	int			result;
 
-	/* If we are in non-blocking mode, switch out of it. */
-	if (!ensure_nonblocking_status(conn, false))
-		return false;
-
-	if ((result = PQputCopyData(conn->pg_conn, buf, size)) == -1)
-		return false;
-
-	Assert(result == 1);
-
-	/* Because the connection is non-blocking, flushing returns 0 or -1 */
-
-	if ((result = PQflush(conn->pg_conn)) == -1)
+	/* If we aren't in non-blocking mode, switch to it. */
+	if (!ensure_nonblocking_status(conn, true))
 		return false;
 
-	Assert(result == 0);
-	return true;
+	result = PQputCopyData(conn->pg_conn, buf, size);
+	if (result == 0)
+	{
+		/*
+		 * Full buffers; push what is queued so far to the socket and retry
+		 * once. A repeated refusal means the output buffer cannot grow, which
+		 * we treat as a connection problem.
+		 */
+		if (PQflush(conn->pg_conn) == -1)
+			return false;
+		result = PQputCopyData(conn->pg_conn, buf, size);
+	}
+	return result == 1;
 }
@@ -32,3 +32,45 @@ CREATE VIEW local_cache AS
 	SELECT P.* FROM local_cache_pages() AS P
 	(pageoffs int8, relfilenode oid, reltablespace oid, reldatabase oid,
 	 relforknumber int2, relblocknumber int8, accesscount int4);
+
+CREATE FUNCTION neon_get_lfc_stats(
+    OUT file_cache_hits int8,
+    OUT file_cache_misses int8,
+    OUT file_cache_writes int8,
+    OUT file_cache_evictions int8,
+    OUT file_cache_used_chunks int8,
+    OUT file_cache_size_chunks int8
+)
+RETURNS record
+AS 'MODULE_PATHNAME', 'neon_get_lfc_stats'
+LANGUAGE C STRICT
+PARALLEL SAFE;
+
+CREATE FUNCTION neon_get_prefetch_stats(
+    OUT prefetch_requests_issued int8,
+    OUT prefetch_hits int8,
+    OUT prefetch_wasted int8,
+    OUT prefetch_discarded int8
+)
+RETURNS record
+AS 'MODULE_PATHNAME', 'neon_get_prefetch_stats'
+LANGUAGE C STRICT
+PARALLEL SAFE;
+
+-- One-row view over the file cache and prefetch counters.
+CREATE VIEW pg_stat_neon AS
+	SELECT L.*, P.* FROM neon_get_lfc_stats() L, neon_get_prefetch_stats() P;
+
+CREATE FUNCTION neon_walproposer_stats()
+RETURNS SETOF RECORD
+AS 'MODULE_PATHNAME', 'neon_walproposer_stats'
+LANGUAGE C PARALLEL SAFE;
+
+-- One row per safekeeper plus a summary row (NULL host and port) carrying the
+-- time-to-quorum distribution. Histograms are power-of-two microsecond
+-- buckets: element i (counting from 0) holds latencies in [2^i, 2^(i+1)) us,
+-- the last element everything above.
+CREATE VIEW walproposer_stats AS
+	SELECT S.* FROM neon_walproposer_stats() AS S
+	(host text, port text, bytes_sent int8, bytes_inflight int8,
+	 append_responses int8, rtt_sum_us int8, rtt_histogram int8[]);
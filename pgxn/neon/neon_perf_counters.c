@@ -0,0 +1,126 @@
+/*-------------------------------------------------------------------------
+ *
+ * neon_perf_counters.c
+ *      Shared-memory performance counters, one slot per process.
+ *
+ * The prefetch machinery in pagestore_smgr.c is strictly per-backend, so its
+ * statistics have to be collected where they happen and aggregated when they
+ * are read. Every process gets its own slot in a shared array, indexed by
+ * pgprocno, and bumps its counters with plain stores; the SQL-visible
+ * functions sum the array. Local file cache counters live with the cache
+ * itself in file_cache.c (its partitions are already shared) and are exposed
+ * through the same pg_stat_neon view.
+ *
+ * Portions Copyright (c) 1996-2021, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, Regents of the University of California
+ *
+ * IDENTIFICATION
+ *	  pgxn/neon/neon_perf_counters.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "access/htup_details.h"
+#include "catalog/pg_type.h"
+#include "storage/ipc.h"
+#include "storage/proc.h"
+#include "storage/shmem.h"
+
+#include "neon_perf_counters.h"
+
+NeonPerfCounters *neon_per_proc_counters;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+static void neon_perf_counters_shmem_request(void);
+#endif
+
+static Size
+neon_perf_counters_shmem_size(void)
+{
+	/* One slot per backend plus the auxiliary processes */
+	return mul_size(MaxBackends + NUM_AUXILIARY_PROCS, sizeof(NeonPerfCounters));
+}
+
+static void
+neon_perf_counters_shmem_startup(void)
+{
+	bool		found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	neon_per_proc_counters = (NeonPerfCounters *)
+		ShmemInitStruct("neon_perf_counters", neon_perf_counters_shmem_size(), &found);
+	if (!found)
+		memset(neon_per_proc_counters, 0, neon_perf_counters_shmem_size());
+	LWLockRelease(AddinShmemInitLock);
+}
+
+#if PG_VERSION_NUM >= 150000
+static void
+neon_perf_counters_shmem_request(void)
+{
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+
+	RequestAddinShmemSpace(neon_perf_counters_shmem_size());
+}
+#endif
+
+void
+neon_perf_counters_init(void)
+{
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = neon_perf_counters_shmem_startup;
+#if PG_VERSION_NUM >= 150000
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = neon_perf_counters_shmem_request;
+#else
+	RequestAddinShmemSpace(neon_perf_counters_shmem_size());
+#endif
+}
+
+/*
+ * Sum of the prefetch counters over all processes, as one row.
+ */
+PG_FUNCTION_INFO_V1(neon_get_prefetch_stats);
+
+Datum
+neon_get_prefetch_stats(PG_FUNCTION_ARGS)
+{
+	NeonPerfCounters total = {0};
+	int			n_slots = MaxBackends + NUM_AUXILIARY_PROCS;
+	Datum		values[4];
+	bool		nulls[4] = {false, false, false, false};
+	TupleDesc	tupdesc;
+
+	for (int i = 0; i < n_slots; i++)
+	{
+		NeonPerfCounters *c = &neon_per_proc_counters[i];
+
+		total.prefetch_requests_issued += c->prefetch_requests_issued;
+		total.prefetch_hits += c->prefetch_hits;
+		total.prefetch_wasted += c->prefetch_wasted;
+		total.prefetch_discarded += c->prefetch_discarded;
+	}
+
+	tupdesc = CreateTemplateTupleDesc(4);
+	TupleDescInitEntry(tupdesc, (AttrNumber) 1, "prefetch_requests_issued", INT8OID, -1, 0);
+	TupleDescInitEntry(tupdesc, (AttrNumber) 2, "prefetch_hits", INT8OID, -1, 0);
+	TupleDescInitEntry(tupdesc, (AttrNumber) 3, "prefetch_wasted", INT8OID, -1, 0);
+	TupleDescInitEntry(tupdesc, (AttrNumber) 4, "prefetch_discarded", INT8OID, -1, 0);
+	tupdesc = BlessTupleDesc(tupdesc);
+
+	values[0] = Int64GetDatum((int64) total.prefetch_requests_issued);
+	values[1] = Int64GetDatum((int64) total.prefetch_hits);
+	values[2] = Int64GetDatum((int64) total.prefetch_wasted);
+	values[3] = Int64GetDatum((int64) total.prefetch_discarded);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
@@ -0,0 +1,38 @@
+/*-------------------------------------------------------------------------
+ *
+ * neon_perf_counters.h
+ *      Shared-memory performance counters, one slot per process.
+ *
+ * Portions Copyright (c) 1996-2021, PostgreSQL Global Development Group
+ * Portions Copyright (c) 1994, Regents of the University of California
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef NEON_PERF_COUNTERS_H
+#define NEON_PERF_COUNTERS_H
+
+#include "storage/proc.h"
+
+/*
+ * Each process owns one slot of the shared array and updates it with plain
+ * stores, without locking or atomics: the counters are monotonic and only
+ * statistics, so readers aggregating the array can tolerate slightly stale
+ * values. This keeps the counters cheap enough to leave enabled in
+ * production.
+ */
+typedef struct NeonPerfCounters
+{
+	uint64		prefetch_requests_issued;	/* GetPage requests sent for readahead */
+	uint64		prefetch_hits;				/* reads satisfied from the prefetch ring */
+	uint64		prefetch_wasted;			/* prefetched pages evicted unused */
+	uint64		prefetch_discarded;			/* prefetched pages unusable (stale LSN) */
+} NeonPerfCounters;
+
+extern NeonPerfCounters *neon_per_proc_counters;
+
+/* This process's slot; valid once shared memory is attached */
+#define MyNeonCounters (&neon_per_proc_counters[MyProc->pgprocno])
+
+extern void neon_perf_counters_init(void);
+
+#endif							/* NEON_PERF_COUNTERS_H */
@@ -0,0 +1,558 @@
+/*-------------------------------------------------------------------------
+ *
+ * pagestore_broker.c
+ *	  Warm-start broker for pageserver connections.
+ *
+ * Establishing a pageserver connection is not cheap: a full libpq
+ * handshake (TCP connect, authentication) followed by the 'pagestream'
+ * command round trip, all before the first GetPage request can be sent.
+ * Every fresh backend pays that cost on its first read, and with
+ * short-lived connection-pooled clients it dominates first-query latency.
+ *
+ * The broker is a background worker that keeps a small pool of
+ * pre-established, authenticated pagestream connections. Backends ask for
+ * one over a unix socket rendezvous in the data directory; the broker
+ * answers by passing the raw socket descriptor with SCM_RIGHTS, so a fresh
+ * backend's first request costs one local IPC hop instead of the whole
+ * handshake. The handed-over socket is no longer driven by libpq on the
+ * backend side - libpagestore.c speaks the CopyBoth subprotocol on it
+ * directly.
+ *
+ * If the broker is not running, has no connection ready, or anything about
+ * the rendezvous fails, the backend silently falls back to connecting
+ * directly, so the broker is strictly an optimization.
+ *
+ * IDENTIFICATION
+ *	 contrib/neon/pagestore_broker.c
+ *
+ *-------------------------------------------------------------------------
+ */
+#include "postgres.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "libpq-fe.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/procsignal.h"
+#include "utils/guc.h"
+
+#include "neon.h"
+#include "pagestore_client.h"
+
+/* rendezvous socket, relative to the data directory (every process' cwd) */
+#define PS_BROKER_SOCKET		"neon-broker.socket"
+
+#define PS_BROKER_MAX_POOL		64
+
+/* how long to sleep between pool health checks, and reconnect backoff */
+#define PS_BROKER_HEALTH_INTERVAL_MS	10000
+#define PS_BROKER_MIN_BACKOFF_MS		1000
+#define PS_BROKER_MAX_BACKOFF_MS		60000
+
+/*
+ * Handoff protocol: the backend sends one request byte ('C'), the broker
+ * answers with one status byte, with the connection's file descriptor
+ * attached via SCM_RIGHTS for the 'c' and 'z' answers.
+ */
+#define PS_BROKER_REQ_CONN		'C'
+#define PS_BROKER_ST_PLAIN		'c' /* connection, no compression */
+#define PS_BROKER_ST_COMPRESSED 'z' /* connection with compress=zlib */
+#define PS_BROKER_ST_NONE		'n' /* nothing available right now */
+
+int			ps_broker_pool_size = 2;
+
+/* the pool, used only inside the broker worker */
+static PGconn *pool_conn[PS_BROKER_MAX_POOL];
+static bool pool_compressed[PS_BROKER_MAX_POOL];
+
+/*
+ * Cleared when the pageserver rejects the compress option, so we don't
+ * repeat the extra handshake round trip for every pooled connection.
+ */
+static bool broker_compression_supported = true;
+
+void		PagestoreBrokerMain(Datum main_arg);
+
+/*
+ * Establish one authenticated pagestream connection, the same way
+ * pageserver_connect in libpagestore.c does, but with blocking waits: the
+ * broker has nothing better to do. Returns NULL (with a LOG message) on
+ * failure.
+ */
+static PGconn *
+broker_establish(bool *compressed)
+{
+	const char *keywords[3];
+	const char *values[3];
+	int			n;
+	PGconn	   *conn;
+	char	   *query;
+	bool		try_compress;
+
+retry:
+	try_compress = compress_getpage_responses && broker_compression_supported;
+
+	n = 0;
+	if (neon_auth_token)
+	{
+		keywords[n] = "password";
+		values[n] = neon_auth_token;
+		n++;
+	}
+	keywords[n] = "dbname";
+	values[n] = page_server_connstring;
+	n++;
+	keywords[n] = NULL;
+	values[n] = NULL;
+	n++;
+	conn = PQconnectdbParams(keywords, values, 1);
+
+	if (PQstatus(conn) == CONNECTION_BAD)
+	{
+		char	   *msg = pchomp(PQerrorMessage(conn));
+
+		PQfinish(conn);
+		neon_log(LOG, "broker could not establish connection to pageserver: %s", msg);
+		pfree(msg);
+		return NULL;
+	}
+
+	query = psprintf("pagestream %s %s%s", neon_tenant, neon_timeline,
+					 try_compress ? " compress=zlib" : "");
+	if (PQsendQuery(conn, query) != 1)
+	{
+		pfree(query);
+		PQfinish(conn);
+		neon_log(LOG, "broker could not send pagestream command to pageserver");
+		return NULL;
+	}
+	pfree(query);
+
+	while (PQisBusy(conn))
+	{
+		int			rc;
+
+		rc = WaitLatchOrSocket(MyLatch,
+							   WL_LATCH_SET | WL_SOCKET_READABLE | WL_EXIT_ON_PM_DEATH,
+							   PQsocket(conn), -1L, PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+
+		if (ShutdownRequestPending)
+		{
+			PQfinish(conn);
+			return NULL;
+		}
+
+		if ((rc & WL_SOCKET_READABLE) && !PQconsumeInput(conn))
+		{
+			char	   *msg = pchomp(PQerrorMessage(conn));
+
+			PQfinish(conn);
+			neon_log(LOG, "broker could not complete handshake with pageserver: %s", msg);
+			pfree(msg);
+			return NULL;
+		}
+	}
+
+	/*
+	 * If we asked for compression, check that the pageserver accepted the
+	 * pagestream command; an older pageserver rejects the extra option.
+	 */
+	if (try_compress)
+	{
+		PGresult   *res = PQgetResult(conn);
+
+		if (PQresultStatus(res) != PGRES_COPY_BOTH)
+		{
+			PQclear(res);
+			PQfinish(conn);
+			broker_compression_supported = false;
+			neon_log(LOG, "pageserver does not support compressed responses, pooling uncompressed connections");
+			goto retry;
+		}
+		PQclear(res);
+	}
+
+	*compressed = try_compress;
+	return conn;
+}
+
+/*
+ * Is a pooled connection still good to hand out?
+ *
+ * libpq keeps its sockets non-blocking, so PQconsumeInput never waits here.
+ * The pageserver sends nothing unsolicited on an idle pagestream
+ * connection, so any failure means the connection is gone.
+ */
+static bool
+broker_conn_is_live(PGconn *conn)
+{
+	if (!PQconsumeInput(conn))
+		return false;
+	return PQstatus(conn) == CONNECTION_OK;
+}
+
+/* Drop pooled connections whose pageserver side went away. */
+static void
+broker_sweep_pool(void)
+{
+	for (int i = 0; i < ps_broker_pool_size; i++)
+	{
+		if (pool_conn[i] != NULL && !broker_conn_is_live(pool_conn[i]))
+		{
+			neon_log(LOG, "pooled pageserver connection went away, dropping it");
+			PQfinish(pool_conn[i]);
+			pool_conn[i] = NULL;
+		}
+	}
+}
+
+/*
+ * Fill empty pool slots. Returns false if an establish attempt failed, so
+ * the main loop can back off instead of hammering a down pageserver.
+ */
+static bool
+broker_fill_pool(void)
+{
+	for (int i = 0; i < ps_broker_pool_size; i++)
+	{
+		if (ShutdownRequestPending)
+			break;
+		if (pool_conn[i] != NULL)
+			continue;
+		pool_conn[i] = broker_establish(&pool_compressed[i]);
+		if (pool_conn[i] == NULL)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Pass pooled connection 'i' to the client and detach it from our libpq
+ * handle. Returns false with the pool slot untouched if the handoff failed.
+ */
+static bool
+broker_send_conn(pgsocket client, int i)
+{
+	PGconn	   *conn = pool_conn[i];
+	char		status = pool_compressed[i] ? PS_BROKER_ST_COMPRESSED : PS_BROKER_ST_PLAIN;
+	int			sock;
+	struct msghdr msg;
+	struct iovec iov;
+
+	union
+	{
+		struct cmsghdr hdr;
+		char		buf[CMSG_SPACE(sizeof(int))];
+	}			cmsgbuf;
+	struct cmsghdr *cmsg;
+	ssize_t		rc;
+
+	sock = dup(PQsocket(conn));
+	if (sock < 0)
+	{
+		neon_log(LOG, "could not dup pooled pageserver socket: %m");
+		return false;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &status;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsgbuf.buf;
+	msg.msg_controllen = sizeof(cmsgbuf.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &sock, sizeof(int));
+
+	do
+	{
+		rc = sendmsg(client, &msg, 0);
+	} while (rc < 0 && errno == EINTR);
+	close(sock);
+
+	if (rc != 1)
+	{
+		neon_log(LOG, "could not pass pageserver connection to backend: %m");
+		return false;
+	}
+
+	/*
+	 * The backend owns the session now. Close the descriptor out from under
+	 * libpq before PQfinish, so that no Terminate message is sent on the
+	 * handed-over connection.
+	 */
+	close(PQsocket(conn));
+	PQfinish(conn);
+	pool_conn[i] = NULL;
+	return true;
+}
+
+/* Answer one backend's request for a connection. */
+static void
+broker_handoff(pgsocket client)
+{
+	char		req;
+	char		none = PS_BROKER_ST_NONE;
+	struct timeval tv;
+
+	/* never let a misbehaving client wedge the broker */
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+	(void) setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	(void) setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	if (recv(client, &req, 1, 0) != 1 || req != PS_BROKER_REQ_CONN)
+		return;
+
+	for (int i = 0; i < ps_broker_pool_size; i++)
+	{
+		if (pool_conn[i] == NULL)
+			continue;
+		if (!broker_conn_is_live(pool_conn[i]))
+		{
+			PQfinish(pool_conn[i]);
+			pool_conn[i] = NULL;
+			continue;
+		}
+		(void) broker_send_conn(client, i);
+		return;
+	}
+
+	/* nothing warm available; the backend will connect directly */
+	(void) send(client, &none, 1, 0);
+}
+
+/* Accept and serve every client waiting on the rendezvous socket. */
+static void
+broker_serve(pgsocket listen_sock)
+{
+	for (;;)
+	{
+		pgsocket	client;
+
+		client = accept(listen_sock, NULL, NULL);
+		if (client < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				neon_log(LOG, "could not accept connection on broker socket: %m");
+			return;
+		}
+		broker_handoff(client);
+		close(client);
+	}
+}
+
+void
+PagestoreBrokerMain(Datum main_arg)
+{
+	pgsocket	listen_sock;
+	struct sockaddr_un addr;
+	WaitEventSet *wes;
+	int			backoff_ms = PS_BROKER_MIN_BACKOFF_MS;
+
+	pqsignal(SIGUSR1, procsignal_sigusr1_handler);
+	pqsignal(SIGHUP, SignalHandlerForConfigReload);
+	pqsignal(SIGTERM, SignalHandlerForShutdownRequest);
+	BackgroundWorkerUnblockSignals();
+
+	/* set up the rendezvous socket in the data directory */
+	unlink(PS_BROKER_SOCKET);
+	listen_sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_sock < 0)
+		elog(FATAL, "could not create broker socket: %m");
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strlcpy(addr.sun_path, PS_BROKER_SOCKET, sizeof(addr.sun_path));
+	if (bind(listen_sock, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+		elog(FATAL, "could not bind broker socket \"%s\": %m", PS_BROKER_SOCKET);
+	if (listen(listen_sock, 64) < 0)
+		elog(FATAL, "could not listen on broker socket: %m");
+	if (!pg_set_noblock(listen_sock))
+		elog(FATAL, "could not set broker socket to nonblocking mode: %m");
+
+	wes = CreateWaitEventSet(TopMemoryContext, 3);
+	AddWaitEventToSet(wes, WL_LATCH_SET, PGINVALID_SOCKET, MyLatch, NULL);
+	AddWaitEventToSet(wes, WL_EXIT_ON_PM_DEATH, PGINVALID_SOCKET, NULL, NULL);
+	AddWaitEventToSet(wes, WL_SOCKET_READABLE, listen_sock, NULL, NULL);
+
+	neon_log(LOG, "pageserver connection broker started, keeping %d warm connections",
+			 ps_broker_pool_size);
+
+	while (!ShutdownRequestPending)
+	{
+		WaitEvent	event;
+		long		timeout;
+		int			rc;
+
+		if (ConfigReloadPending)
+		{
+			ConfigReloadPending = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		broker_sweep_pool();
+		if (broker_fill_pool())
+		{
+			backoff_ms = PS_BROKER_MIN_BACKOFF_MS;
+			timeout = PS_BROKER_HEALTH_INTERVAL_MS;
+		}
+		else
+		{
+			/* pageserver unreachable; retry with increasing backoff */
+			timeout = backoff_ms;
+			backoff_ms = Min(backoff_ms * 2, PS_BROKER_MAX_BACKOFF_MS);
+		}
+
+		rc = WaitEventSetWait(wes, timeout, &event, 1, PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+
+		if (rc > 0 && (event.events & WL_SOCKET_READABLE))
+			broker_serve(listen_sock);
+	}
+
+	/* don't leave a dangling rendezvous point behind */
+	unlink(PS_BROKER_SOCKET);
+	proc_exit(0);
+}
+
+/*
+ * Backend side: ask the broker for a pre-established pagestream connection.
+ *
+ * Returns the socket descriptor and sets *compressed to whether the
+ * connection negotiated compressed GetPage responses, or returns -1 if no
+ * connection could be obtained; the caller then connects directly.
+ */
+int
+broker_request_conn(bool *compressed)
+{
+	pgsocket	sock;
+	struct sockaddr_un addr;
+	struct timeval tv;
+	char		req = PS_BROKER_REQ_CONN;
+	char		status = PS_BROKER_ST_NONE;
+	struct msghdr msg;
+	struct iovec iov;
+
+	union
+	{
+		struct cmsghdr hdr;
+		char		buf[CMSG_SPACE(sizeof(int))];
+	}			cmsgbuf;
+	struct cmsghdr *cmsg;
+	ssize_t		rc;
+	int			fd = -1;
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0)
+		return -1;
+
+	/* never let a wedged broker stall the backend; fall back instead */
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+	(void) setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	(void) setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strlcpy(addr.sun_path, PS_BROKER_SOCKET, sizeof(addr.sun_path));
+	if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+	{
+		/* broker not running (yet) */
+		close(sock);
+		return -1;
+	}
+
+	if (send(sock, &req, 1, 0) != 1)
+	{
+		close(sock);
+		return -1;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &status;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsgbuf.buf;
+	msg.msg_controllen = sizeof(cmsgbuf.buf);
+
+	do
+	{
+		rc = recvmsg(sock, &msg, 0);
+	} while (rc < 0 && errno == EINTR);
+	close(sock);
+
+	if (rc != 1)
+		return -1;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg != NULL &&
+		cmsg->cmsg_level == SOL_SOCKET &&
+		cmsg->cmsg_type == SCM_RIGHTS &&
+		cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+		memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+	if ((status != PS_BROKER_ST_PLAIN && status != PS_BROKER_ST_COMPRESSED) ||
+		fd < 0)
+	{
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	*compressed = (status == PS_BROKER_ST_COMPRESSED);
+	return fd;
+}
+
+static void
+broker_register_worker(void)
+{
+	BackgroundWorker bgw;
+
+	memset(&bgw, 0, sizeof(bgw));
+	bgw.bgw_flags = BGWORKER_SHMEM_ACCESS;
+	bgw.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	snprintf(bgw.bgw_library_name, BGW_MAXLEN, "neon");
+	snprintf(bgw.bgw_function_name, BGW_MAXLEN, "PagestoreBrokerMain");
+	snprintf(bgw.bgw_name, BGW_MAXLEN, "Pageserver connection broker");
+	snprintf(bgw.bgw_type, BGW_MAXLEN, "Pageserver connection broker");
+	bgw.bgw_restart_time = 5;
+	bgw.bgw_notify_pid = 0;
+	bgw.bgw_main_arg = (Datum) 0;
+
+	RegisterBackgroundWorker(&bgw);
+}
+
+void
+pg_init_pagestore_broker(void)
+{
+	DefineCustomIntVariable("neon.connection_broker_pool_size",
+							"number of warm pageserver connections kept by the connection broker",
+							"The broker background worker keeps this many "
+							"pre-established pagestream connections and "
+							"hands them to backends on their first "
+							"pageserver request. Set to 0 to disable the "
+							"broker.",
+							&ps_broker_pool_size,
+							2, 0, PS_BROKER_MAX_POOL,
+							PGC_POSTMASTER,
+							0,	/* no flags required */
+							NULL, NULL, NULL);
+
+	if (ps_broker_pool_size > 0 &&
+		page_server_connstring && page_server_connstring[0])
+		broker_register_worker();
+}
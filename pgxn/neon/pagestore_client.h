@@ -16,6 +16,7 @@
 #include "postgres.h"
 
 #include "access/xlogdefs.h"
+#include "storage/buf_internals.h"
 #include "storage/relfilenode.h"
 #include "storage/block.h"
 #include "storage/smgr.h"
@@ -32,6 +33,7 @@ typedef enum
 	T_NeonNblocksRequest,
 	T_NeonGetPageRequest,
 	T_NeonDbSizeRequest,
+	T_NeonGetPageVRequest,
 
 	/* pagestore -> pagestore_client */
 	T_NeonExistsResponse = 100,
@@ -39,6 +41,7 @@ typedef enum
 	T_NeonGetPageResponse,
 	T_NeonErrorResponse,
 	T_NeonDbSizeResponse,
+	T_NeonGetPageVResponse,
 }			NeonMessageTag;
 
 /* base struct for c-style inheritance */
@@ -96,6 +99,20 @@ typedef struct
 	BlockNumber blkno;
 }			NeonGetPageRequest;
 
+/*
+ * Vectored version of NeonGetPageRequest: requests 'nblocks' consecutive
+ * blocks starting at 'blkno', all at the same LSN. The pages come back in
+ * a single NeonGetPageVResponse.
+ */
+typedef struct
+{
+	NeonRequest req;
+	RelFileNode rnode;
+	ForkNumber	forknum;
+	BlockNumber blkno;
+	uint32		nblocks;
+}			NeonGetPageVRequest;
+
 /* supertype of all the Neon*Response structs below */
 typedef struct
 {
@@ -122,6 +139,14 @@ typedef struct
 
 #define PS_GETPAGERESPONSE_SIZE (MAXALIGN(offsetof(NeonGetPageResponse, page) + BLCKSZ))
 
+typedef struct
+{
+	NeonMessageTag tag;
+	uint32		n_pages;
+	char		pages[FLEXIBLE_ARRAY_MEMBER];	/* n_pages * BLCKSZ page
+												 * images, back to back */
+}			NeonGetPageVResponse;
+
 typedef struct
 {
 	NeonMessageTag tag;
@@ -136,18 +161,36 @@ typedef struct
 }			NeonErrorResponse;
 
 extern StringInfoData nm_pack_request(NeonRequest * msg);
-extern NeonResponse * nm_unpack_response(StringInfo s);
+extern NeonResponse * nm_unpack_response(StringInfo s, char *dest_page, bool compressed);
 extern char *nm_to_string(NeonMessage * msg);
 
 /*
  * API
  */
 
+/*
+ * Each backend talks to the pageserver over a small pool of connections,
+ * one per channel, multiplexed by request tag: synchronous (demand) requests
+ * must not queue behind the prefetch pipeline, and losing the connection of
+ * one channel must not invalidate the in-flight requests of the other.
+ */
+typedef enum
+{
+	PS_CHANNEL_SYNC = 0,		/* demand GetPage and metadata requests */
+	PS_CHANNEL_PREFETCH,		/* prefetch/readahead request pipeline */
+	NUM_PS_CHANNELS
+}			PsChannel;
+
+/*
+ * 'dest_page' of receive(), when not NULL, is where the page image of a
+ * GetPage response is placed directly, bypassing the response struct; see
+ * nm_unpack_response().
+ */
 typedef struct
 {
-	bool		(*send) (NeonRequest * request);
-	NeonResponse *(*receive) (void);
-	bool		(*flush) (void);
+	bool		(*send) (PsChannel chan, NeonRequest * request);
+	NeonResponse *(*receive) (PsChannel chan, char *dest_page);
+	bool		(*flush) (PsChannel chan);
 }			page_server_api;
 
 extern void prefetch_on_ps_disconnect(void);
@@ -155,8 +198,10 @@ extern void prefetch_on_ps_disconnect(void);
 extern page_server_api * page_server;
 
 extern char *page_server_connstring;
+extern bool compress_getpage_responses;
 extern int flush_every_n_requests;
 extern int readahead_buffer_size;
+extern int readahead_getpage_batch_size;
 extern bool seqscan_prefetch_enabled;
 extern int seqscan_prefetch_distance;
 extern char *neon_timeline;
@@ -164,6 +209,12 @@ extern char *neon_tenant;
 extern bool wal_redo;
 extern int32 max_cluster_size;
 
+/* pagestore_broker.c */
+extern int	ps_broker_pool_size;
+extern void pg_init_pagestore_broker(void);
+extern int	broker_request_conn(bool *compressed);
+extern void PagestoreBrokerMain(Datum main_arg);
+
 extern const f_smgr *smgr_neon(BackendId backend, RelFileNode rnode);
 extern void smgr_init_neon(void);
 extern void readahead_buffer_resize(int newsize, void *extra);
@@ -196,6 +247,19 @@ extern void neon_truncate(SMgrRelation reln, ForkNumber forknum,
 						  BlockNumber nblocks);
 extern void neon_immedsync(SMgrRelation reln, ForkNumber forknum);
 
+/* cross-backend GetPage request deduplication */
+typedef enum
+{
+	GETPAGE_DEDUP_BYPASS,		/* caller must request the page itself */
+	GETPAGE_DEDUP_HIT,			/* buffer was filled from a shared response */
+	GETPAGE_DEDUP_LEADER,		/* caller requests on behalf of all backends */
+}			GetPageDedupResult;
+
+extern void getpage_dedup_init(void);
+extern GetPageDedupResult getpage_dedup_begin(BufferTag tag, XLogRecPtr lsn, char *buffer);
+extern void getpage_dedup_complete(BufferTag tag, const char *page);
+extern void getpage_dedup_abort(BufferTag tag);
+
 /* utils for neon relsize cache */
 extern void relsize_hash_init(void);
 extern bool get_cached_relsize(RelFileNode rnode, ForkNumber forknum, BlockNumber *size);
@@ -207,6 +271,7 @@ extern void forget_cached_relsize(RelFileNode rnode, ForkNumber forknum);
 extern void lfc_write(RelFileNode rnode, ForkNumber forkNum, BlockNumber blkno, char *buffer);
 extern bool lfc_read(RelFileNode rnode, ForkNumber forkNum, BlockNumber blkno, char *buffer);
 extern bool lfc_cache_contains(RelFileNode rnode, ForkNumber forkNum, BlockNumber blkno);
+extern int  lfc_chunk_promote_range(RelFileNode rnode, ForkNumber forkNum, BlockNumber blkno, BlockNumber* start);
 extern void lfc_evict(RelFileNode rnode, ForkNumber forkNum, BlockNumber blkno);
 extern void lfc_init(void);
 
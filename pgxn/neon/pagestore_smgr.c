@@ -45,6 +45,8 @@
  */
 #include "postgres.h"
 
+#include <zlib.h>
+
 #include "access/xact.h"
 #include "access/xlog.h"
 #include "access/xloginsert.h"
@@ -53,7 +55,9 @@
 #include "catalog/pg_class.h"
 #include "common/hashfn.h"
 #include "executor/instrument.h"
+#include "lib/ilist.h"
 #include "pagestore_client.h"
+#include "neon_perf_counters.h"
 #include "postmaster/interrupt.h"
 #include "postmaster/autovacuum.h"
 #include "replication/walsender.h"
@@ -62,6 +66,7 @@
 #include "storage/buf_internals.h"
 #include "storage/smgr.h"
 #include "storage/md.h"
+#include "utils/hsearch.h"
 #include "pgstat.h"
 
 
@@ -112,27 +117,33 @@ static UnloggedBuildPhase unlogged_build_phase = UNLOGGED_BUILD_NOT_IN_PROGRESS;
  * There can be up to readahead_buffer_size active IO requests registered at
  * any time. Requests using smgr_prefetch are sent to the pageserver, but we
  * don't wait on the response. Requests using smgr_read are either read from
- * the buffer, or (if that's not possible) we wait on the response to arrive -
- * this also will allow us to receive other prefetched pages. 
+ * the buffer, or (if that's not possible) requested synchronously.
  * Each request is immediately written to the output buffer of the pageserver
  * connection, but may not be flushed if smgr_prefetch is used: pageserver
  * flushes sent requests on manual flush, or every neon.flush_output_after
  * unflushed requests; which is not necessarily always and all the time.
  *
+ * Prefetch requests travel on their own pageserver connection
+ * (PS_CHANNEL_PREFETCH); synchronous requests (demand reads that miss the
+ * prefetch buffer, and metadata requests) use a separate connection
+ * (PS_CHANNEL_SYNC), so they neither queue behind the prefetch pipeline nor
+ * require draining it, and a reconnect of one channel does not invalidate
+ * the in-flight requests of the other.
+ *
  * Once we have received a response, this value will be stored in the response
  * buffer, indexed in a hash table. This allows us to retain our buffered
  * prefetch responses even when we have cache misses.
  *
  * Reading of prefetch responses is delayed until them are actually needed
- * (smgr_read). In case of prefetch miss or any other SMGR request other than
- * smgr_read, all prefetch responses in the pipeline will need to be read from
- * the connection; the responses are stored for later use.
+ * (smgr_read), or until the ring buffer needs the oldest slot back.
  *
  * NOTE: The current implementation of the prefetch system implements a ring
  * buffer of up to readahead_buffer_size requests. If there are more _read and
  * _prefetch requests between the initial _prefetch and the _read of a buffer,
- * the prefetch request will have been dropped from this prefetch buffer, and
- * your prefetch was wasted.
+ * the prefetch request is dropped from this prefetch buffer. A page whose
+ * response had already arrived when that happens is not thrown away, though:
+ * it is parked in a backend-local pool keyed by buffer tag (see
+ * prefetch_park_response), where a later _read can still pick it up.
  */
 
 /*
@@ -162,6 +173,10 @@ typedef struct PrefetchRequest {
 	XLogRecPtr	effective_request_lsn;
 	NeonResponse *response; /* may be null */
 	PrefetchStatus status;
+	uint16		batch_size;	/* number of pages carried by the response for
+							 * this slot: > 1 on the head slot of a vectored
+							 * GetPage request, 0 otherwise */
+	instr_time	request_time;	/* when the request was written out */
 	uint64		my_ring_index;
 } PrefetchRequest;
 
@@ -221,6 +236,17 @@ typedef struct PrefetchState {
 	int		n_requests_inflight;	/* count of PS requests considered in flight */
 	int		n_unused;				/* count of buffers < unused, > last, that are also unused */
 
+	/*
+	 * Adaptive readahead window: sized towards the bandwidth-delay product
+	 * of the scan (observed GetPage completion latency over the rate at
+	 * which the scan consumes blocks), and halved whenever a prefetched
+	 * page is evicted unused. Kept within [1, readahead_getpage_batch_size].
+	 */
+	double	ewma_latency_us;		/* smoothed request completion latency */
+	double	ewma_interval_us;		/* smoothed interval of sequential reads */
+	instr_time last_seq_read_time;	/* time of the last sequential read */
+	int		ra_window;				/* current readahead window, in blocks */
+
 	/* the buffers */
 	prfh_hash *prf_hash;
 	PrefetchRequest prf_buffer[]; /* prefetch buffers */
@@ -246,11 +272,158 @@ PrefetchState *MyPState;
 
 XLogRecPtr	prefetch_lsn = 0;
 
+/* EWMA smoothing: new samples get a weight of 1/8 */
+static inline double
+prefetch_ewma(double old, double sample)
+{
+	return old == 0 ? sample : old + (sample - old) / 8;
+}
+
+/*
+ * Record the completion latency of a prefetch request and feed it into the
+ * smoothed latency used to size the readahead window.
+ */
+static void
+prefetch_note_latency(PrefetchRequest *slot)
+{
+	instr_time	since;
+
+	if (INSTR_TIME_IS_ZERO(slot->request_time))
+		return;
+
+	INSTR_TIME_SET_CURRENT(since);
+	INSTR_TIME_SUBTRACT(since, slot->request_time);
+	MyPState->ewma_latency_us =
+		prefetch_ewma(MyPState->ewma_latency_us, INSTR_TIME_GET_MICROSEC(since));
+}
+
+/*
+ * A prefetched page was thrown away without being read: the window ran
+ * deeper than the scan needed, so shrink it.
+ */
+static inline void
+prefetch_note_waste(void)
+{
+	MyPState->ra_window = Max(1, MyPState->ra_window / 2);
+	MyNeonCounters->prefetch_wasted += 1;
+}
+
+/*
+ * Parking pool for prefetched pages that fell off the ring.
+ *
+ * When the ring buffer needs its oldest slot back while that slot still
+ * holds a received-but-unread page, throwing the page away would waste the
+ * round trip that fetched it. Instead we "park" the response in a small
+ * backend-local pool keyed by buffer tag, where neon_read_at_lsn can still
+ * find it. A parked page is subject to the same effective_request_lsn
+ * validity check as a ring slot, so serving one is exactly as correct as
+ * serving it from the ring would have been, and a pageserver disconnect
+ * does not invalidate it: the response had already arrived in full.
+ *
+ * The pool holds at most readahead_buffer_size pages. When it overflows,
+ * the page that was parked longest ago is finally counted as wasted and
+ * freed.
+ */
+typedef struct ParkedPage {
+	BufferTag	buftag;			/* hash key; must be first */
+	XLogRecPtr	effective_request_lsn;
+	NeonResponse *response;
+	dlist_node	fifo_node;		/* position in parked_pages_fifo */
+} ParkedPage;
+
+static HTAB *parked_pages;
+static dlist_head parked_pages_fifo = DLIST_STATIC_INIT(parked_pages_fifo);
+static int	n_parked_pages;
+
+static void
+parked_page_free(ParkedPage *parked)
+{
+	BufferTag	tag = parked->buftag;
+
+	dlist_delete(&parked->fifo_node);
+	pfree(parked->response);
+	hash_search(parked_pages, &tag, HASH_REMOVE, NULL);
+	n_parked_pages -= 1;
+}
+
+/*
+ * Move the received response of 'slot' into the parking pool.
+ *
+ * On return the slot no longer owns a response and can be released with
+ * prefetch_set_unused without the page being lost. Error responses are not
+ * parked; reporting those can wait until the page is actually demanded.
+ */
+static void
+prefetch_park_response(PrefetchRequest *slot)
+{
+	ParkedPage *parked;
+	bool		found;
+
+	Assert(slot->status == PRFS_RECEIVED);
+
+	if (slot->response->tag != T_NeonGetPageResponse)
+	{
+		prefetch_note_waste();
+		return;
+	}
+
+	if (parked_pages == NULL)
+	{
+		HASHCTL		hash_ctl = {};
+
+		hash_ctl.keysize = sizeof(BufferTag);
+		hash_ctl.entrysize = sizeof(ParkedPage);
+		hash_ctl.hcxt = TopMemoryContext;
+		parked_pages = hash_create("Neon parked prefetch responses",
+								   readahead_buffer_size,
+								   &hash_ctl,
+								   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+
+	/* The page parked longest ago makes room; it was truly wasted */
+	while (n_parked_pages >= readahead_buffer_size)
+	{
+		parked_page_free(dlist_container(ParkedPage, fifo_node,
+										 dlist_head_node(&parked_pages_fifo)));
+		prefetch_note_waste();
+	}
+
+	parked = hash_search(parked_pages, &slot->buftag, HASH_ENTER, &found);
+	if (found)
+	{
+		/* replace an older copy of the same page */
+		dlist_delete(&parked->fifo_node);
+		pfree(parked->response);
+		n_parked_pages -= 1;
+	}
+	parked->effective_request_lsn = slot->effective_request_lsn;
+	parked->response = slot->response;
+	dlist_push_tail(&parked_pages_fifo, &parked->fifo_node);
+	n_parked_pages += 1;
+
+	/* The slot keeps only its tag; account the response as handed over */
+	slot->response = NULL;
+	slot->status = PRFS_TAG_REMAINS;
+	MyPState->n_responses_buffered -= 1;
+	MyPState->n_unused += 1;
+}
+
+/*
+ * Sequential-scan detection state for vectored readahead: the last block
+ * read through neon_read, and the first block past the range we have
+ * already requested ahead of it.
+ */
+static RelFileNode last_read_rnode;
+static ForkNumber last_read_forknum = InvalidForkNumber;
+static BlockNumber last_read_blkno = InvalidBlockNumber;
+static BlockNumber readahead_next_blkno;
+
 static bool compact_prefetch_buffers(void);
-static void consume_prefetch_responses(void);
-static uint64 prefetch_register_buffer(BufferTag tag, bool *force_latest, XLogRecPtr *force_lsn);
+static uint64 prefetch_register_buffer(BufferTag tag);
+static int prefetch_register_buffer_batch(BufferTag tag, int nblocks);
 static bool prefetch_read(PrefetchRequest *slot);
-static void prefetch_do_request(PrefetchRequest *slot, bool *force_latest, XLogRecPtr *force_lsn);
+static bool prefetch_read_batch(PrefetchRequest *slot);
+static void prefetch_do_request(PrefetchRequest *slot);
 static bool prefetch_wait_for(uint64 ring_index);
 static void prefetch_cleanup_trailing_unused(void);
 static inline void prefetch_set_unused(uint64 ring_index);
@@ -379,6 +552,10 @@ readahead_buffer_resize(int newsize, void *extra)
 	newPState->n_unused = newsize;
 	newPState->n_requests_inflight = 0;
 	newPState->n_responses_buffered = 0;
+	newPState->ewma_latency_us = MyPState->ewma_latency_us;
+	newPState->ewma_interval_us = MyPState->ewma_interval_us;
+	newPState->last_seq_read_time = MyPState->last_seq_read_time;
+	newPState->ra_window = MyPState->ra_window;
 	newPState->ring_last = newsize;
 	newPState->ring_unused = newsize;
 	newPState->ring_receive = newsize;
@@ -444,19 +621,6 @@ readahead_buffer_resize(int newsize, void *extra)
 
 
 
-/*
- * Make sure that there are no responses still in the buffer.
- *
- * NOTE: this function may indirectly update MyPState->pfs_hash; which
- * invalidates any active pointers into the hash table.
- */
-static void
-consume_prefetch_responses(void)
-{
-	if (MyPState->ring_receive < MyPState->ring_unused)
-		prefetch_wait_for(MyPState->ring_unused - 1);
-}
-
 static void
 prefetch_cleanup_trailing_unused(void)
 {
@@ -489,7 +653,7 @@ prefetch_wait_for(uint64 ring_index)
 	if (MyPState->ring_flush <= ring_index &&
 		MyPState->ring_unused > MyPState->ring_flush)
 	{
-		if (!page_server->flush())
+		if (!page_server->flush(PS_CHANNEL_PREFETCH))
 			return false;
 		MyPState->ring_flush = MyPState->ring_unused;
 	}
@@ -526,11 +690,16 @@ prefetch_read(PrefetchRequest *slot)
 	Assert(slot->response == NULL);
 	Assert(slot->my_ring_index == MyPState->ring_receive);
 
+	if (slot->batch_size > 1)
+		return prefetch_read_batch(slot);
+
 	old = MemoryContextSwitchTo(MyPState->errctx);
-	response = (NeonResponse *) page_server->receive();
+	response = (NeonResponse *) page_server->receive(PS_CHANNEL_PREFETCH, NULL);
 	MemoryContextSwitchTo(old);
 	if (response)
 	{
+		prefetch_note_latency(slot);
+
 		/* update prefetch state */
 		MyPState->n_responses_buffered += 1;
 		MyPState->n_requests_inflight -= 1;
@@ -547,6 +716,99 @@ prefetch_read(PrefetchRequest *slot)
 	}
 }
 
+/*
+ * Read the single response of a vectored GetPage request and distribute its
+ * pages (or its error) over the slots of the batch, so that each slot ends up
+ * with an individually allocated response, just like after a non-vectored
+ * request. The batch head must be the next slot to receive.
+ *
+ * NOTE: this function may indirectly update MyPState->pfs_hash; which
+ * invalidates any active pointers into the hash table.
+ */
+static bool
+prefetch_read_batch(PrefetchRequest *slot)
+{
+	NeonResponse *response;
+	MemoryContext old;
+	int			nblocks = slot->batch_size;
+	uint64		head_index = slot->my_ring_index;
+
+	Assert(nblocks > 1);
+	Assert(slot->status == PRFS_REQUESTED);
+	Assert(slot->response == NULL);
+	Assert(slot->my_ring_index == MyPState->ring_receive);
+
+	old = MemoryContextSwitchTo(MyPState->errctx);
+	response = (NeonResponse *) page_server->receive(PS_CHANNEL_PREFETCH, NULL);
+	MemoryContextSwitchTo(old);
+
+	if (response == NULL)
+		return false;
+
+	prefetch_note_latency(slot);
+
+	if (response->tag == T_NeonGetPageVResponse &&
+		((NeonGetPageVResponse *) response)->n_pages != (uint32) nblocks)
+	{
+		elog(ERROR, "expected %d pages in vectored GetPage response, got %u",
+			 nblocks, ((NeonGetPageVResponse *) response)->n_pages);
+	}
+
+	for (int i = 0; i < nblocks; i++)
+	{
+		PrefetchRequest *member = GetPrfSlot(head_index + i);
+
+		Assert(member->status == PRFS_REQUESTED);
+		Assert(member->response == NULL);
+
+		if (response->tag == T_NeonGetPageVResponse)
+		{
+			NeonGetPageVResponse *vresp = (NeonGetPageVResponse *) response;
+			NeonGetPageResponse *page_resp;
+
+			page_resp = MemoryContextAllocZero(MyPState->bufctx,
+											   PS_GETPAGERESPONSE_SIZE);
+			page_resp->tag = T_NeonGetPageResponse;
+			memcpy(page_resp->page, vresp->pages + (size_t) i * BLCKSZ, BLCKSZ);
+			member->response = (NeonResponse *) page_resp;
+		}
+		else
+		{
+			/*
+			 * An error (or any unexpected message) terminates the whole
+			 * batch; give each slot its own copy so that the regular
+			 * per-slot error handling applies.
+			 */
+			NeonErrorResponse *err_resp = (NeonErrorResponse *) response;
+			NeonErrorResponse *slot_resp;
+			size_t		msglen;
+
+			if (response->tag != T_NeonErrorResponse)
+				elog(ERROR, "unexpected response from page server with tag 0x%02x",
+					 response->tag);
+
+			msglen = strlen(err_resp->message);
+			slot_resp = MemoryContextAllocZero(MyPState->errctx,
+											   sizeof(NeonErrorResponse) + msglen + 1);
+			slot_resp->tag = T_NeonErrorResponse;
+			memcpy(slot_resp->message, err_resp->message, msglen + 1);
+			member->response = (NeonResponse *) slot_resp;
+		}
+
+		member->status = PRFS_RECEIVED;
+
+		MyPState->n_responses_buffered += 1;
+		MyPState->n_requests_inflight -= 1;
+		MyPState->ring_receive += 1;
+	}
+
+	/* the batch has been delivered; the head is now an ordinary slot */
+	slot->batch_size = 0;
+
+	pfree(response);
+	return true;
+}
+
 /*
  * Disconnect hook - drop prefetches when the connection drops
  * 
@@ -627,9 +889,10 @@ prefetch_set_unused(uint64 ring_index)
 }
 
 static void
-prefetch_do_request(PrefetchRequest *slot, bool *force_latest, XLogRecPtr *force_lsn)
+prefetch_do_request(PrefetchRequest *slot)
 {
 	bool found;
+	XLogRecPtr lsn;
 	NeonGetPageRequest request = {
 		.req.tag = T_NeonGetPageRequest,
 		.req.latest = false,
@@ -639,55 +902,48 @@ prefetch_do_request(PrefetchRequest *slot, bool *force_latest, XLogRecPtr *force
 		.blkno = slot->buftag.blockNum,
 	};
 
-	if (force_lsn && force_latest)
-	{
-		request.req.lsn = *force_lsn;
-		request.req.latest = *force_latest;
-		slot->effective_request_lsn = *force_lsn;
-	}
-	else
-	{
-		XLogRecPtr lsn = neon_get_request_lsn(
-			&request.req.latest,
-			slot->buftag.rnode,
-			slot->buftag.forkNum,
-			slot->buftag.blockNum
-		);
-		/*
-		 * Note: effective_request_lsn is potentially higher than the requested
-		 * LSN, but still correct:
-		 * 
-		 * We know there are no changes between the actual requested LSN and
-		 * the value of effective_request_lsn: If there were, the page would
-		 * have been in cache and evicted between those LSN values, which
-		 * then would have had to result in a larger request LSN for this page.
-		 * 
-		 * It is possible that a concurrent backend loads the page, modifies
-		 * it and then evicts it again, but the LSN of that eviction cannot be
-		 * smaller than the current WAL insert/redo pointer, which is already
-		 * larger than this prefetch_lsn. So in any case, that would
-		 * invalidate this cache.
-		 *
-		 * The best LSN to use for effective_request_lsn would be
-		 * XLogCtl->Insert.RedoRecPtr, but that's expensive to access.
-		 */
-		request.req.lsn = lsn;
-		prefetch_lsn = Max(prefetch_lsn, lsn);
-		slot->effective_request_lsn = prefetch_lsn;
-	}
+	lsn = neon_get_request_lsn(
+		&request.req.latest,
+		slot->buftag.rnode,
+		slot->buftag.forkNum,
+		slot->buftag.blockNum
+	);
+	/*
+	 * Note: effective_request_lsn is potentially higher than the requested
+	 * LSN, but still correct:
+	 * 
+	 * We know there are no changes between the actual requested LSN and
+	 * the value of effective_request_lsn: If there were, the page would
+	 * have been in cache and evicted between those LSN values, which
+	 * then would have had to result in a larger request LSN for this page.
+	 * 
+	 * It is possible that a concurrent backend loads the page, modifies
+	 * it and then evicts it again, but the LSN of that eviction cannot be
+	 * smaller than the current WAL insert/redo pointer, which is already
+	 * larger than this prefetch_lsn. So in any case, that would
+	 * invalidate this cache.
+	 *
+	 * The best LSN to use for effective_request_lsn would be
+	 * XLogCtl->Insert.RedoRecPtr, but that's expensive to access.
+	 */
+	request.req.lsn = lsn;
+	prefetch_lsn = Max(prefetch_lsn, lsn);
+	slot->effective_request_lsn = prefetch_lsn;
 
 	Assert(slot->response == NULL);
 	Assert(slot->my_ring_index == MyPState->ring_unused);
 
-	while (!page_server->send((NeonRequest *) &request));
+	while (!page_server->send(PS_CHANNEL_PREFETCH, (NeonRequest *) &request));
 
 	/* update prefetch state */
 	MyPState->n_requests_inflight += 1;
 	MyPState->n_unused -= 1;
 	MyPState->ring_unused += 1;
+	MyNeonCounters->prefetch_requests_issued += 1;
 
 	/* update slot state */
 	slot->status = PRFS_REQUESTED;
+	INSTR_TIME_SET_CURRENT(slot->request_time);
 
 
 	prfh_insert(MyPState->prf_hash, slot, &found);
@@ -698,17 +954,14 @@ prefetch_do_request(PrefetchRequest *slot, bool *force_latest, XLogRecPtr *force
  * prefetch_register_buffer() - register and prefetch buffer
  *
  * Register that we may want the contents of BufferTag in the near future.
- * 
- * If force_latest and force_lsn are not NULL, those values are sent to the
- * pageserver. If they are NULL, we utilize the lastWrittenLsn -infrastructure
- * to fill in these values manually.
+ * The request LSN is filled in from the lastWrittenLsn -infrastructure.
  *
  * NOTE: this function may indirectly update MyPState->pfs_hash; which
  * invalidates any active pointers into the hash table.
  */
 
 static uint64
-prefetch_register_buffer(BufferTag tag, bool *force_latest, XLogRecPtr *force_lsn)
+prefetch_register_buffer(BufferTag tag)
 {
 	uint64	ring_index;
 	PrefetchRequest req;
@@ -732,51 +985,19 @@ prefetch_register_buffer(BufferTag tag, bool *force_latest, XLogRecPtr *force_ls
 		Assert(BUFFERTAGS_EQUAL(slot->buftag, tag));
 
 		/*
-		 * If we want a specific lsn, we do not accept requests that were made
-		 * with a potentially different LSN.
+		 * We received a prefetch for a page that was recently read and
+		 * removed from the buffers. Remove that request from the buffers.
 		 */
-		if (force_latest && force_lsn)
+		if (slot->status == PRFS_TAG_REMAINS)
 		{
-			/* if we want the latest version, any effective_request_lsn < request lsn is OK */
-			if (*force_latest)
-			{
-				if (*force_lsn > slot->effective_request_lsn)
-				{
-					prefetch_wait_for(ring_index);
-					prefetch_set_unused(ring_index);
-					entry = NULL;
-				}
-
-			}
-			/* if we don't want the latest version, only accept requests with the exact same LSN */
-			else
-			{
-				if (*force_lsn != slot->effective_request_lsn)
-				{
-					prefetch_wait_for(ring_index);
-					prefetch_set_unused(ring_index);
-					entry = NULL;
-				}
-			}
+			prefetch_set_unused(ring_index);
+			entry = NULL;
 		}
-
-		if (entry != NULL)
+		else
 		{
-			/*
-			 * We received a prefetch for a page that was recently read and
-			 * removed from the buffers. Remove that request from the buffers.
-			 */
-			if (slot->status == PRFS_TAG_REMAINS)
-			{
-				prefetch_set_unused(ring_index);
-				entry = NULL;
-			}
-			else
-			{
-				/* The buffered request is good enough, return that index */
-				pgBufferUsage.prefetch.duplicates++;
-				return ring_index;
-			}
+			/* The buffered request is good enough, return that index */
+			pgBufferUsage.prefetch.duplicates++;
+			return ring_index;
 		}
 	}
 
@@ -815,10 +1036,14 @@ prefetch_register_buffer(BufferTag tag, bool *force_latest, XLogRecPtr *force_ls
 			{
 				case PRFS_REQUESTED:
 					Assert(MyPState->ring_receive == cleanup_index);
-					prefetch_wait_for(cleanup_index);
+					if (prefetch_wait_for(cleanup_index))
+						prefetch_park_response(GetPrfSlot(cleanup_index));
 					prefetch_set_unused(cleanup_index);
 					break;
 				case PRFS_RECEIVED:
+					prefetch_park_response(slot);
+					prefetch_set_unused(cleanup_index);
+					break;
 				case PRFS_TAG_REMAINS:
 					prefetch_set_unused(cleanup_index);
 					break;
@@ -846,7 +1071,7 @@ prefetch_register_buffer(BufferTag tag, bool *force_latest, XLogRecPtr *force_ls
 	slot->buftag = tag;
 	slot->my_ring_index = ring_index;
 
-	prefetch_do_request(slot, force_latest, force_lsn);
+	prefetch_do_request(slot);
 	Assert(slot->status == PRFS_REQUESTED);
 	Assert(MyPState->ring_last <= ring_index &&
 		   ring_index < MyPState->ring_unused);
@@ -854,22 +1079,189 @@ prefetch_register_buffer(BufferTag tag, bool *force_latest, XLogRecPtr *force_ls
 	if (flush_every_n_requests > 0 &&
 		MyPState->ring_unused - MyPState->ring_flush >= flush_every_n_requests)
 	{
-		page_server->flush();
+		page_server->flush(PS_CHANNEL_PREFETCH);
 		MyPState->ring_flush = MyPState->ring_unused;
 	}
 
 	return ring_index;
 }
 
+/*
+ * prefetch_register_buffer_batch() - prefetch a range of blocks with one
+ * vectored GetPage request.
+ *
+ * Registers up to nblocks consecutive blocks of the same relation fork,
+ * starting at tag.blockNum, with a single T_NeonGetPageVRequest whose pages
+ * arrive in one response. The batch is truncated at the first block that is
+ * already being prefetched or resides in the local file cache, because the
+ * range sent to the pageserver must stay contiguous.
+ *
+ * All blocks are requested at the same LSN, so this must not be used in
+ * recovery, where the exact LSN of each page matters.
+ *
+ * Returns the number of blocks actually registered (possibly 0).
+ *
+ * NOTE: this function may indirectly update MyPState->pfs_hash; which
+ * invalidates any active pointers into the hash table.
+ */
+static int
+prefetch_register_buffer_batch(BufferTag tag, int nblocks)
+{
+	uint64		ring_index;
+	XLogRecPtr	lsn = InvalidXLogRecPtr;
+	NeonGetPageVRequest request;
+	int			n = 0;
+
+	Assert(!RecoveryInProgress() && !am_walsender);
+
+	/* Leave room in the ring for regular (demand) requests as well */
+	nblocks = Min(nblocks, readahead_buffer_size / 2);
+
+	while (n < nblocks)
+	{
+		PrefetchRequest probe;
+
+		/* use an intermediate PrefetchRequest struct to ensure correct alignment */
+		memset(&probe, 0, sizeof(probe));
+		probe.buftag = tag;
+		probe.buftag.blockNum = tag.blockNum + n;
+
+		if (prfh_lookup(MyPState->prf_hash, &probe) != NULL)
+			break;
+		if (lfc_cache_contains(tag.rnode, tag.forkNum, tag.blockNum + n))
+			break;
+		n++;
+	}
+
+	if (n == 0)
+		return 0;
+	if (n == 1)
+	{
+		(void) prefetch_register_buffer(tag);
+		return 1;
+	}
+
+	/*
+	 * Make room for n slots, evicting from the tail with the same policy as
+	 * the single-block path in prefetch_register_buffer.
+	 */
+	while (MyPState->ring_unused - MyPState->ring_last >
+		   (uint64) (readahead_buffer_size - 1 - n))
+	{
+		uint64		cleanup_index = MyPState->ring_last;
+		PrefetchRequest *slot = GetPrfSlot(cleanup_index);
+
+		Assert(slot->status != PRFS_UNUSED);
+
+		if (ReceiveBufferNeedsCompaction() && compact_prefetch_buffers())
+			continue;
+
+		switch (slot->status)
+		{
+			case PRFS_REQUESTED:
+				Assert(MyPState->ring_receive == cleanup_index);
+				if (prefetch_wait_for(cleanup_index))
+					prefetch_park_response(GetPrfSlot(cleanup_index));
+				prefetch_set_unused(cleanup_index);
+				break;
+			case PRFS_RECEIVED:
+				prefetch_park_response(slot);
+				prefetch_set_unused(cleanup_index);
+				break;
+			case PRFS_TAG_REMAINS:
+				prefetch_set_unused(cleanup_index);
+				break;
+			default:
+				pg_unreachable();
+		}
+	}
+
+	/*
+	 * Request the whole range at one LSN: the highest last-written LSN of
+	 * the blocks in it. As explained in prefetch_do_request, an
+	 * effective_request_lsn that is potentially higher than a block's
+	 * last-written LSN is still correct.
+	 */
+	for (int i = 0; i < n; i++)
+	{
+		bool		latest;
+		XLogRecPtr	block_lsn;
+
+		block_lsn = neon_get_request_lsn(&latest, tag.rnode, tag.forkNum,
+										 tag.blockNum + i);
+		Assert(latest);
+		lsn = Max(lsn, block_lsn);
+	}
+	prefetch_lsn = Max(prefetch_lsn, lsn);
+
+	request = (NeonGetPageVRequest) {
+		.req.tag = T_NeonGetPageVRequest,
+		.req.latest = true,
+		.req.lsn = lsn,
+		.rnode = tag.rnode,
+		.forknum = tag.forkNum,
+		.blkno = tag.blockNum,
+		.nblocks = n,
+	};
+
+	while (!page_server->send(PS_CHANNEL_PREFETCH, (NeonRequest *) &request));
+
+	ring_index = MyPState->ring_unused;
+	for (int i = 0; i < n; i++)
+	{
+		PrefetchRequest *slot = &MyPState->prf_buffer[(ring_index + i) % readahead_buffer_size];
+		bool		found;
+
+		Assert(slot->status == PRFS_UNUSED);
+
+		/*
+		 * We must update the slot data before insertion, because the hash
+		 * function reads the buffer tag from the slot.
+		 */
+		slot->buftag = tag;
+		slot->buftag.blockNum = tag.blockNum + i;
+		slot->my_ring_index = ring_index + i;
+		slot->effective_request_lsn = prefetch_lsn;
+		slot->status = PRFS_REQUESTED;
+		slot->batch_size = (i == 0) ? n : 0;
+		if (i == 0)
+			INSTR_TIME_SET_CURRENT(slot->request_time);
+		else
+			INSTR_TIME_SET_ZERO(slot->request_time);
+
+		prfh_insert(MyPState->prf_hash, slot, &found);
+		Assert(!found);
+
+		MyPState->n_requests_inflight += 1;
+		MyPState->n_unused -= 1;
+		MyPState->ring_unused += 1;
+	}
+
+	if (flush_every_n_requests > 0 &&
+		MyPState->ring_unused - MyPState->ring_flush >= flush_every_n_requests)
+	{
+		page_server->flush(PS_CHANNEL_PREFETCH);
+		MyPState->ring_flush = MyPState->ring_unused;
+	}
+
+	return n;
+}
+
+/*
+ * Perform a synchronous request/response exchange on the demand channel.
+ *
+ * If 'dest_page' is not NULL and the response is a GetPage response, its
+ * page image is placed directly in 'dest_page' and the returned response
+ * carries no payload of its own.
+ */
 static NeonResponse *
-page_server_request(void const *req)
+page_server_request(void const *req, char *dest_page)
 {
 	NeonResponse* resp;
 	do {
-		while (!page_server->send((NeonRequest *) req) || !page_server->flush());
-		MyPState->ring_flush = MyPState->ring_unused;
-		consume_prefetch_responses();
-		resp = page_server->receive();
+		while (!page_server->send(PS_CHANNEL_SYNC, (NeonRequest *) req) ||
+			   !page_server->flush(PS_CHANNEL_SYNC));
+		resp = page_server->receive(PS_CHANNEL_SYNC, dest_page);
 	} while (resp == NULL);
 	return resp;
 
@@ -937,11 +1329,27 @@ nm_pack_request(NeonRequest * msg)
 
 				break;
 			}
+		case T_NeonGetPageVRequest:
+			{
+				NeonGetPageVRequest *msg_req = (NeonGetPageVRequest *) msg;
+
+				pq_sendbyte(&s, msg_req->req.latest);
+				pq_sendint64(&s, msg_req->req.lsn);
+				pq_sendint32(&s, msg_req->rnode.spcNode);
+				pq_sendint32(&s, msg_req->rnode.dbNode);
+				pq_sendint32(&s, msg_req->rnode.relNode);
+				pq_sendbyte(&s, msg_req->forknum);
+				pq_sendint32(&s, msg_req->blkno);
+				pq_sendint32(&s, msg_req->nblocks);
+
+				break;
+			}
 
 			/* pagestore -> pagestore_client. We never need to create these. */
 		case T_NeonExistsResponse:
 		case T_NeonNblocksResponse:
 		case T_NeonGetPageResponse:
+		case T_NeonGetPageVResponse:
 		case T_NeonErrorResponse:
 		case T_NeonDbSizeResponse:
 		default:
@@ -951,8 +1359,48 @@ nm_pack_request(NeonRequest * msg)
 	return s;
 }
 
+/*
+ * Read the page payload of a GetPage(V) response into 'dst', which has room
+ * for 'rawsize' bytes.
+ *
+ * On a connection with negotiated compression the payload is a uint32
+ * compressed length followed by a zlib stream, with length 0 marking an
+ * incompressible payload that was sent raw.
+ */
+static void
+nm_read_page_payload(StringInfo s, bool compressed, char *dst, size_t rawsize)
+{
+	if (compressed)
+	{
+		uint32		clen = pq_getmsgint(s, 4);
+
+		if (clen > 0)
+		{
+			uLongf		dlen = rawsize;
+
+			if (uncompress((Bytef *) dst, &dlen,
+						   (const Bytef *) pq_getmsgbytes(s, clen), clen) != Z_OK ||
+				dlen != rawsize)
+				elog(ERROR, "could not decompress page server response");
+			return;
+		}
+	}
+	memcpy(dst, pq_getmsgbytes(s, rawsize), rawsize);
+}
+
+/*
+ * Unpack a response read from the pageserver connection.
+ *
+ * For GetPage responses, a non-NULL 'dest_page' makes the page image land
+ * directly in 'dest_page' instead of being copied into the response struct:
+ * the returned response then consists of the header alone. This spares the
+ * hot read path one 8KB copy.
+ *
+ * 'compressed' tells whether page payloads on this connection are
+ * compressed (see neon.compress_getpage_responses).
+ */
 NeonResponse *
-nm_unpack_response(StringInfo s)
+nm_unpack_response(StringInfo s, char *dest_page, bool compressed)
 {
 	NeonMessageTag tag = pq_getmsgbyte(s);
 	NeonResponse *resp = NULL;
@@ -988,10 +1436,22 @@ nm_unpack_response(StringInfo s)
 			{
 				NeonGetPageResponse *msg_resp;
 
+				if (dest_page != NULL)
+				{
+					NeonResponse *hdr_resp = palloc0(sizeof(NeonResponse));
+
+					hdr_resp->tag = tag;
+					nm_read_page_payload(s, compressed, dest_page, BLCKSZ);
+					pq_getmsgend(s);
+
+					resp = hdr_resp;
+					break;
+				}
+
 				msg_resp = MemoryContextAllocZero(MyPState->bufctx, PS_GETPAGERESPONSE_SIZE);
 				msg_resp->tag = tag;
 				/* XXX:	should be varlena */
-				memcpy(msg_resp->page, pq_getmsgbytes(s, BLCKSZ), BLCKSZ);
+				nm_read_page_payload(s, compressed, msg_resp->page, BLCKSZ);
 				pq_getmsgend(s);
 				
 				Assert(msg_resp->tag == T_NeonGetPageResponse);
@@ -1000,6 +1460,30 @@ nm_unpack_response(StringInfo s)
 				break;
 			}
 
+		case T_NeonGetPageVResponse:
+			{
+				NeonGetPageVResponse *msg_resp;
+				uint32		n_pages;
+
+				n_pages = pq_getmsgint(s, 4);
+
+				/*
+				 * The variable-length response doesn't fit in the bufctx slab,
+				 * it is split up into per-page responses by
+				 * prefetch_read_batch.
+				 */
+				msg_resp = palloc0(offsetof(NeonGetPageVResponse, pages) +
+								   (size_t) n_pages * BLCKSZ);
+				msg_resp->tag = tag;
+				msg_resp->n_pages = n_pages;
+				nm_read_page_payload(s, compressed, msg_resp->pages,
+									 (size_t) n_pages * BLCKSZ);
+				pq_getmsgend(s);
+
+				resp = (NeonResponse *) msg_resp;
+				break;
+			}
+
 		case T_NeonDbSizeResponse:
 			{
 				NeonDbSizeResponse *msg_resp = palloc0(sizeof(NeonDbSizeResponse));
@@ -1038,6 +1522,7 @@ nm_unpack_response(StringInfo s)
 		case T_NeonExistsRequest:
 		case T_NeonNblocksRequest:
 		case T_NeonGetPageRequest:
+		case T_NeonGetPageVRequest:
 		case T_NeonDbSizeRequest:
 		default:
 			elog(ERROR, "unexpected neon message tag 0x%02x", tag);
@@ -1106,6 +1591,23 @@ nm_to_string(NeonMessage * msg)
 				appendStringInfoChar(&s, '}');
 				break;
 			}
+		case T_NeonGetPageVRequest:
+			{
+				NeonGetPageVRequest *msg_req = (NeonGetPageVRequest *) msg;
+
+				appendStringInfoString(&s, "{\"type\": \"NeonGetPageVRequest\"");
+				appendStringInfo(&s, ", \"rnode\": \"%u/%u/%u\"",
+								 msg_req->rnode.spcNode,
+								 msg_req->rnode.dbNode,
+								 msg_req->rnode.relNode);
+				appendStringInfo(&s, ", \"forknum\": %d", msg_req->forknum);
+				appendStringInfo(&s, ", \"blkno\": %u", msg_req->blkno);
+				appendStringInfo(&s, ", \"nblocks\": %u", msg_req->nblocks);
+				appendStringInfo(&s, ", \"lsn\": \"%X/%X\"", LSN_FORMAT_ARGS(msg_req->req.lsn));
+				appendStringInfo(&s, ", \"latest\": %d", msg_req->req.latest);
+				appendStringInfoChar(&s, '}');
+				break;
+			}
 		case T_NeonDbSizeRequest:
 			{
 				NeonDbSizeRequest *msg_req = (NeonDbSizeRequest *) msg;
@@ -1152,6 +1654,16 @@ nm_to_string(NeonMessage * msg)
 				appendStringInfoChar(&s, '}');
 				break;
 			}
+		case T_NeonGetPageVResponse:
+			{
+				NeonGetPageVResponse *msg_resp = (NeonGetPageVResponse *) msg;
+
+				appendStringInfoString(&s, "{\"type\": \"NeonGetPageVResponse\"");
+				appendStringInfo(&s, ", \"n_pages\": %u", msg_resp->n_pages);
+				appendStringInfo(&s, ", \"pages\": \"XXX\"}");
+				appendStringInfoChar(&s, '}');
+				break;
+			}
 		case T_NeonErrorResponse:
 			{
 				NeonErrorResponse *msg_resp = (NeonErrorResponse *) msg;
@@ -1330,6 +1842,7 @@ neon_init(void)
 	MyPState = MemoryContextAllocZero(TopMemoryContext, prfs_size);
 	
 	MyPState->n_unused = readahead_buffer_size;
+	MyPState->ra_window = 1;
 
 	MyPState->bufctx = SlabContextCreate(TopMemoryContext,
 										 "NeonSMGR/prefetch",
@@ -1516,7 +2029,7 @@ neon_exists(SMgrRelation reln, ForkNumber forkNum)
 			.rnode = reln->smgr_rnode.node,
 		.forknum = forkNum};
 
-		resp = page_server_request(&request);
+		resp = page_server_request(&request, NULL);
 	}
 
 	switch (resp->tag)
@@ -1643,6 +2156,72 @@ neon_unlink(RelFileNodeBackend rnode, ForkNumber forkNum, bool isRedo)
 	}
 }
 
+/*
+ * WAL-log a range of zero-filled blocks [blkno, blkno + nblocks) with as few
+ * WAL records as possible.
+ *
+ * PostgreSQL can extend a relation by more than one block at a time, leaving
+ * zero-filled blocks below the new EOF: PG-15's CreateAndCopyRelationData
+ * extends the destination relation directly to the source's size, and bulk
+ * loads extend the heap ahead of the blocks they fill. Logging each of those
+ * blocks with its own full-page record and flushing the WAL after every one
+ * makes such loads pay a WAL round trip per 8KB. Instead, batch the range
+ * into log_newpages() records carrying up to XLR_MAX_BLOCK_ID zero pages
+ * each and flush once at the end, so bulk extension throughput tracks WAL
+ * bandwidth rather than per-block bookkeeping.
+ */
+static void
+neon_log_zero_range(SMgrRelation reln, ForkNumber forkNum,
+					BlockNumber blkno, BlockNumber nblocks)
+{
+	PGAlignedBlock zero_page;
+	BlockNumber blknos[XLR_MAX_BLOCK_ID];
+	Page		pages[XLR_MAX_BLOCK_ID];
+	XLogRecPtr	lsn;
+	BlockNumber	first_blkno = blkno;
+
+	if (ShutdownRequestPending)
+		return;
+	if (!XLogInsertAllowed() || RecoveryInProgress())
+		return;
+
+	/* every entry of a batch points at the same all-zeros page */
+	memset(zero_page.data, 0, BLCKSZ);
+	for (int i = 0; i < XLR_MAX_BLOCK_ID; i++)
+		pages[i] = (Page) zero_page.data;
+
+	while (nblocks > 0)
+	{
+		int			n = Min(nblocks, XLR_MAX_BLOCK_ID);
+
+		for (int i = 0; i < n; i++)
+			blknos[i] = blkno + i;
+
+		log_newpages(&reln->smgr_rnode.node, forkNum, n, blknos, pages, false);
+
+		blkno += n;
+		nblocks -= n;
+	}
+
+	/* one flush for the whole range */
+	lsn = XactLastRecEnd;
+	XLogFlush(lsn);
+
+	/*
+	 * Remember the LSN on these pages. When we read them again, we must read
+	 * the same or newer version.
+	 */
+	for (BlockNumber i = first_blkno; i < blkno; i++)
+		SetLastWrittenLSNForBlock(lsn, reln->smgr_rnode.node, forkNum, i);
+
+	ereport(SmgrTrace,
+			(errmsg("Logged zero-extension of relation %u/%u/%u.%u blocks %u..%u at lsn=%X/%X",
+					reln->smgr_rnode.node.spcNode,
+					reln->smgr_rnode.node.dbNode,
+					reln->smgr_rnode.node.relNode,
+					forkNum, first_blkno, blkno - 1, LSN_FORMAT_ARGS(lsn))));
+}
+
 /*
  *	neon_extend() -- Add a block to the specified relation.
  *
@@ -1700,11 +2279,13 @@ neon_extend(SMgrRelation reln, ForkNumber forkNum, BlockNumber blkno,
 	/*
 	 * Usually Postgres doesn't extend relation on more than one page
 	 * (leaving holes). But this rule is violated in PG-15 where CreateAndCopyRelationData
-	 * call smgrextend for destination relation n using size of source relation
+	 * call smgrextend for destination relation n using size of source relation.
+	 * WAL-log the whole zeroed range with coalesced records rather than one
+	 * full-page record (and WAL flush) per block.
 	 */
 	n_blocks = neon_nblocks(reln, forkNum);
-	while (n_blocks < blkno)
-		neon_wallog_page(reln, forkNum, n_blocks++, buffer, true);
+	if (n_blocks < blkno)
+		neon_log_zero_range(reln, forkNum, n_blocks, blkno - n_blocks);
 
 	neon_wallog_page(reln, forkNum, blkno, buffer, false);
 	set_cached_relsize(reln->smgr_rnode.node, forkNum, blkno + 1);
@@ -1801,7 +2382,7 @@ neon_prefetch(SMgrRelation reln, ForkNumber forknum, BlockNumber blocknum)
 		.blockNum = blocknum
 	};
 
-	ring_index = prefetch_register_buffer(tag, NULL, NULL);
+	ring_index = prefetch_register_buffer(tag);
 
 	Assert(ring_index < MyPState->ring_unused &&
 		   MyPState->ring_last <= ring_index);
@@ -1847,6 +2428,44 @@ neon_writeback(SMgrRelation reln, ForkNumber forknum,
 #endif
 }
 
+/*
+ * Copy the page image of a GetPage response into the caller's buffer (and
+ * the local file cache), or raise the error the pageserver returned instead.
+ *
+ * With 'page_in_place', the page was already received directly into
+ * 'buffer' (see nm_unpack_response) and only the cache write remains.
+ */
+static void
+neon_copy_getpage_response(NeonResponse *resp, RelFileNode rnode, ForkNumber forkNum,
+						   BlockNumber blkno, XLogRecPtr request_lsn, char *buffer,
+						   bool page_in_place)
+{
+	switch (resp->tag)
+	{
+		case T_NeonGetPageResponse:
+			if (!page_in_place)
+				memcpy(buffer, ((NeonGetPageResponse *) resp)->page, BLCKSZ);
+			lfc_write(rnode, forkNum, blkno, buffer);
+			break;
+
+		case T_NeonErrorResponse:
+			ereport(ERROR,
+					(errcode(ERRCODE_IO_ERROR),
+					 errmsg("could not read block %u in rel %u/%u/%u.%u from page server at lsn %X/%08X",
+							blkno,
+							rnode.spcNode,
+							rnode.dbNode,
+							rnode.relNode,
+							forkNum,
+							(uint32) (request_lsn >> 32), (uint32) request_lsn),
+					 errdetail("page server returned error: %s",
+							   ((NeonErrorResponse *) resp)->message)));
+			break;
+		default:
+			elog(ERROR, "unexpected response from page server with tag 0x%02x", resp->tag);
+	}
+}
+
 /*
  * While function is defined in the neon extension it's used within neon_test_utils directly.
  * To avoid breaking tests in the runtime please keep function signature in sync.
@@ -1857,7 +2476,7 @@ neon_read_at_lsn(RelFileNode rnode, ForkNumber forkNum, BlockNumber blkno,
 {
 	NeonResponse *resp;
 	BufferTag	buftag;
-	uint64		ring_index;
+	uint64		ring_index = 0;
 	PrfHashEntry *entry;
 	PrefetchRequest *slot;
 
@@ -1899,6 +2518,7 @@ neon_read_at_lsn(RelFileNode rnode, ForkNumber forkNum, BlockNumber blkno,
 		{
 			ring_index = slot->my_ring_index;
 			pgBufferUsage.prefetch.hits += 1;
+			MyNeonCounters->prefetch_hits += 1;
 		}
 		else /* the current prefetch LSN is not large enough, so drop the prefetch */
 		{
@@ -1912,74 +2532,140 @@ neon_read_at_lsn(RelFileNode rnode, ForkNumber forkNum, BlockNumber blkno,
 				prefetch_wait_for(slot->my_ring_index);
 			}
 			/* drop caches */
+			prefetch_note_waste();
 			prefetch_set_unused(slot->my_ring_index);
 			pgBufferUsage.prefetch.expired += 1;
+			MyNeonCounters->prefetch_discarded += 1;
 			/* make it look like a prefetch cache miss */
 			entry = NULL;
 		}
 	}
 
-	do
+	if (entry != NULL)
 	{
-		if (entry == NULL)
-		{
-			pgBufferUsage.prefetch.misses += 1;
+		/*
+		 * Empty our reference to the prefetch buffer's hash entry. When we
+		 * wait for prefetches, the entry reference is invalidated by
+		 * potential updates to the hash.
+		 */
+		entry = NULL;
 
-			ring_index = prefetch_register_buffer(buftag, &request_latest,
-												  &request_lsn);
-			slot = GetPrfSlot(ring_index);
-		}
-		else
+		/*
+		 * If the pageserver connection is dropped while we wait, the
+		 * prefetch is gone; fall through to a synchronous demand request
+		 * in that case.
+		 */
+		if (prefetch_wait_for(ring_index))
 		{
-			/*
-			 * Empty our reference to the prefetch buffer's hash entry.
-			 * When we wait for prefetches, the entry reference is invalidated by 
-			 * potential updates to the hash, and when we reconnect to the 
-			 * pageserver the prefetch we're waiting for may be dropped,
-			 * in which case we need to retry and take the branch above.
-			 */
-			entry = NULL;
+			slot = GetPrfSlot(ring_index);
+
+			Assert(slot->status == PRFS_RECEIVED);
+			Assert(slot->my_ring_index == ring_index);
+
+			neon_copy_getpage_response(slot->response, rnode, forkNum, blkno,
+									   request_lsn, buffer, false);
+
+			/* buffer was used, clean up for later reuse */
+			prefetch_set_unused(ring_index);
+			prefetch_cleanup_trailing_unused();
+			return;
 		}
+	}
 
-		Assert(slot->my_ring_index == ring_index);
-		Assert(MyPState->ring_last <= ring_index &&
-			   MyPState->ring_unused > ring_index);
-		Assert(slot->status != PRFS_UNUSED);
-		Assert(GetPrfSlot(ring_index) == slot);
+	/*
+	 * The page may have been prefetched but pushed out of the ring by later
+	 * requests; check the parking pool before going to the pageserver.
+	 */
+	if (parked_pages != NULL)
+	{
+		ParkedPage *parked;
 
-	} while (!prefetch_wait_for(ring_index));
+		parked = hash_search(parked_pages, &buftag, HASH_FIND, NULL);
+		if (parked != NULL)
+		{
+			if (parked->effective_request_lsn >= request_lsn)
+			{
+				neon_copy_getpage_response(parked->response, rnode, forkNum,
+										   blkno, request_lsn, buffer, false);
+				parked_page_free(parked);
+				pgBufferUsage.prefetch.hits += 1;
+				MyNeonCounters->prefetch_hits += 1;
+				return;
+			}
 
-	Assert(slot->status == PRFS_RECEIVED);
+			/* too old to serve this read, so drop it */
+			parked_page_free(parked);
+			prefetch_note_waste();
+			pgBufferUsage.prefetch.expired += 1;
+			MyNeonCounters->prefetch_discarded += 1;
+		}
+	}
 
-	resp = slot->response;
+	/*
+	 * Prefetch miss: request the page synchronously, on the channel
+	 * dedicated to demand requests so that we neither queue behind the
+	 * prefetch pipeline nor have to drain it.
+	 */
+	pgBufferUsage.prefetch.misses += 1;
 
-	switch (resp->tag)
 	{
-		case T_NeonGetPageResponse:
-			memcpy(buffer, ((NeonGetPageResponse *) resp)->page, BLCKSZ);
-			lfc_write(rnode, forkNum, blkno, buffer);
-			break;
+		NeonGetPageRequest request = {
+			.req.tag = T_NeonGetPageRequest,
+			.req.latest = request_latest,
+			.req.lsn = request_lsn,
+			.rnode = rnode,
+			.forknum = forkNum,
+			.blkno = blkno,
+		};
+		bool		leader = false;
 
-		case T_NeonErrorResponse:
-			ereport(ERROR,
-					(errcode(ERRCODE_IO_ERROR),
-					 errmsg("could not read block %u in rel %u/%u/%u.%u from page server at lsn %X/%08X",
-							blkno,
-							rnode.spcNode,
-							rnode.dbNode,
-							rnode.relNode,
-							forkNum,
-							(uint32) (request_lsn >> 32), (uint32) request_lsn),
-					 errdetail("page server returned error: %s",
-							   ((NeonErrorResponse *) resp)->message)));
-			break;
-		default:
-			elog(ERROR, "unexpected response from page server with tag 0x%02x", resp->tag);
+		/*
+		 * In latest mode outside of recovery one response can satisfy every
+		 * concurrent request for the block, so try to share the request with
+		 * other backends: if another backend already has an equivalent
+		 * request in flight, wait for its response instead of sending a
+		 * duplicate. On a hit the leader has already written the page to the
+		 * local file cache, so we are done.
+		 */
+		if (request_latest && !RecoveryInProgress())
+		{
+			switch (getpage_dedup_begin(buftag, request_lsn, buffer))
+			{
+				case GETPAGE_DEDUP_HIT:
+					return;
+				case GETPAGE_DEDUP_LEADER:
+					leader = true;
+					break;
+				case GETPAGE_DEDUP_BYPASS:
+					break;
+			}
+		}
+
+		if (leader)
+		{
+			PG_TRY();
+			{
+				resp = page_server_request(&request, buffer);
+			}
+			PG_CATCH();
+			{
+				getpage_dedup_abort(buftag);
+				PG_RE_THROW();
+			}
+			PG_END_TRY();
+
+			/* on success the page was received directly into 'buffer' */
+			if (messageTag(resp) == T_NeonGetPageResponse)
+				getpage_dedup_complete(buftag, buffer);
+			else
+				getpage_dedup_abort(buftag);
+		}
+		else
+			resp = page_server_request(&request, buffer);
 	}
 
-	/* buffer was used, clean up for later reuse */
-	prefetch_set_unused(ring_index);
-	prefetch_cleanup_trailing_unused();
+	neon_copy_getpage_response(resp, rnode, forkNum, blkno, request_lsn, buffer, true);
+	pfree(resp);
 }
 
 /*
@@ -2009,12 +2695,139 @@ neon_read(SMgrRelation reln, ForkNumber forkNum, BlockNumber blkno,
 			elog(ERROR, "unknown relpersistence '%c'", reln->smgr_relpersistence);
 	}
 
+	/*
+	 * On a sequential scan, keep an adaptively sized window of up to
+	 * readahead_getpage_batch_size blocks ahead of the scan position,
+	 * requested with vectored GetPage requests. This is issued before the
+	 * demand read below, so that the batch request travels to the pageserver
+	 * in the same flush.
+	 */
+	if (readahead_getpage_batch_size > 1 &&
+		!RecoveryInProgress() && !am_walsender &&
+		RelFileNodeEquals(last_read_rnode, reln->smgr_rnode.node) &&
+		last_read_forknum == forkNum &&
+		blkno == last_read_blkno + 1)
+	{
+		BlockNumber relsize;
+		instr_time	now;
+		int			window;
+
+		/*
+		 * Adapt the readahead window to the scan: raise it, one block per
+		 * read, towards the bandwidth-delay product of observed GetPage
+		 * completion latency over the rate at which this scan consumes
+		 * blocks. The window is halved in prefetch_note_waste() when
+		 * prefetched pages are thrown away unused, and capped by the
+		 * configured maximum.
+		 */
+		INSTR_TIME_SET_CURRENT(now);
+		if (!INSTR_TIME_IS_ZERO(MyPState->last_seq_read_time))
+		{
+			instr_time	since = now;
+			double		target;
+
+			INSTR_TIME_SUBTRACT(since, MyPState->last_seq_read_time);
+			MyPState->ewma_interval_us =
+				prefetch_ewma(MyPState->ewma_interval_us,
+							  INSTR_TIME_GET_MICROSEC(since));
+
+			target = MyPState->ewma_latency_us /
+				Max(MyPState->ewma_interval_us, 1.0);
+			if (MyPState->ra_window < target)
+				MyPState->ra_window += 1;
+			else if (MyPState->ra_window > target)
+				MyPState->ra_window -= 1;
+			MyPState->ra_window = Max(1, Min(MyPState->ra_window,
+											 readahead_getpage_batch_size));
+		}
+		MyPState->last_seq_read_time = now;
+		window = MyPState->ra_window;
+
+		if (readahead_next_blkno < blkno + 1)
+			readahead_next_blkno = blkno + 1;
+
+		/*
+		 * Refill when less than half the window is still ahead of the scan,
+		 * so that the next batch is requested before the previous one has
+		 * been fully consumed.
+		 */
+		if (readahead_next_blkno <= blkno + Max(window / 2, 1) &&
+			get_cached_relsize(reln->smgr_rnode.node, forkNum, &relsize) &&
+			readahead_next_blkno < relsize)
+		{
+			BlockNumber end = relsize;
+			BufferTag	tag;
+			int			registered;
+
+			if (end > blkno + window)
+				end = blkno + window;
+
+			tag = (BufferTag) {
+				.rnode = reln->smgr_rnode.node,
+				.forkNum = forkNum,
+				.blockNum = readahead_next_blkno,
+			};
+
+			registered = prefetch_register_buffer_batch(tag, (int) (end - readahead_next_blkno));
+
+			/*
+			 * If nothing was registered (the next block is already buffered
+			 * or in the local file cache), still advance past it so that we
+			 * make progress on the next call.
+			 */
+			readahead_next_blkno += Max(registered, 1);
+		}
+	}
+	else
+	{
+		/* Pattern broken: restart interval measurement along with the scan */
+		readahead_next_blkno = blkno + 1;
+		INSTR_TIME_SET_ZERO(MyPState->last_seq_read_time);
+	}
+
+	last_read_rnode = reln->smgr_rnode.node;
+	last_read_forknum = forkNum;
+	last_read_blkno = blkno;
+
 	/* Try to read from local file cache */
 	if (lfc_read(reln->smgr_rnode.node, forkNum, blkno, buffer))
 	{
 		return;
 	}
 
+	/*
+	 * Whole-chunk promotion: if this miss landed in a partially cached 1Mb
+	 * chunk of the local file cache, pull the chunk's missing blocks with one
+	 * batched request, issued before the demand read below so that both
+	 * travel to the pageserver in the same flush. The received pages are
+	 * installed in the file cache by the prefetch receive path.
+	 */
+	if (!RecoveryInProgress() && !am_walsender)
+	{
+		BlockNumber	promote_start;
+		int			promote_blocks;
+		BlockNumber relsize;
+
+		promote_blocks = lfc_chunk_promote_range(reln->smgr_rnode.node, forkNum,
+												 blkno, &promote_start);
+		if (promote_blocks > 0 &&
+			get_cached_relsize(reln->smgr_rnode.node, forkNum, &relsize))
+		{
+			if (promote_start + promote_blocks > relsize)
+				promote_blocks = relsize > promote_start ? (int) (relsize - promote_start) : 0;
+			if (promote_blocks > 0)
+			{
+				BufferTag	promote_tag = {
+					.rnode = reln->smgr_rnode.node,
+					.forkNum = forkNum,
+					.blockNum = promote_start,
+				};
+
+				(void) prefetch_register_buffer_batch(promote_tag, promote_blocks);
+			}
+		}
+	}
+
 	request_lsn = neon_get_request_lsn(&latest, reln->smgr_rnode.node, forkNum, blkno);
 	neon_read_at_lsn(reln->smgr_rnode.node, forkNum, blkno, request_lsn, latest, buffer);
 
@@ -2232,7 +3045,7 @@ neon_nblocks(SMgrRelation reln, ForkNumber forknum)
 			.forknum = forknum,
 		};
 
-		resp = page_server_request(&request);
+		resp = page_server_request(&request, NULL);
 	}
 
 	switch (resp->tag)
@@ -2292,7 +3105,7 @@ neon_dbsize(Oid dbNode)
 			.dbNode = dbNode,
 		};
 
-		resp = page_server_request(&request);
+		resp = page_server_request(&request, NULL);
 	}
 
 	switch (resp->tag)
@@ -2767,7 +3580,7 @@ neon_redo_read_buffer_filter(XLogReaderState *record, uint8 block_id)
 			.forknum = forknum,
 		};
 
-		response = page_server_request(&request);
+		response = page_server_request(&request, NULL);
 
 		Assert(response->tag == T_NeonNblocksResponse);
 		nbresponse = (NeonNblocksResponse *) response;
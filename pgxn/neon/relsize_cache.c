@@ -15,6 +15,7 @@
 #include "postgres.h"
 
 #include "pagestore_client.h"
+#include "port/atomics.h"
 #include "storage/relfilenode.h"
 #include "storage/smgr.h"
 #include "storage/lwlock.h"
@@ -40,6 +41,32 @@ typedef struct
 	BlockNumber size;
 } RelSizeEntry;
 
+/*
+ * Lock-free read path: the planner and every smgr read/extend call
+ * get_cached_relsize, so the common lookup must not take the LWLock. Each
+ * backend keeps a small direct-mapped lookaside of recently used sizes,
+ * validated against a shared array of generation counters indexed by the
+ * entry's hash value: writers bump the counter of the tag they modify (under
+ * the exclusive lock they already hold), which invalidates only the lookaside
+ * entries that hashed to the same counter. A lookaside hit whose generation
+ * still matches never touches the LWLock; a miss falls back to the shared
+ * hash and refills the lookaside, reading the generation while still holding
+ * the shared lock so no concurrent writer can be mid-update.
+ */
+#define RELSIZE_N_GENERATIONS	1024	/* power of two */
+#define RELSIZE_LOCAL_CACHE_SIZE 64		/* power of two */
+
+typedef struct
+{
+	RelTag		tag;
+	BlockNumber size;
+	uint32		generation;		/* value of the tag's shared counter at fill */
+	bool		valid;
+} RelSizeLocalEntry;
+
+static pg_atomic_uint32 *relsize_generations;
+static RelSizeLocalEntry relsize_local_cache[RELSIZE_LOCAL_CACHE_SIZE];
+
 static HTAB *relsize_hash;
 static LWLockId relsize_lock;
 static int	relsize_hash_size;
@@ -59,6 +86,7 @@ static void
 neon_smgr_shmem_startup(void)
 {
 	static HASHCTL info;
+	bool		found;
 
 	if (prev_shmem_startup_hook)
 		prev_shmem_startup_hook();
@@ -71,9 +99,44 @@ neon_smgr_shmem_startup(void)
 								 relsize_hash_size, relsize_hash_size,
 								 &info,
 								 HASH_ELEM | HASH_BLOBS);
+	relsize_generations = (pg_atomic_uint32 *)
+		ShmemInitStruct("neon_relsize_gens",
+						sizeof(pg_atomic_uint32) * RELSIZE_N_GENERATIONS, &found);
+	if (!found)
+	{
+		for (int i = 0; i < RELSIZE_N_GENERATIONS; i++)
+			pg_atomic_init_u32(&relsize_generations[i], 0);
+	}
 	LWLockRelease(AddinShmemInitLock);
 }
 
+/*
+ * Invalidate lookaside entries for 'tag' in every backend by advancing its
+ * generation counter. Caller holds relsize_lock exclusively, so the bump is
+ * published no later than the lock release.
+ */
+static inline void
+relsize_bump_generation(uint32 hash)
+{
+	pg_atomic_fetch_add_u32(&relsize_generations[hash % RELSIZE_N_GENERATIONS], 1);
+}
+
+/*
+ * Remember (tag, size) in this backend's lookaside. The generation must have
+ * been read while the shared entry was known current (under relsize_lock, or
+ * right after this backend itself updated it).
+ */
+static inline void
+relsize_local_fill(RelTag const *tag, BlockNumber size, uint32 hash, uint32 generation)
+{
+	RelSizeLocalEntry *lentry = &relsize_local_cache[hash % RELSIZE_LOCAL_CACHE_SIZE];
+
+	lentry->tag = *tag;
+	lentry->size = size;
+	lentry->generation = generation;
+	lentry->valid = true;
+}
+
 bool
 get_cached_relsize(RelFileNode rnode, ForkNumber forknum, BlockNumber *size)
 {
@@ -83,17 +146,39 @@ get_cached_relsize(RelFileNode rnode, ForkNumber forknum, BlockNumber *size)
 	{
 		RelTag		tag;
 		RelSizeEntry *entry;
+		RelSizeLocalEntry *lentry;
+		uint32		hash;
+		uint32		generation;
 
 		tag.rnode = rnode;
 		tag.forknum = forknum;
+		hash = get_hash_value(relsize_hash, &tag);
+
+		/* Fast path: lookaside hit whose generation is still current */
+		lentry = &relsize_local_cache[hash % RELSIZE_LOCAL_CACHE_SIZE];
+		if (lentry->valid
+			&& memcmp(&lentry->tag, &tag, sizeof tag) == 0
+			&& pg_atomic_read_u32(&relsize_generations[hash % RELSIZE_N_GENERATIONS]) == lentry->generation)
+		{
+			*size = lentry->size;
+			return true;
+		}
+
 		LWLockAcquire(relsize_lock, LW_SHARED);
-		entry = hash_search(relsize_hash, &tag, HASH_FIND, NULL);
+		entry = hash_search_with_hash_value(relsize_hash, &tag, hash, HASH_FIND, NULL);
 		if (entry != NULL)
 		{
 			*size = entry->size;
 			found = true;
+			/*
+			 * Read the generation while still holding the lock: no writer
+			 * can be between updating the entry and bumping the counter.
+			 */
+			generation = pg_atomic_read_u32(&relsize_generations[hash % RELSIZE_N_GENERATIONS]);
 		}
 		LWLockRelease(relsize_lock);
+		if (found)
+			relsize_local_fill(&tag, *size, hash, generation);
 	}
 	return found;
 }
@@ -105,13 +190,19 @@ set_cached_relsize(RelFileNode rnode, ForkNumber forknum, BlockNumber size)
 	{
 		RelTag		tag;
 		RelSizeEntry *entry;
+		uint32		hash;
+		uint32		generation;
 
 		tag.rnode = rnode;
 		tag.forknum = forknum;
+		hash = get_hash_value(relsize_hash, &tag);
 		LWLockAcquire(relsize_lock, LW_EXCLUSIVE);
-		entry = hash_search(relsize_hash, &tag, HASH_ENTER, NULL);
+		entry = hash_search_with_hash_value(relsize_hash, &tag, hash, HASH_ENTER, NULL);
 		entry->size = size;
+		relsize_bump_generation(hash);
+		generation = pg_atomic_read_u32(&relsize_generations[hash % RELSIZE_N_GENERATIONS]);
 		LWLockRelease(relsize_lock);
+		relsize_local_fill(&tag, size, hash, generation);
 	}
 }
 
@@ -123,14 +214,23 @@ update_cached_relsize(RelFileNode rnode, ForkNumber forknum, BlockNumber size)
 		RelTag		tag;
 		RelSizeEntry *entry;
 		bool		found;
+		uint32		hash;
+		uint32		generation;
 
 		tag.rnode = rnode;
 		tag.forknum = forknum;
+		hash = get_hash_value(relsize_hash, &tag);
 		LWLockAcquire(relsize_lock, LW_EXCLUSIVE);
-		entry = hash_search(relsize_hash, &tag, HASH_ENTER, &found);
+		entry = hash_search_with_hash_value(relsize_hash, &tag, hash, HASH_ENTER, &found);
 		if (!found || entry->size < size)
+		{
 			entry->size = size;
+			relsize_bump_generation(hash);
+		}
+		size = entry->size;
+		generation = pg_atomic_read_u32(&relsize_generations[hash % RELSIZE_N_GENERATIONS]);
 		LWLockRelease(relsize_lock);
+		relsize_local_fill(&tag, size, hash, generation);
 	}
 }
 
@@ -140,11 +240,14 @@ forget_cached_relsize(RelFileNode rnode, ForkNumber forknum)
 	if (relsize_hash_size > 0)
 	{
 		RelTag		tag;
+		uint32		hash;
 
 		tag.rnode = rnode;
 		tag.forknum = forknum;
+		hash = get_hash_value(relsize_hash, &tag);
 		LWLockAcquire(relsize_lock, LW_EXCLUSIVE);
-		hash_search(relsize_hash, &tag, HASH_REMOVE, NULL);
+		hash_search_with_hash_value(relsize_hash, &tag, hash, HASH_REMOVE, NULL);
+		relsize_bump_generation(hash);
 		LWLockRelease(relsize_lock);
 	}
 }
@@ -169,7 +272,8 @@ relsize_hash_init(void)
 		prev_shmem_request_hook = shmem_request_hook;
 		shmem_request_hook = relsize_shmem_request;
 #else
-		RequestAddinShmemSpace(hash_estimate_size(relsize_hash_size, sizeof(RelSizeEntry)));
+		RequestAddinShmemSpace(hash_estimate_size(relsize_hash_size, sizeof(RelSizeEntry))
+							   + sizeof(pg_atomic_uint32) * RELSIZE_N_GENERATIONS);
 		RequestNamedLWLockTranche("neon_relsize", 1);
 #endif
 
@@ -189,7 +293,8 @@ relsize_shmem_request(void)
 	if (prev_shmem_request_hook)
 		prev_shmem_request_hook();
 
-	RequestAddinShmemSpace(hash_estimate_size(relsize_hash_size, sizeof(RelSizeEntry)));
+	RequestAddinShmemSpace(hash_estimate_size(relsize_hash_size, sizeof(RelSizeEntry))
+						   + sizeof(pg_atomic_uint32) * RELSIZE_N_GENERATIONS);
 	RequestNamedLWLockTranche("neon_relsize", 1);
 }
 #endif
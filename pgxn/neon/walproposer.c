@@ -36,6 +36,7 @@
 #include <signal.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <zlib.h>
 #include "access/xact.h"
 #include "access/xlogdefs.h"
 #include "access/xlogutils.h"
@@ -47,8 +48,12 @@
 #include "storage/latch.h"
 #include "miscadmin.h"
 #include "pgstat.h"
+#include "access/htup_details.h"
 #include "access/xlog.h"
+#include "catalog/pg_type.h"
+#include "funcapi.h"
 #include "libpq/pqformat.h"
+#include "port/pg_bitutils.h"
 #include "replication/slot.h"
 #include "replication/walreceiver.h"
 #include "postmaster/bgworker.h"
@@ -61,6 +66,7 @@
 #include "storage/shmem.h"
 #include "storage/spin.h"
 #include "tcop/tcopprot.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/guc.h"
 #include "utils/memutils.h"
@@ -76,6 +82,7 @@ static bool syncSafekeepers = false;
 char	   *wal_acceptors_list;
 int			wal_acceptor_reconnect_timeout;
 int			wal_acceptor_connection_timeout;
+bool		wal_acceptor_compression;
 bool		am_wal_proposer;
 
 #define WAL_PROPOSER_SLOT_NAME "wal_proposer_slot"
@@ -90,11 +97,44 @@ static ProposerGreeting greetRequest;
 static VoteRequest voteRequest; /* Vote request for safekeeper */
 static WaitEventSet *waitEvents;
 static AppendResponse quorumFeedback;
+
+/*
+ * Cache of the most recently read WAL, shared by all safekeeper connections;
+ * see the comment above WalCacheMove for how it works.
+ */
+#define WAL_SEND_CACHE_SIZE (MAX_SEND_SIZE * 8)
+
+static char *walSendCache;
+static XLogRecPtr walCacheStart = InvalidXLogRecPtr;
+static XLogRecPtr walCacheEnd = InvalidXLogRecPtr;
+
+/*
+ * Ring of recently broadcast WAL positions with the time they became
+ * available, used by HandleSafekeeperResponse to measure how long the quorum
+ * takes to acknowledge them. When the ring is full new positions simply go
+ * unsampled, so a stalled quorum can't make it grow.
+ */
+#define QUORUM_LATENCY_RING_SIZE 128
+
+typedef struct
+{
+	XLogRecPtr	lsn;
+	TimestampTz ts;
+} QuorumLatencySample;
+
+static QuorumLatencySample quorumLatencyRing[QUORUM_LATENCY_RING_SIZE];
+static int	quorumRingHead;		/* oldest sample */
+static int	quorumRingCount;
 /*
  *  Minimal LSN which may be needed for recovery of some safekeeper,
  *  record-aligned (first record which might not yet received by someone).
  */
 static XLogRecPtr truncateLsn;
+/*
+ * Bumped every time the wait event set is recreated, so that the poll loop
+ * can tell that pending events from the old set are stale.
+ */
+static uint64 eventSetRebuilds;
 
 /*
  * Term of the proposer. We want our term to be highest and unique,
@@ -154,9 +194,10 @@ static XLogRecPtr GetAcknowledgedByQuorumWALPosition(void);
 static void HandleSafekeeperResponse(void);
 static bool AsyncRead(Safekeeper *sk, char **buf, int *buf_size);
 static bool AsyncReadMessage(Safekeeper *sk, AcceptorProposerMessage * anymsg);
-static bool BlockingWrite(Safekeeper *sk, void *msg, size_t msg_size, SafekeeperState success_state);
 static bool AsyncWrite(Safekeeper *sk, void *msg, size_t msg_size, SafekeeperState flush_state);
 static bool AsyncFlush(Safekeeper *sk);
+static int	LatencyBucket(uint64 us);
+static void UpdateSafekeeperStats(Safekeeper *sk, size_t sentBytes);
 
 static void nwp_shmem_startup_hook(void);
 static void nwp_register_gucs(void);
@@ -271,6 +312,16 @@ nwp_register_gucs(void)
 							PGC_SIGHUP,
 							GUC_UNIT_MS,
 							NULL, NULL, NULL);
+
+	DefineCustomBoolVariable(
+							 "neon.safekeeper_compression",
+							 "Compress WAL sent to safekeepers with zlib.",
+							 NULL,
+							 &wal_acceptor_compression,
+							 false,
+							 PGC_POSTMASTER,
+							 0,
+							 NULL, NULL, NULL);
 }
 
 /* shmem handling */
@@ -370,6 +421,21 @@ WalProposerBroadcast(XLogRecPtr startpos, XLogRecPtr endpos)
 {
 	Assert(startpos == availableLsn && endpos >= availableLsn);
 	availableLsn = endpos;
+
+	/*
+	 * Remember when this position became available, so that
+	 * HandleSafekeeperResponse can measure the time until a quorum
+	 * acknowledges it.
+	 */
+	if (endpos > startpos && quorumRingCount < QUORUM_LATENCY_RING_SIZE)
+	{
+		QuorumLatencySample *s =
+			&quorumLatencyRing[(quorumRingHead + quorumRingCount) % QUORUM_LATENCY_RING_SIZE];
+
+		s->lsn = endpos;
+		s->ts = GetCurrentTimestamp();
+		quorumRingCount++;
+	}
 	BroadcastAppendRequest();
 }
 
@@ -383,21 +449,42 @@ WalProposerPoll(void)
 {
 	while (true)
 	{
-		Safekeeper *sk;
 		int			rc;
-		WaitEvent	event;
+		WaitEvent	events[MAX_SAFEKEEPERS + 2];
+		bool		latchSet = false;
+		uint64		rebuilds = eventSetRebuilds;
 		TimestampTz now = GetCurrentTimestamp();
 
-		rc = WaitEventSetWait(waitEvents, TimeToReconnect(now),
-							  &event, 1, WAIT_EVENT_WAL_SENDER_MAIN);
-		sk = (Safekeeper *) event.user_data;
-
 		/*
-		 * If the event contains something that one of our safekeeper states
-		 * was waiting for, we'll advance its state.
+		 * Drain all ready events in one wakeup: with many safekeepers and a
+		 * high commit rate there is usually more than one socket ready, and
+		 * handling them together amortizes the WaitEventSetWait call.
 		 */
-		if (rc != 0 && (event.events & (WL_SOCKET_READABLE | WL_SOCKET_WRITEABLE)))
-			AdvancePollState(sk, event.events);
+		rc = WaitEventSetWait(waitEvents, TimeToReconnect(now),
+							  events, lengthof(events), WAIT_EVENT_WAL_SENDER_MAIN);
+		for (int i = 0; i < rc; i++)
+		{
+			Safekeeper *sk = (Safekeeper *) events[i].user_data;
+
+			if (events[i].events & WL_LATCH_SET)
+				latchSet = true;
+
+			/*
+			 * If the event contains something that one of our safekeeper
+			 * states was waiting for, we'll advance its state.
+			 */
+			if (events[i].events & (WL_SOCKET_READABLE | WL_SOCKET_WRITEABLE))
+				AdvancePollState(sk, events[i].events);
+
+			/*
+			 * Advancing a state can shut a connection down and rebuild the
+			 * event set; the remaining entries then refer to the old set, so
+			 * stop and re-poll. A latch event skipped this way is
+			 * level-triggered and will be reported again immediately.
+			 */
+			if (rebuilds != eventSetRebuilds)
+				break;
+		}
 
 		/*
 		 * If the timeout expired, attempt to reconnect to any safekeepers
@@ -410,7 +497,7 @@ WalProposerPoll(void)
 		 * each wal flush), then exit loop. (no need for pm death check due to
 		 * WL_EXIT_ON_PM_DEATH)
 		 */
-		if (rc != 0 && (event.events & WL_LATCH_SET))
+		if (latchSet)
 		{
 			ResetLatch(MyLatch);
 			break;
@@ -518,12 +605,16 @@ WalProposerInit(XLogRecPtr flushRecPtr, uint64 systemId)
 		}
 
 		initStringInfo(&safekeeper[n_safekeepers].outbuf);
+		initStringInfo(&safekeeper[n_safekeepers].compressBuf);
+		safekeeper[n_safekeepers].compression = WP_COMPRESSION_NONE;
 		safekeeper[n_safekeepers].xlogreader = XLogReaderAllocate(wal_segment_size, NULL, XL_ROUTINE(.segment_open = wal_segment_open,.segment_close = wal_segment_close), NULL);
 		if (safekeeper[n_safekeepers].xlogreader == NULL)
 			elog(FATAL, "Failed to allocate xlog reader");
 		safekeeper[n_safekeepers].flushWrite = false;
 		safekeeper[n_safekeepers].startStreamingAt = InvalidXLogRecPtr;
 		safekeeper[n_safekeepers].streamingAt = InvalidXLogRecPtr;
+		safekeeper[n_safekeepers].rttSampleLsn = InvalidXLogRecPtr;
+		safekeeper[n_safekeepers].rttSampleStartAt = 0;
 		n_safekeepers += 1;
 	}
 	if (n_safekeepers < 1)
@@ -532,6 +623,31 @@ WalProposerInit(XLogRecPtr flushRecPtr, uint64 systemId)
 	}
 	quorum = n_safekeepers / 2 + 1;
 
+	/*
+	 * Publish safekeeper identities and reset the streaming statistics
+	 * exposed through neon_walproposer_stats(). In --sync-safekeepers mode
+	 * there is no shared memory to publish into.
+	 */
+	if (!syncSafekeepers)
+	{
+		SpinLockAcquire(&walprop_shared->mutex);
+		walprop_shared->numSafekeepers = n_safekeepers;
+		memset(walprop_shared->skStats, 0, sizeof(walprop_shared->skStats));
+		walprop_shared->quorumLatencyCount = 0;
+		walprop_shared->quorumLatencySumUs = 0;
+		memset(walprop_shared->quorumLatencyBuckets, 0,
+			   sizeof(walprop_shared->quorumLatencyBuckets));
+		for (int i = 0; i < n_safekeepers; i++)
+		{
+			WalproposerSafekeeperStats *st = &walprop_shared->skStats[i];
+
+			st->active = true;
+			strlcpy(st->host, safekeeper[i].host, sizeof(st->host));
+			strlcpy(st->port, safekeeper[i].port, sizeof(st->port));
+		}
+		SpinLockRelease(&walprop_shared->mutex);
+	}
+
 	/* Fill the greeting package */
 	greetRequest.tag = 'g';
 	greetRequest.protocolVersion = SK_PROTOCOL_VERSION;
@@ -556,6 +672,10 @@ WalProposerInit(XLogRecPtr flushRecPtr, uint64 systemId)
 	greetRequest.timeline = ThisTimeLineID;
 #endif
 	greetRequest.walSegSize = wal_segment_size;
+	greetRequest.compressionAlg = wal_acceptor_compression
+		? WP_COMPRESSION_ZLIB : WP_COMPRESSION_NONE;
+
+	walSendCache = MemoryContextAlloc(TopMemoryContext, WAL_SEND_CACHE_SIZE);
 
 	InitEventSet();
 }
@@ -608,7 +728,16 @@ UpdateEventSet(Safekeeper *sk, uint32 events)
 	/* eventPos = -1 when we don't have an event */
 	Assert(sk->eventPos != -1);
 
+	/*
+	 * ModifyWaitEvent re-registers the socket with the kernel; skip it when
+	 * the desired mask hasn't changed, which is the common case when
+	 * HandleActiveState runs once per sent or received message.
+	 */
+	if (events == sk->curEvents)
+		return;
+
 	ModifyWaitEvent(waitEvents, sk->eventPos, events, NULL);
+	sk->curEvents = events;
 }
 
 /* Hack: provides a way to remove the event corresponding to an individual walproposer from the set.
@@ -623,6 +752,7 @@ HackyRemoveWalProposerEvent(Safekeeper *to_remove)
 	{
 		FreeWaitEventSet(waitEvents);
 		waitEvents = NULL;
+		eventSetRebuilds++;
 	}
 	/* Re-initialize it without adding any safekeeper events */
 	InitEventSet();
@@ -638,6 +768,7 @@ HackyRemoveWalProposerEvent(Safekeeper *to_remove)
 		Safekeeper *sk = &safekeeper[i];
 
 		sk->eventPos = -1;
+		sk->curEvents = WL_NO_EVENTS;
 
 		if (sk == to_remove)
 			continue;
@@ -647,6 +778,7 @@ HackyRemoveWalProposerEvent(Safekeeper *to_remove)
 		{
 			desired_events = SafekeeperStateDesiredEvents(sk->state);
 			sk->eventPos = AddWaitEventToSet(waitEvents, desired_events, walprop_socket(sk->conn), NULL, sk);
+			sk->curEvents = desired_events;
 		}
 	}
 }
@@ -661,6 +793,9 @@ ShutdownConnection(Safekeeper *sk)
 	sk->state = SS_OFFLINE;
 	sk->flushWrite = false;
 	sk->streamingAt = InvalidXLogRecPtr;
+	sk->compression = WP_COMPRESSION_NONE;
+	sk->rttSampleLsn = InvalidXLogRecPtr;
+	UpdateSafekeeperStats(sk, 0);
 
 	if (sk->voteResponse.termHistory.entries)
 		pfree(sk->voteResponse.termHistory.entries);
@@ -745,6 +880,7 @@ ResetConnection(Safekeeper *sk)
 
 	sock = walprop_socket(sk->conn);
 	sk->eventPos = AddWaitEventToSet(waitEvents, WL_SOCKET_WRITEABLE, sock, NULL, sk);
+	sk->curEvents = WL_SOCKET_WRITEABLE;
 	return;
 }
 
@@ -828,6 +964,15 @@ AdvancePollState(Safekeeper *sk, uint32 events)
 			RecvStartWALPushResult(sk);
 			break;
 
+			/* Flush proposer greeting message */
+		case SS_HANDSHAKE_SEND_FLUSH:
+			if (!AsyncFlush(sk))
+				return;
+
+			sk->state = SS_HANDSHAKE_RECV;
+			UpdateEventSet(sk, WL_SOCKET_READABLE);
+			break;
+
 			/*
 			 * Finish handshake comms: receive information about the
 			 * safekeeper.
@@ -848,6 +993,15 @@ AdvancePollState(Safekeeper *sk, uint32 events)
 			ResetConnection(sk);
 			return;
 
+			/* Flush vote request message */
+		case SS_SEND_VOTE_FLUSH:
+			if (!AsyncFlush(sk))
+				return;
+
+			sk->state = SS_WAIT_VERDICT;
+			UpdateEventSet(sk, WL_SOCKET_READABLE);
+			break;
+
 			/* Read the safekeeper response for our candidate */
 		case SS_WAIT_VERDICT:
 			RecvVoteResponse(sk);
@@ -939,6 +1093,7 @@ HandleConnectionEvent(Safekeeper *sk)
 	 */
 	HackyRemoveWalProposerEvent(sk);
 	sk->eventPos = AddWaitEventToSet(waitEvents, new_events, walprop_socket(sk->conn), NULL, sk);
+	sk->curEvents = new_events;
 
 	/* If we successfully connected, send START_WAL_PUSH query */
 	if (result == WP_CONN_POLLING_OK)
@@ -1018,9 +1173,15 @@ SendProposerGreeting(Safekeeper *sk)
 {
 	/*
 	 * On failure, logging & resetting the connection is handled. We just need
-	 * to handle the control flow.
+	 * to handle the control flow. If the socket pushes back, the message
+	 * stays in the output buffer and is flushed from SS_HANDSHAKE_SEND_FLUSH
+	 * when the socket becomes writeable, without blocking the event loop.
 	 */
-	BlockingWrite(sk, &greetRequest, sizeof(greetRequest), SS_HANDSHAKE_RECV);
+	if (!AsyncWrite(sk, &greetRequest, sizeof(greetRequest), SS_HANDSHAKE_SEND_FLUSH))
+		return;
+
+	sk->state = SS_HANDSHAKE_RECV;
+	UpdateEventSet(sk, WL_SOCKET_READABLE);
 }
 
 static void
@@ -1037,6 +1198,17 @@ RecvAcceptorGreeting(Safekeeper *sk)
 
 	elog(LOG, "received AcceptorGreeting from safekeeper %s:%s", sk->host, sk->port);
 
+	/* Adopt the payload codec the safekeeper agreed to, if we offered it. */
+	if (sk->greetResponse.compressionAlg == greetRequest.compressionAlg)
+		sk->compression = sk->greetResponse.compressionAlg;
+	else
+	{
+		if (sk->greetResponse.compressionAlg != WP_COMPRESSION_NONE)
+			elog(WARNING, "safekeeper %s:%s chose unsupported compression codec %u, sending raw WAL",
+				 sk->host, sk->port, sk->greetResponse.compressionAlg);
+		sk->compression = WP_COMPRESSION_NONE;
+	}
+
 	/* Protocol is all good, move to voting. */
 	sk->state = SS_VOTING;
 
@@ -1110,10 +1282,12 @@ SendVoteRequest(Safekeeper *sk)
 	/* We have quorum for voting, send our vote request */
 	elog(LOG, "requesting vote from %s:%s for term " UINT64_FORMAT, sk->host, sk->port, voteRequest.term);
 	/* On failure, logging & resetting is handled */
-	if (!BlockingWrite(sk, &voteRequest, sizeof(voteRequest), SS_WAIT_VERDICT))
+	if (!AsyncWrite(sk, &voteRequest, sizeof(voteRequest), SS_SEND_VOTE_FLUSH))
 		return;
 
 	/* If successful, wait for read-ready with SS_WAIT_VERDICT */
+	sk->state = SS_WAIT_VERDICT;
+	UpdateEventSet(sk, WL_SOCKET_READABLE);
 }
 
 static void
@@ -1658,6 +1832,64 @@ BroadcastAppendRequest()
 			SendMessageToNode(&safekeeper[i]);
 }
 
+/*
+ * Cache of the most recently read WAL, shared by all safekeeper connections.
+ *
+ * In the common case every caught-up safekeeper is sent the same few chunks
+ * just below availableLsn one after another; without the cache each of them
+ * re-reads the range from the WAL segment through its own xlogreader, so the
+ * bytes a backend just wrote are read back from disk once per quorum member.
+ * The cache holds a contiguous window [walCacheStart, walCacheEnd) stored as
+ * a ring addressed by lsn % WAL_SEND_CACHE_SIZE: the first send of a range
+ * fills it, the remaining safekeepers are served from memory. Historical
+ * ranges (a lagging safekeeper catching up after election) miss the window
+ * and fall back to segment reads as before.
+ */
+
+/* memcpy between a linear buffer and the ring, splitting at the wrap point */
+static void
+WalCacheMove(char *buf, XLogRecPtr lsn, Size count, bool into_cache)
+{
+	while (count > 0)
+	{
+		Size		off = lsn % WAL_SEND_CACHE_SIZE;
+		Size		chunk = Min(count, WAL_SEND_CACHE_SIZE - off);
+
+		if (into_cache)
+			memcpy(walSendCache + off, buf, chunk);
+		else
+			memcpy(buf, walSendCache + off, chunk);
+		buf += chunk;
+		lsn += chunk;
+		count -= chunk;
+	}
+}
+
+static bool
+ReadWalFromCache(char *dest, XLogRecPtr start, Size count)
+{
+	if (walSendCache == NULL ||
+		start < walCacheStart || start + count > walCacheEnd)
+		return false;
+	WalCacheMove(dest, start, count, false);
+	return true;
+}
+
+static void
+StoreWalInCache(char *src, XLogRecPtr start, Size count)
+{
+	if (walSendCache == NULL || count > WAL_SEND_CACHE_SIZE)
+		return;
+
+	/* The window must stay contiguous: restart it unless appending */
+	if (walCacheEnd != start)
+		walCacheStart = start;
+	WalCacheMove(src, start, count, true);
+	walCacheEnd = start + count;
+	if (walCacheEnd - walCacheStart > WAL_SEND_CACHE_SIZE)
+		walCacheStart = walCacheEnd - WAL_SEND_CACHE_SIZE;
+}
+
 static void
 PrepareAppendRequest(AppendRequestHeader * req, XLogRecPtr beginLsn, XLogRecPtr endLsn)
 {
@@ -1672,6 +1904,40 @@ PrepareAppendRequest(AppendRequestHeader * req, XLogRecPtr beginLsn, XLogRecPtr
 	req->proposerId = greetRequest.proposerId;
 }
 
+/* Map a latency in microseconds to its power-of-two histogram bucket */
+static int
+LatencyBucket(uint64 us)
+{
+	int			bucket = us > 0 ? pg_leftmost_one_pos64(us) : 0;
+
+	return Min(bucket, WP_LATENCY_BUCKETS - 1);
+}
+
+/*
+ * Publish this safekeeper's send-side counters in shared memory. 'sentBytes'
+ * is how much was queued to the socket since the previous call.
+ */
+static void
+UpdateSafekeeperStats(Safekeeper *sk, size_t sentBytes)
+{
+	WalproposerSafekeeperStats *st;
+	XLogRecPtr	ackedLsn;
+
+	if (syncSafekeepers)
+		return;
+
+	/*
+	 * Until the first response arrives flushLsn is zero; count from the
+	 * position we started streaming at instead.
+	 */
+	ackedLsn = Max(sk->appendResponse.flushLsn, sk->startStreamingAt);
+	st = &walprop_shared->skStats[sk - safekeeper];
+	SpinLockAcquire(&walprop_shared->mutex);
+	st->bytesSent += sentBytes;
+	st->bytesInflight = sk->streamingAt > ackedLsn ? sk->streamingAt - ackedLsn : 0;
+	SpinLockRelease(&walprop_shared->mutex);
+}
+
 /*
  * Process all events happened in SS_ACTIVE state, update event set after that.
  */
@@ -1717,9 +1983,12 @@ SendAppendRequests(Safekeeper *sk)
 {
 	XLogRecPtr	endLsn;
 	AppendRequestHeader *req;
-	PGAsyncWriteResult writeResult;
 	WALReadError errinfo;
 	bool		sentAnything = false;
+	char	   *msgData;
+	size_t		msgLen;
+	size_t		queuedBytes = 0;
+	size_t		sentBytes = 0;
 
 	if (sk->flushWrite)
 	{
@@ -1764,57 +2033,145 @@ SendAppendRequests(Safekeeper *sk)
 		/* write AppendRequest header */
 		appendBinaryStringInfo(&sk->outbuf, (char *) req, sizeof(AppendRequestHeader));
 
-		/* write the WAL itself */
+		/* write the WAL itself, from the send cache when it has the range */
 		enlargeStringInfo(&sk->outbuf, req->endLsn - req->beginLsn);
-		if (!WALRead(sk->xlogreader,
-					 &sk->outbuf.data[sk->outbuf.len],
-					 req->beginLsn,
-					 req->endLsn - req->beginLsn,
+		if (!ReadWalFromCache(&sk->outbuf.data[sk->outbuf.len],
+							  req->beginLsn,
+							  req->endLsn - req->beginLsn))
+		{
+			if (!WALRead(sk->xlogreader,
+						 &sk->outbuf.data[sk->outbuf.len],
+						 req->beginLsn,
+						 req->endLsn - req->beginLsn,
 #if PG_VERSION_NUM >= 150000
-		/* FIXME don't use hardcoded timeline_id here */
-					 1,
+			/* FIXME don't use hardcoded timeline_id here */
+						 1,
 #else
-					 ThisTimeLineID,
+						 ThisTimeLineID,
 #endif
-					 &errinfo))
-		{
-			WALReadRaiseError(&errinfo);
+						 &errinfo))
+			{
+				WALReadRaiseError(&errinfo);
+			}
+			StoreWalInCache(&sk->outbuf.data[sk->outbuf.len],
+							req->beginLsn,
+							req->endLsn - req->beginLsn);
 		}
 		sk->outbuf.len += req->endLsn - req->beginLsn;
 
-		writeResult = walprop_async_write(sk->conn, sk->outbuf.data, sk->outbuf.len);
+		msgData = sk->outbuf.data;
+		msgLen = sk->outbuf.len;
+
+		/*
+		 * If the safekeeper agreed to zlib compression during the greeting,
+		 * ship the WAL payload as a 'z' message: the same header followed by
+		 * a self-contained zlib stream, whose decompressed size the receiver
+		 * knows from endLsn - beginLsn. Every message compresses
+		 * independently, so reconnects can resume at any position.
+		 * Incompressible payloads keep the plain 'a' format.
+		 */
+		if (sk->compression == WP_COMPRESSION_ZLIB && req->endLsn > req->beginLsn)
+		{
+			uLong		walSize = req->endLsn - req->beginLsn;
+			uLongf		compressedSize = compressBound(walSize);
+
+			resetStringInfo(&sk->compressBuf);
+			enlargeStringInfo(&sk->compressBuf, sizeof(AppendRequestHeader) + compressedSize);
+			if (compress2((Bytef *) sk->compressBuf.data + sizeof(AppendRequestHeader),
+						  &compressedSize,
+						  (Bytef *) sk->outbuf.data + sizeof(AppendRequestHeader),
+						  walSize, Z_BEST_SPEED) == Z_OK &&
+				compressedSize < walSize)
+			{
+				AppendRequestHeader *zreq = (AppendRequestHeader *) sk->compressBuf.data;
+
+				*zreq = *req;
+				zreq->tag = 'z';
+				sk->compressBuf.len = sizeof(AppendRequestHeader) + compressedSize;
+				msgData = sk->compressBuf.data;
+				msgLen = sk->compressBuf.len;
+			}
+		}
+
+		/*
+		 * Queue the message without flushing: one flush below pushes the
+		 * whole batch to the socket in a single write, instead of a syscall
+		 * per MAX_SEND_SIZE chunk.
+		 */
+		if (!walprop_async_write_noflush(sk->conn, msgData, msgLen))
+		{
+			elog(WARNING, "Failed to send to node %s:%s in %s state: %s",
+				 sk->host, sk->port, FormatSafekeeperState(sk->state),
+				 walprop_error_message(sk->conn));
+			ShutdownConnection(sk);
+			return false;
+		}
 
 		/* Mark current message as sent, whatever the result is */
 		sk->streamingAt = endLsn;
 
-		switch (writeResult)
+		/*
+		 * Start a round-trip sample if none is in flight: the response
+		 * covering endLsn completes it in RecvAppendResponses. Heartbeats
+		 * carry no WAL and are not sampled.
+		 */
+		if (!syncSafekeepers && sk->rttSampleLsn == InvalidXLogRecPtr &&
+			req->endLsn > req->beginLsn)
 		{
-			case PG_ASYNC_WRITE_SUCCESS:
-				/* Continue writing the next message */
-				break;
+			sk->rttSampleLsn = req->endLsn;
+			sk->rttSampleStartAt = GetCurrentTimestamp();
+		}
 
-			case PG_ASYNC_WRITE_TRY_FLUSH:
+		/*
+		 * Don't let libpq's output buffer grow without bound while catching
+		 * up: push intermediate batches, and if the socket pushes back, stop
+		 * queueing and wait for it to become writeable again.
+		 */
+		queuedBytes += msgLen;
+		sentBytes += msgLen;
+		if (queuedBytes >= MAX_SEND_BATCH_SIZE)
+		{
+			switch (walprop_flush(sk->conn))
+			{
+				case 0:
+					queuedBytes = 0;
+					break;
+				case 1:
+					sk->flushWrite = true;
+					UpdateSafekeeperStats(sk, sentBytes);
+					return true;
+				case -1:
+					elog(WARNING, "Failed to send to node %s:%s in %s state: %s",
+						 sk->host, sk->port, FormatSafekeeperState(sk->state),
+						 walprop_error_message(sk->conn));
+					ShutdownConnection(sk);
+					return false;
+			}
+		}
+	}
 
-				/*
-				 * * We still need to call PQflush some more to finish the
-				 * job. Caller function will handle this by setting right
-				 * event* set.
-				 */
-				sk->flushWrite = true;
-				return true;
+	/* Flush whatever remains of the batch */
+	switch (walprop_flush(sk->conn))
+	{
+		case 0:
+			break;
+		case 1:
 
-			case PG_ASYNC_WRITE_FAIL:
-				elog(WARNING, "Failed to send to node %s:%s in %s state: %s",
-					 sk->host, sk->port, FormatSafekeeperState(sk->state),
-					 walprop_error_message(sk->conn));
-				ShutdownConnection(sk);
-				return false;
-			default:
-				Assert(false);
-				return false;
-		}
+			/*
+			 * We still need to call PQflush some more to finish the job.
+			 * Caller function will handle this by setting right event set.
+			 */
+			sk->flushWrite = true;
+			break;
+		case -1:
+			elog(WARNING, "Failed to send to node %s:%s in %s state: %s",
+				 sk->host, sk->port, FormatSafekeeperState(sk->state),
+				 walprop_error_message(sk->conn));
+			ShutdownConnection(sk);
+			return false;
 	}
 
+	UpdateSafekeeperStats(sk, sentBytes);
 	return true;
 }
 
@@ -1858,12 +2215,36 @@ RecvAppendResponses(Safekeeper *sk)
 				 sk->appendResponse.term, propTerm);
 		}
 
+		/*
+		 * Account the response and, if it acknowledges the sampled request,
+		 * record the round trip. latestMsgReceivedAt was just set by
+		 * AsyncReadMessage, so no extra clock reading is needed here.
+		 */
+		if (!syncSafekeepers)
+		{
+			WalproposerSafekeeperStats *st = &walprop_shared->skStats[sk - safekeeper];
+
+			SpinLockAcquire(&walprop_shared->mutex);
+			st->appendResponses++;
+			if (sk->rttSampleLsn != InvalidXLogRecPtr &&
+				sk->appendResponse.flushLsn >= sk->rttSampleLsn)
+			{
+				uint64		us = sk->latestMsgReceivedAt - sk->rttSampleStartAt;
+
+				st->appendRttSumUs += us;
+				st->appendRttBuckets[LatencyBucket(us)]++;
+				sk->rttSampleLsn = InvalidXLogRecPtr;
+			}
+			SpinLockRelease(&walprop_shared->mutex);
+		}
+
 		readAnything = true;
 	}
 
 	if (!readAnything)
 		return sk->state == SS_ACTIVE;
 
+	UpdateSafekeeperStats(sk, 0);
 	HandleSafekeeperResponse();
 
 	/*
@@ -2132,6 +2513,27 @@ HandleSafekeeperResponse(void)
 	minQuorumLsn = GetAcknowledgedByQuorumWALPosition();
 	diskConsistentLsn = quorumFeedback.rf.disk_consistent_lsn;
 
+	/* Record time-to-quorum for broadcast positions the quorum now covers */
+	if (!syncSafekeepers && quorumRingCount > 0 &&
+		quorumLatencyRing[quorumRingHead].lsn <= minQuorumLsn)
+	{
+		TimestampTz now = GetCurrentTimestamp();
+
+		SpinLockAcquire(&walprop_shared->mutex);
+		while (quorumRingCount > 0 &&
+			   quorumLatencyRing[quorumRingHead].lsn <= minQuorumLsn)
+		{
+			uint64		us = now - quorumLatencyRing[quorumRingHead].ts;
+
+			walprop_shared->quorumLatencyCount++;
+			walprop_shared->quorumLatencySumUs += us;
+			walprop_shared->quorumLatencyBuckets[LatencyBucket(us)]++;
+			quorumRingHead = (quorumRingHead + 1) % QUORUM_LATENCY_RING_SIZE;
+			quorumRingCount--;
+		}
+		SpinLockRelease(&walprop_shared->mutex);
+	}
+
 	if (!syncSafekeepers)
 	{
 		/* Get PageserverFeedback fields from the most advanced safekeeper */
@@ -2318,6 +2720,9 @@ AsyncReadMessage(Safekeeper *sk, AcceptorProposerMessage * anymsg)
 
 				msg->term = pq_getmsgint64_le(&s);
 				msg->nodeId = pq_getmsgint64_le(&s);
+				/* older safekeepers don't report a codec */
+				msg->compressionAlg = s.cursor < s.len
+					? pq_getmsgint32_le(&s) : WP_COMPRESSION_NONE;
 				pq_getmsgend(&s);
 				return true;
 			}
@@ -2366,39 +2771,6 @@ AsyncReadMessage(Safekeeper *sk, AcceptorProposerMessage * anymsg)
 	}
 }
 
-/*
- * Blocking equivalent to AsyncWrite.
- *
- * We use this everywhere messages are small enough that they should fit in a
- * single packet.
- */
-static bool
-BlockingWrite(Safekeeper *sk, void *msg, size_t msg_size, SafekeeperState success_state)
-{
-	uint32		events;
-
-	if (!walprop_blocking_write(sk->conn, msg, msg_size))
-	{
-		elog(WARNING, "Failed to send to node %s:%s in %s state: %s",
-			 sk->host, sk->port, FormatSafekeeperState(sk->state),
-			 walprop_error_message(sk->conn));
-		ShutdownConnection(sk);
-		return false;
-	}
-
-	sk->state = success_state;
-
-	/*
-	 * If the new state will be waiting for events to happen, update the event
-	 * set to wait for those
-	 */
-	events = SafekeeperStateDesiredEvents(success_state);
-	if (events)
-		UpdateEventSet(sk, events);
-
-	return true;
-}
-
 /*
  * Starts a write into the 'i'th safekeeper's postgres connection, moving to
  * flush_state (adjusting eventset) if write still needs flushing.
@@ -2550,3 +2922,142 @@ BackpressureThrottlingTime(void)
 {
 	return pg_atomic_read_u64(&walprop_shared->backpressureThrottlingTime);
 }
+
+/*
+ * Function context for data persisting over repeated calls.
+ */
+typedef struct
+{
+	TupleDesc	tupdesc;
+	WalproposerShmemState *snap;
+} WalproposerStatsContext;
+
+/*
+ * Function returning walproposer streaming statistics: one row per configured
+ * safekeeper, followed by a summary row (NULL host and port) carrying the
+ * time-to-quorum distribution. Histograms are arrays of power-of-two
+ * microsecond buckets: element i counts samples in [2^i, 2^(i+1)) us, the
+ * last bucket everything above.
+ */
+PG_FUNCTION_INFO_V1(neon_walproposer_stats);
+
+#define NUM_WALPROPOSER_STATS_ELEM	7
+
+Datum
+neon_walproposer_stats(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	MemoryContext oldcontext;
+	WalproposerStatsContext *fctx;	/* User function context. */
+	TupleDesc	tupledesc;
+	TupleDesc	expected_tupledesc;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		funcctx = SRF_FIRSTCALL_INIT();
+
+		/* Switch context when allocating stuff to be used in later calls */
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		/* Create a user function context for cross-call persistence */
+		fctx = (WalproposerStatsContext *) palloc(sizeof(WalproposerStatsContext));
+
+		if (get_call_result_type(fcinfo, NULL, &expected_tupledesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "return type must be a row type");
+
+		if (expected_tupledesc->natts != NUM_WALPROPOSER_STATS_ELEM)
+			elog(ERROR, "incorrect number of output arguments");
+
+		/* Construct a tuple descriptor for the result rows. */
+		tupledesc = CreateTemplateTupleDesc(expected_tupledesc->natts);
+		TupleDescInitEntry(tupledesc, (AttrNumber) 1, "host",
+						   TEXTOID, -1, 0);
+		TupleDescInitEntry(tupledesc, (AttrNumber) 2, "port",
+						   TEXTOID, -1, 0);
+		TupleDescInitEntry(tupledesc, (AttrNumber) 3, "bytes_sent",
+						   INT8OID, -1, 0);
+		TupleDescInitEntry(tupledesc, (AttrNumber) 4, "bytes_inflight",
+						   INT8OID, -1, 0);
+		TupleDescInitEntry(tupledesc, (AttrNumber) 5, "append_responses",
+						   INT8OID, -1, 0);
+		TupleDescInitEntry(tupledesc, (AttrNumber) 6, "rtt_sum_us",
+						   INT8OID, -1, 0);
+		TupleDescInitEntry(tupledesc, (AttrNumber) 7, "rtt_histogram",
+						   INT8ARRAYOID, -1, 0);
+
+		fctx->tupdesc = BlessTupleDesc(tupledesc);
+
+		/*
+		 * Copy the whole shared state under the spinlock, so that the rows we
+		 * return form a consistent snapshot. No shared state means the
+		 * walproposer has never run here: return no rows.
+		 */
+		if (walprop_shared != NULL)
+		{
+			fctx->snap = (WalproposerShmemState *) palloc(sizeof(WalproposerShmemState));
+			SpinLockAcquire(&walprop_shared->mutex);
+			memcpy(fctx->snap, walprop_shared, sizeof(WalproposerShmemState));
+			SpinLockRelease(&walprop_shared->mutex);
+			funcctx->max_calls = fctx->snap->numSafekeepers + 1;
+		}
+		else
+		{
+			fctx->snap = NULL;
+			funcctx->max_calls = 0;
+		}
+		funcctx->user_fctx = fctx;
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+
+	/* Get the saved state */
+	fctx = funcctx->user_fctx;
+
+	if (funcctx->call_cntr < funcctx->max_calls)
+	{
+		uint32		i = funcctx->call_cntr;
+		Datum		values[NUM_WALPROPOSER_STATS_ELEM];
+		bool		nulls[NUM_WALPROPOSER_STATS_ELEM];
+		Datum		buckets[WP_LATENCY_BUCKETS];
+		uint64	   *bucketSrc;
+		HeapTuple	tuple;
+
+		MemSet(nulls, 0, sizeof(nulls));
+
+		if (i < (uint32) fctx->snap->numSafekeepers)
+		{
+			WalproposerSafekeeperStats *st = &fctx->snap->skStats[i];
+
+			values[0] = CStringGetTextDatum(st->host);
+			values[1] = CStringGetTextDatum(st->port);
+			values[2] = Int64GetDatum((int64) st->bytesSent);
+			values[3] = Int64GetDatum((int64) st->bytesInflight);
+			values[4] = Int64GetDatum((int64) st->appendResponses);
+			values[5] = Int64GetDatum((int64) st->appendRttSumUs);
+			bucketSrc = st->appendRttBuckets;
+		}
+		else
+		{
+			/* Summary row: how long quorum acknowledgement took */
+			nulls[0] = true;
+			nulls[1] = true;
+			nulls[2] = true;
+			nulls[3] = true;
+			values[4] = Int64GetDatum((int64) fctx->snap->quorumLatencyCount);
+			values[5] = Int64GetDatum((int64) fctx->snap->quorumLatencySumUs);
+			bucketSrc = fctx->snap->quorumLatencyBuckets;
+		}
+
+		for (int j = 0; j < WP_LATENCY_BUCKETS; j++)
+			buckets[j] = Int64GetDatum((int64) bucketSrc[j]);
+		values[6] = PointerGetDatum(construct_array(buckets, WP_LATENCY_BUCKETS,
+													INT8OID, 8, FLOAT8PASSBYVAL, 'd'));
+
+		tuple = heap_form_tuple(fctx->tupdesc, values, nulls);
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
@@ -13,9 +13,18 @@
 #define SK_MAGIC 0xCafeCeefu
 #define SK_PROTOCOL_VERSION 2
 
+/*
+ * Codecs for AppendRequest WAL payloads, negotiated during the greeting
+ * exchange. Values are sent on the wire.
+ */
+#define WP_COMPRESSION_NONE 0
+#define WP_COMPRESSION_ZLIB 1
+
 #define MAX_SAFEKEEPERS 32
 #define MAX_SEND_SIZE (XLOG_BLCKSZ * 16)	/* max size of a single* WAL
 											 * message */
+#define MAX_SEND_BATCH_SIZE (MAX_SEND_SIZE * 4) /* how much WAL to queue*
+												 * before flushing the socket */
 #define XLOG_HDR_SIZE (1 + 8 * 3)	/* 'w' + startPos + walEnd + timestamp */
 #define XLOG_HDR_START_POS 1	/* offset of start position in wal sender*
 								 * message header */
@@ -31,6 +40,7 @@
 extern char *wal_acceptors_list;
 extern int	wal_acceptor_reconnect_timeout;
 extern int	wal_acceptor_connection_timeout;
+extern bool	wal_acceptor_compression;
 extern bool am_wal_proposer;
 
 struct WalProposerConn;			/* Defined in libpqwalproposer */
@@ -109,6 +119,9 @@ typedef enum
 	 */
 	SS_WAIT_EXEC_RESULT,
 
+	/* Need to flush ProposerGreeting message. */
+	SS_HANDSHAKE_SEND_FLUSH,
+
 	/*
 	 * Executing the receiving half of the handshake. After receiving, moves
 	 * to SS_VOTING.
@@ -124,6 +137,9 @@ typedef enum
 	 */
 	SS_VOTING,
 
+	/* Need to flush VoteRequest message. */
+	SS_SEND_VOTE_FLUSH,
+
 	/*
 	 * Already sent voting information, waiting to receive confirmation from
 	 * the node. After receiving, moves to SS_IDLE, if the quorum isn't
@@ -171,6 +187,13 @@ typedef struct ProposerGreeting
 	uint8		tenant_id[16];
 	TimeLineID	timeline;
 	uint32		walSegSize;
+
+	/*
+	 * Codec the proposer offers for AppendRequest WAL payloads
+	 * (WP_COMPRESSION_*). Safekeepers ignore trailing greeting bytes they
+	 * don't understand, so this field is safe to send unconditionally.
+	 */
+	uint32		compressionAlg;
 }			ProposerGreeting;
 
 typedef struct AcceptorProposerMessage
@@ -186,6 +209,8 @@ typedef struct AcceptorGreeting
 	AcceptorProposerMessage apm;
 	term_t		term;
 	NNodeId		nodeId;
+	uint32		compressionAlg; /* codec the safekeeper chose; older ones*
+								 * don't send it and get WP_COMPRESSION_NONE */
 }			AcceptorGreeting;
 
 /*
@@ -291,12 +316,42 @@ typedef struct PageserverFeedback
 	TimestampTz replytime;
 }			PageserverFeedback;
 
+/*
+ * Latency histograms use power-of-two microsecond buckets: bucket i counts
+ * samples in [2^i, 2^(i+1)) us, the last bucket everything above.
+ */
+#define WP_LATENCY_BUCKETS 20
+
+/*
+ * Per-safekeeper streaming counters, maintained by the walproposer in shared
+ * memory and exposed through neon_walproposer_stats().
+ */
+typedef struct WalproposerSafekeeperStats
+{
+	bool		active;			/* slot belongs to a configured safekeeper */
+	char		host[64];
+	char		port[16];
+	uint64		bytesSent;		/* WAL bytes queued to the socket */
+	uint64		bytesInflight;	/* sent but not yet acknowledged */
+	uint64		appendResponses;	/* AppendResponse messages received */
+	uint64		appendRttSumUs; /* sum of sampled append round-trip times */
+	uint64		appendRttBuckets[WP_LATENCY_BUCKETS];
+}			WalproposerSafekeeperStats;
+
 typedef struct WalproposerShmemState
 {
 	slock_t		mutex;
 	PageserverFeedback feedback;
 	term_t		mineLastElectedTerm;
 	pg_atomic_uint64 backpressureThrottlingTime;
+
+	/* Streaming statistics, protected by 'mutex' like 'feedback' */
+	int			numSafekeepers;
+	WalproposerSafekeeperStats skStats[MAX_SAFEKEEPERS];
+	/* time from WAL becoming available to its acknowledgement by a quorum */
+	uint64		quorumLatencyCount;
+	uint64		quorumLatencySumUs;
+	uint64		quorumLatencyBuckets[WP_LATENCY_BUCKETS];
 }			WalproposerShmemState;
 
 /*
@@ -345,8 +400,10 @@ typedef struct Safekeeper
 	/*
 	 * postgres protocol connection to the WAL acceptor
 	 *
-	 * Equals NULL only when state = SS_OFFLINE. Nonblocking is set once we
-	 * reach SS_ACTIVE; not before.
+	 * Equals NULL only when state = SS_OFFLINE. The connection is switched to
+	 * nonblocking mode for the first message of the handshake and stays that
+	 * way: all writes go through libpq's output buffer, which is drained on
+	 * WL_SOCKET_WRITEABLE, so a slow safekeeper never stalls the event loop.
 	 */
 	WalProposerConn *conn;
 
@@ -355,6 +412,15 @@ typedef struct Safekeeper
 	 */
 	StringInfoData outbuf;
 
+	/*
+	 * Scratch buffer for the compressed copy of an AppendRequest, used when
+	 * 'compression' is not WP_COMPRESSION_NONE.
+	 */
+	StringInfoData compressBuf;
+
+	uint32		compression;	/* AppendRequest payload codec negotiated*
+								 * during the greeting exchange */
+
 	/*
 	 * WAL reader, allocated for each safekeeper.
 	 */
@@ -368,10 +434,21 @@ typedef struct Safekeeper
 	bool		flushWrite;		/* set to true if we need to call AsyncFlush,*
 								 * to flush pending messages */
 	XLogRecPtr	streamingAt;	/* current streaming position */
+
+	/*
+	 * Round-trip sampling: endLsn of the AppendRequest whose acknowledgement
+	 * we are timing, or InvalidXLogRecPtr when no sample is in flight. One
+	 * sample per connection at a time keeps the overhead to a single
+	 * timestamp per round trip.
+	 */
+	XLogRecPtr	rttSampleLsn;
+	TimestampTz rttSampleStartAt;	/* when the sampled request was queued */
+
 	AppendRequestHeader appendRequest;	/* request for sending to safekeeper */
 
 	int			eventPos;		/* position in wait event set. Equal to -1 if*
 								 * no event */
+	uint32		curEvents;		/* event mask eventPos is registered with */
 	SafekeeperState state;		/* safekeeper state machine state */
 	TimestampTz latestMsgReceivedAt;        /* when latest msg is received */
 	AcceptorGreeting greetResponse; /* acceptor greeting */
@@ -500,11 +577,12 @@ extern PGAsyncReadResult walprop_async_read(WalProposerConn *conn, char **buf, i
 extern PGAsyncWriteResult walprop_async_write(WalProposerConn *conn, void const *buf, size_t size);
 
 /*
- * Blocking equivalent to walprop_async_write_fn
+ * Queue a CopyData message without flushing; a batch of such messages is
+ * pushed to the socket by one walprop_flush.
  *
  * Returns 'true' if successful, 'false' on failure.
  */
-extern bool walprop_blocking_write(WalProposerConn *conn, void const *buf, size_t size);
+extern bool walprop_async_write_noflush(WalProposerConn *conn, void const *buf, size_t size);
 
 extern uint64 BackpressureThrottlingTime(void);
 
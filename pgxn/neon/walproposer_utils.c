@@ -144,12 +144,18 @@ FormatSafekeeperState(SafekeeperState state)
 		case SS_WAIT_EXEC_RESULT:
 			return_val = "receiving query result";
 			break;
+		case SS_HANDSHAKE_SEND_FLUSH:
+			return_val = "handshake (flushing)";
+			break;
 		case SS_HANDSHAKE_RECV:
 			return_val = "handshake (receiving)";
 			break;
 		case SS_VOTING:
 			return_val = "voting";
 			break;
+		case SS_SEND_VOTE_FLUSH:
+			return_val = "send-vote-flush";
+			break;
 		case SS_WAIT_VERDICT:
 			return_val = "wait-for-verdict";
 			break;
@@ -243,6 +249,8 @@ SafekeeperStateDesiredEvents(SafekeeperState state)
 			 * TODO: SS_ACTIVE sometimes doesn't need to be write-ready. We
 			 * should check sk->flushWrite here to set WL_SOCKET_WRITEABLE.
 			 */
+		case SS_HANDSHAKE_SEND_FLUSH:
+		case SS_SEND_VOTE_FLUSH:
 		case SS_SEND_ELECTED_FLUSH:
 		case SS_ACTIVE:
 			result = WL_SOCKET_READABLE | WL_SOCKET_WRITEABLE;
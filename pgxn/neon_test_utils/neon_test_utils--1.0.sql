@@ -27,3 +27,35 @@ CREATE FUNCTION neon_xlogflush(lsn pg_lsn)
 RETURNS VOID
 AS 'MODULE_PATHNAME', 'neon_xlogflush'
 LANGUAGE C PARALLEL UNSAFE;
+
+-- Storage microbenchmarks. Superuser only; see neontest.c for details.
+
+CREATE FUNCTION neon_bench_getpage(relname text, nreads int4, sequential bool,
+    OUT reads int8, OUT total_us int8, OUT min_us int8,
+    OUT p50_us int8, OUT p99_us int8, OUT max_us int8)
+RETURNS record
+AS 'MODULE_PATHNAME', 'neon_bench_getpage'
+LANGUAGE C STRICT
+PARALLEL UNSAFE;
+
+CREATE FUNCTION neon_bench_lfc(nblocks int4,
+    OUT blocks int8, OUT write_us int8, OUT write_mb_per_sec float8,
+    OUT read_us int8, OUT read_hits int8)
+RETURNS record
+AS 'MODULE_PATHNAME', 'neon_bench_lfc'
+LANGUAGE C STRICT
+PARALLEL UNSAFE;
+
+CREATE FUNCTION neon_bench_prefetch(relname text, nblocks int4,
+    OUT blocks int8, OUT total_us int8, OUT avg_us float8, OUT mb_per_sec float8)
+RETURNS record
+AS 'MODULE_PATHNAME', 'neon_bench_prefetch'
+LANGUAGE C STRICT
+PARALLEL UNSAFE;
+
+CREATE FUNCTION neon_bench_relsize(relname text, niter int4,
+    OUT lookups int8, OUT hits int8, OUT total_us int8, OUT ns_per_lookup float8)
+RETURNS record
+AS 'MODULE_PATHNAME', 'neon_bench_relsize'
+LANGUAGE C STRICT
+PARALLEL UNSAFE;
@@ -10,15 +10,19 @@
  */
 #include "postgres.h"
 
+#include "access/htup_details.h"
 #include "access/relation.h"
 #include "access/xact.h"
 #include "access/xlog.h"
 #include "catalog/namespace.h"
+#include "catalog/pg_type.h"
 #include "fmgr.h"
 #include "funcapi.h"
 #include "miscadmin.h"
+#include "portability/instr_time.h"
 #include "storage/buf_internals.h"
 #include "storage/bufmgr.h"
+#include "storage/smgr.h"
 #include "utils/builtins.h"
 #include "utils/pg_lsn.h"
 #include "utils/rel.h"
@@ -34,6 +38,10 @@ PG_FUNCTION_INFO_V1(clear_buffer_cache);
 PG_FUNCTION_INFO_V1(get_raw_page_at_lsn);
 PG_FUNCTION_INFO_V1(get_raw_page_at_lsn_ex);
 PG_FUNCTION_INFO_V1(neon_xlogflush);
+PG_FUNCTION_INFO_V1(neon_bench_getpage);
+PG_FUNCTION_INFO_V1(neon_bench_lfc);
+PG_FUNCTION_INFO_V1(neon_bench_prefetch);
+PG_FUNCTION_INFO_V1(neon_bench_relsize);
 
 /*
  * Linkage to functions in neon module.
@@ -44,6 +52,19 @@ typedef void (*neon_read_at_lsn_type) (RelFileNode rnode, ForkNumber forkNum, Bl
 
 static neon_read_at_lsn_type neon_read_at_lsn_ptr;
 
+typedef void (*lfc_write_type) (RelFileNode rnode, ForkNumber forkNum, BlockNumber blkno,
+								char *buffer);
+typedef bool (*lfc_read_type) (RelFileNode rnode, ForkNumber forkNum, BlockNumber blkno,
+							   char *buffer);
+typedef void (*lfc_evict_type) (RelFileNode rnode, ForkNumber forkNum, BlockNumber blkno);
+typedef bool (*get_cached_relsize_type) (RelFileNode rnode, ForkNumber forknum,
+										 BlockNumber *size);
+
+static lfc_write_type lfc_write_ptr;
+static lfc_read_type lfc_read_ptr;
+static lfc_evict_type lfc_evict_ptr;
+static get_cached_relsize_type get_cached_relsize_ptr;
+
 /*
  * Module initialize function: fetch function pointers for cross-module calls.
  */
@@ -55,9 +76,25 @@ _PG_init(void)
 	neon_read_at_lsn_ptr = (neon_read_at_lsn_type)
 		load_external_function("$libdir/neon", "neon_read_at_lsn",
 							   true, NULL);
+	AssertVariableIsOfType(&lfc_write, lfc_write_type);
+	lfc_write_ptr = (lfc_write_type)
+		load_external_function("$libdir/neon", "lfc_write", true, NULL);
+	AssertVariableIsOfType(&lfc_read, lfc_read_type);
+	lfc_read_ptr = (lfc_read_type)
+		load_external_function("$libdir/neon", "lfc_read", true, NULL);
+	AssertVariableIsOfType(&lfc_evict, lfc_evict_type);
+	lfc_evict_ptr = (lfc_evict_type)
+		load_external_function("$libdir/neon", "lfc_evict", true, NULL);
+	AssertVariableIsOfType(&get_cached_relsize, get_cached_relsize_type);
+	get_cached_relsize_ptr = (get_cached_relsize_type)
+		load_external_function("$libdir/neon", "get_cached_relsize", true, NULL);
 }
 
 #define neon_read_at_lsn neon_read_at_lsn_ptr
+#define lfc_write lfc_write_ptr
+#define lfc_read lfc_read_ptr
+#define lfc_evict lfc_evict_ptr
+#define get_cached_relsize get_cached_relsize_ptr
 
 /*
  * test_consume_xids(int4), for rapidly consuming XIDs, to test wraparound.
@@ -300,3 +337,365 @@ neon_xlogflush(PG_FUNCTION_ARGS)
 	XLogFlush(lsn);
 	PG_RETURN_VOID();
 }
+
+/*
+ * Storage microbenchmarks. They measure the storage path from inside the
+ * compute - getpage round trips, local file cache bandwidth, the prefetch
+ * pipeline and relsize cache lookups - so that a new compute image can be
+ * regression-tested in minutes without replaying production traffic.
+ */
+
+/*
+ * Open a permanent relation for benchmarking. The benchmarks read pages
+ * bypassing the buffer cache, which only gives meaningful (and safe) results
+ * for relations stored on the pageserver.
+ */
+static Relation
+bench_open_relation(text *relname)
+{
+	RangeVar   *relrv;
+	Relation	rel;
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must be superuser to use benchmark functions")));
+
+	relrv = makeRangeVarFromNameList(textToQualifiedNameList(relname));
+	rel = relation_openrv(relrv, AccessShareLock);
+
+	if (rel->rd_rel->relkind != RELKIND_RELATION &&
+		rel->rd_rel->relkind != RELKIND_INDEX &&
+		rel->rd_rel->relkind != RELKIND_TOASTVALUE &&
+		rel->rd_rel->relkind != RELKIND_MATVIEW)
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("relation \"%s\" has no storage",
+						RelationGetRelationName(rel))));
+	if (rel->rd_rel->relpersistence != RELPERSISTENCE_PERMANENT)
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("relation \"%s\" is not stored on the pageserver",
+						RelationGetRelationName(rel))));
+	return rel;
+}
+
+/* xorshift64: cheap deterministic block number sequence for random patterns */
+static uint64
+bench_next_random(uint64 *state)
+{
+	uint64		x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+	return x;
+}
+
+static int
+bench_latency_cmp(const void *a, const void *b)
+{
+	uint64		la = *(const uint64 *) a;
+	uint64		lb = *(const uint64 *) b;
+
+	return la < lb ? -1 : la > lb ? 1 : 0;
+}
+
+static uint64
+bench_percentile(uint64 *sorted, int n, int percent)
+{
+	return sorted[Min((n * percent) / 100, n - 1)];
+}
+
+/*
+ * neon_bench_getpage(relname, nreads, sequential)
+ *
+ * Measures getpage round-trip latency by reading pages of the relation with
+ * neon_read_at_lsn(), which goes to the pageserver bypassing both the buffer
+ * cache and the local file cache. Reads follow a sequential or a (seeded,
+ * reproducible) random block pattern and the per-read latencies are reported
+ * as a distribution.
+ */
+Datum
+neon_bench_getpage(PG_FUNCTION_ARGS)
+{
+	text	   *relname = PG_GETARG_TEXT_PP(0);
+	int32		nreads = PG_GETARG_INT32(1);
+	bool		sequential = PG_GETARG_BOOL(2);
+	Relation	rel;
+	BlockNumber relsize;
+	char	   *buffer;
+	uint64	   *latencies;
+	uint64		total_us = 0;
+	uint64		rstate = 0x5851f42d4c957f2d;
+	TupleDesc	tupdesc;
+	Datum		values[6];
+	bool		nulls[6];
+
+	if (nreads <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("number of reads must be positive")));
+
+	rel = bench_open_relation(relname);
+	relsize = RelationGetNumberOfBlocks(rel);
+	if (relsize == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("relation \"%s\" has no blocks",
+						RelationGetRelationName(rel))));
+
+	buffer = palloc(BLCKSZ);
+	latencies = palloc(sizeof(uint64) * nreads);
+
+	for (int i = 0; i < nreads; i++)
+	{
+		BlockNumber blkno = sequential
+			? i % relsize
+			: bench_next_random(&rstate) % relsize;
+		XLogRecPtr	request_lsn = GetXLogInsertRecPtr();
+		instr_time	start,
+					duration;
+
+		CHECK_FOR_INTERRUPTS();
+		INSTR_TIME_SET_CURRENT(start);
+		neon_read_at_lsn(rel->rd_node, MAIN_FORKNUM, blkno, request_lsn, true, buffer);
+		INSTR_TIME_SET_CURRENT(duration);
+		INSTR_TIME_SUBTRACT(duration, start);
+		latencies[i] = INSTR_TIME_GET_MICROSEC(duration);
+		total_us += latencies[i];
+	}
+	relation_close(rel, AccessShareLock);
+
+	qsort(latencies, nreads, sizeof(uint64), bench_latency_cmp);
+
+	tupdesc = CreateTemplateTupleDesc(6);
+	TupleDescInitEntry(tupdesc, (AttrNumber) 1, "reads", INT8OID, -1, 0);
+	TupleDescInitEntry(tupdesc, (AttrNumber) 2, "total_us", INT8OID, -1, 0);
+	TupleDescInitEntry(tupdesc, (AttrNumber) 3, "min_us", INT8OID, -1, 0);
+	TupleDescInitEntry(tupdesc, (AttrNumber) 4, "p50_us", INT8OID, -1, 0);
+	TupleDescInitEntry(tupdesc, (AttrNumber) 5, "p99_us", INT8OID, -1, 0);
+	TupleDescInitEntry(tupdesc, (AttrNumber) 6, "max_us", INT8OID, -1, 0);
+	tupdesc = BlessTupleDesc(tupdesc);
+
+	MemSet(nulls, 0, sizeof(nulls));
+	values[0] = Int64GetDatum((int64) nreads);
+	values[1] = Int64GetDatum((int64) total_us);
+	values[2] = Int64GetDatum((int64) latencies[0]);
+	values[3] = Int64GetDatum((int64) bench_percentile(latencies, nreads, 50));
+	values[4] = Int64GetDatum((int64) bench_percentile(latencies, nreads, 99));
+	values[5] = Int64GetDatum((int64) latencies[nreads - 1]);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * neon_bench_lfc(nblocks)
+ *
+ * Measures local file cache bandwidth: writes nblocks pages through
+ * lfc_write(), reads them back through lfc_read() and reports both rates.
+ * The pages are written under a synthetic relfilenode (InvalidOid) that can
+ * not collide with a real relation and are evicted again afterwards, so the
+ * cache contents are not perturbed beyond temporary space usage. With
+ * asynchronous file cache writes enabled some reads may miss blocks that are
+ * still in the staging buffers; the hit count makes that visible.
+ */
+Datum
+neon_bench_lfc(PG_FUNCTION_ARGS)
+{
+	int32		nblocks = PG_GETARG_INT32(0);
+	RelFileNode rnode = {InvalidOid, InvalidOid, InvalidOid};
+	char	   *buffer;
+	uint64		write_us,
+				read_us;
+	int64		read_hits = 0;
+	instr_time	start,
+				duration;
+	TupleDesc	tupdesc;
+	Datum		values[5];
+	bool		nulls[5];
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must be superuser to use benchmark functions")));
+	if (nblocks <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("number of blocks must be positive")));
+
+	buffer = palloc(BLCKSZ);
+	memset(buffer, 0x5a, BLCKSZ);
+
+	INSTR_TIME_SET_CURRENT(start);
+	for (int i = 0; i < nblocks; i++)
+	{
+		CHECK_FOR_INTERRUPTS();
+		lfc_write(rnode, MAIN_FORKNUM, i, buffer);
+	}
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+	write_us = INSTR_TIME_GET_MICROSEC(duration);
+
+	INSTR_TIME_SET_CURRENT(start);
+	for (int i = 0; i < nblocks; i++)
+	{
+		CHECK_FOR_INTERRUPTS();
+		if (lfc_read(rnode, MAIN_FORKNUM, i, buffer))
+			read_hits++;
+	}
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+	read_us = INSTR_TIME_GET_MICROSEC(duration);
+
+	for (int i = 0; i < nblocks; i++)
+		lfc_evict(rnode, MAIN_FORKNUM, i);
+
+	tupdesc = CreateTemplateTupleDesc(5);
+	TupleDescInitEntry(tupdesc, (AttrNumber) 1, "blocks", INT8OID, -1, 0);
+	TupleDescInitEntry(tupdesc, (AttrNumber) 2, "write_us", INT8OID, -1, 0);
+	TupleDescInitEntry(tupdesc, (AttrNumber) 3, "write_mb_per_sec", FLOAT8OID, -1, 0);
+	TupleDescInitEntry(tupdesc, (AttrNumber) 4, "read_us", INT8OID, -1, 0);
+	TupleDescInitEntry(tupdesc, (AttrNumber) 5, "read_hits", INT8OID, -1, 0);
+	tupdesc = BlessTupleDesc(tupdesc);
+
+	MemSet(nulls, 0, sizeof(nulls));
+	values[0] = Int64GetDatum((int64) nblocks);
+	values[1] = Int64GetDatum((int64) write_us);
+	values[2] = Float8GetDatum(write_us > 0
+							   ? ((double) nblocks * BLCKSZ) / write_us
+							   : 0.0);
+	values[3] = Int64GetDatum((int64) read_us);
+	values[4] = Int64GetDatum(read_hits);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * neon_bench_prefetch(relname, nblocks)
+ *
+ * Measures prefetch-pipeline effectiveness: reads the relation sequentially
+ * through smgrread(), which drives the readahead machinery exactly as a
+ * sequential scan would, bypassing the buffer cache. Run it with different
+ * settings of neon.readahead_getpage_batch_size and compare the bandwidth;
+ * the prefetch hit and waste counters in pg_stat_neon show how much of the
+ * pipeline was actually used. nblocks <= 0 reads the whole relation.
+ */
+Datum
+neon_bench_prefetch(PG_FUNCTION_ARGS)
+{
+	text	   *relname = PG_GETARG_TEXT_PP(0);
+	int32		nblocks = PG_GETARG_INT32(1);
+	Relation	rel;
+	SMgrRelation smgr;
+	BlockNumber relsize;
+	BlockNumber n;
+	char	   *buffer;
+	uint64		total_us;
+	instr_time	start,
+				duration;
+	TupleDesc	tupdesc;
+	Datum		values[4];
+	bool		nulls[4];
+
+	rel = bench_open_relation(relname);
+	relsize = RelationGetNumberOfBlocks(rel);
+	if (relsize == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("relation \"%s\" has no blocks",
+						RelationGetRelationName(rel))));
+	n = nblocks > 0 ? Min((BlockNumber) nblocks, relsize) : relsize;
+
+	smgr = smgropen(rel->rd_node, InvalidBackendId, RELPERSISTENCE_PERMANENT);
+	buffer = palloc(BLCKSZ);
+
+	INSTR_TIME_SET_CURRENT(start);
+	for (BlockNumber blkno = 0; blkno < n; blkno++)
+	{
+		CHECK_FOR_INTERRUPTS();
+		smgrread(smgr, MAIN_FORKNUM, blkno, buffer);
+	}
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+	total_us = INSTR_TIME_GET_MICROSEC(duration);
+
+	relation_close(rel, AccessShareLock);
+
+	tupdesc = CreateTemplateTupleDesc(4);
+	TupleDescInitEntry(tupdesc, (AttrNumber) 1, "blocks", INT8OID, -1, 0);
+	TupleDescInitEntry(tupdesc, (AttrNumber) 2, "total_us", INT8OID, -1, 0);
+	TupleDescInitEntry(tupdesc, (AttrNumber) 3, "avg_us", FLOAT8OID, -1, 0);
+	TupleDescInitEntry(tupdesc, (AttrNumber) 4, "mb_per_sec", FLOAT8OID, -1, 0);
+	tupdesc = BlessTupleDesc(tupdesc);
+
+	MemSet(nulls, 0, sizeof(nulls));
+	values[0] = Int64GetDatum((int64) n);
+	values[1] = Int64GetDatum((int64) total_us);
+	values[2] = Float8GetDatum((double) total_us / n);
+	values[3] = Float8GetDatum(total_us > 0
+							   ? ((double) n * BLCKSZ) / total_us
+							   : 0.0);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * neon_bench_relsize(relname, niter)
+ *
+ * Measures relsize cache lookup throughput: repeats get_cached_relsize() for
+ * the relation's main fork. The preceding RelationGetNumberOfBlocks() call
+ * primes the cache, so on a healthy compute every lookup is a hit.
+ */
+Datum
+neon_bench_relsize(PG_FUNCTION_ARGS)
+{
+	text	   *relname = PG_GETARG_TEXT_PP(0);
+	int32		niter = PG_GETARG_INT32(1);
+	Relation	rel;
+	BlockNumber size;
+	int64		hits = 0;
+	uint64		total_us;
+	instr_time	start,
+				duration;
+	TupleDesc	tupdesc;
+	Datum		values[4];
+	bool		nulls[4];
+
+	if (niter <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("number of iterations must be positive")));
+
+	rel = bench_open_relation(relname);
+	(void) RelationGetNumberOfBlocks(rel);
+
+	INSTR_TIME_SET_CURRENT(start);
+	for (int i = 0; i < niter; i++)
+	{
+		CHECK_FOR_INTERRUPTS();
+		if (get_cached_relsize(rel->rd_node, MAIN_FORKNUM, &size))
+			hits++;
+	}
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+	total_us = INSTR_TIME_GET_MICROSEC(duration);
+
+	relation_close(rel, AccessShareLock);
+
+	tupdesc = CreateTemplateTupleDesc(4);
+	TupleDescInitEntry(tupdesc, (AttrNumber) 1, "lookups", INT8OID, -1, 0);
+	TupleDescInitEntry(tupdesc, (AttrNumber) 2, "hits", INT8OID, -1, 0);
+	TupleDescInitEntry(tupdesc, (AttrNumber) 3, "total_us", INT8OID, -1, 0);
+	TupleDescInitEntry(tupdesc, (AttrNumber) 4, "ns_per_lookup", FLOAT8OID, -1, 0);
+	tupdesc = BlessTupleDesc(tupdesc);
+
+	MemSet(nulls, 0, sizeof(nulls));
+	values[0] = Int64GetDatum((int64) niter);
+	values[1] = Int64GetDatum(hits);
+	values[2] = Int64GetDatum((int64) total_us);
+	values[3] = Float8GetDatum((double) total_us * 1000.0 / niter);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
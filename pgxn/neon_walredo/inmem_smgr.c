@@ -4,7 +4,7 @@
  *
  * This is an implementation of the SMGR interface, used in the WAL redo
  * process. It has no persistent storage, the pages that are written out
- * are kept in a small number of in-memory buffers.
+ * are kept in an in-memory arena indexed by a small hash table.
  *
  * Normally, replaying a WAL record only needs to access a handful of
  * buffers, which fit in the normal buffer cache, so this is just for
@@ -19,10 +19,12 @@
 #include "postgres.h"
 
 #include "access/xlog.h"
+#include "common/hashfn.h"
 #include "storage/block.h"
 #include "storage/buf_internals.h"
 #include "storage/relfilenode.h"
 #include "storage/smgr.h"
+#include "utils/memutils.h"
 
 #if PG_VERSION_NUM >= 150000
 #include "access/xlogutils.h"
@@ -30,32 +32,83 @@
 
 #include "inmem_smgr.h"
 
-/* Size of the in-memory smgr */
-#define MAX_PAGES 64
+/* Initial size of the in-memory smgr; the arena doubles up to MAX_PAGES */
+#define INIT_PAGES 64
+#define MAX_PAGES 1024
 
 /* If more than WARN_PAGES are used, print a warning in the log */
 #define WARN_PAGES 32
 
-static BufferTag page_tag[MAX_PAGES];
-static char page_body[MAX_PAGES][BLCKSZ];
+static BufferTag *page_tag;
+static char *page_body;
+static int	arena_pages;		/* allocated capacity of the arena */
 static int	used_pages;
 
+/*
+ * Open-addressing hash over the used pages, so that locating a page is O(1)
+ * instead of a linear scan over the arena on every read and write. A slot
+ * holds the page index + 1, zero meaning empty. The table is sized at twice
+ * the arena capacity (a power of two), which keeps linear probing chains
+ * short. Pages are never removed individually, only by resetting the whole
+ * store in inmem_init(), so there is no need for tombstones.
+ */
+static uint32 *hash_slots;
+static uint32 hash_size;
+
+static uint32
+page_hash(BufferTag const *tag)
+{
+	return hash_bytes((unsigned char *) tag, sizeof(BufferTag));
+}
+
 static int
 locate_page(SMgrRelation reln, ForkNumber forknum, BlockNumber blkno)
 {
-	/* We only hold a small number of pages, so linear search */
-	for (int i = 0; i < used_pages; i++)
+	BufferTag	tag;
+	uint32		pos;
+
+	if (used_pages == 0)
+		return -1;
+
+	INIT_BUFFERTAG(tag, reln->smgr_rnode.node, forknum, blkno);
+	pos = page_hash(&tag) & (hash_size - 1);
+	while (hash_slots[pos] != 0)
 	{
-		if (RelFileNodeEquals(reln->smgr_rnode.node, page_tag[i].rnode)
-			&& forknum == page_tag[i].forkNum
-			&& blkno == page_tag[i].blockNum)
-		{
-			return i;
-		}
+		int			pg = hash_slots[pos] - 1;
+
+		if (BUFFERTAGS_EQUAL(page_tag[pg], tag))
+			return pg;
+		pos = (pos + 1) & (hash_size - 1);
 	}
 	return -1;
 }
 
+/* Enter an already-tagged page into the hash */
+static void
+hash_insert_page(int pg)
+{
+	uint32		pos = page_hash(&page_tag[pg]) & (hash_size - 1);
+
+	while (hash_slots[pos] != 0)
+		pos = (pos + 1) & (hash_size - 1);
+	hash_slots[pos] = pg + 1;
+}
+
+/* Double the arena and rebuild the hash to match the new capacity */
+static void
+grow_arena(void)
+{
+	arena_pages *= 2;
+	hash_size = arena_pages * 2;
+	page_tag = repalloc(page_tag, sizeof(BufferTag) * arena_pages);
+	page_body = repalloc(page_body, (Size) BLCKSZ * arena_pages);
+	pfree(hash_slots);
+	hash_slots = MemoryContextAllocZero(TopMemoryContext,
+										sizeof(uint32) * hash_size);
+	for (int i = 0; i < used_pages; i++)
+		hash_insert_page(i);
+}
+
 
 /* neon wal-redo storage manager functionality */
 static void inmem_init(void);
@@ -86,6 +139,19 @@ static void inmem_immedsync(SMgrRelation reln, ForkNumber forknum);
 static void
 inmem_init(void)
 {
+	if (page_tag == NULL)
+	{
+		arena_pages = INIT_PAGES;
+		hash_size = arena_pages * 2;
+		page_tag = MemoryContextAlloc(TopMemoryContext,
+									  sizeof(BufferTag) * arena_pages);
+		page_body = MemoryContextAlloc(TopMemoryContext,
+									   (Size) BLCKSZ * arena_pages);
+		hash_slots = MemoryContextAllocZero(TopMemoryContext,
+											sizeof(uint32) * hash_size);
+	}
+	else
+		memset(hash_slots, 0, sizeof(uint32) * hash_size);
 	used_pages = 0;
 }
 
@@ -188,7 +254,7 @@ inmem_read(SMgrRelation reln, ForkNumber forknum, BlockNumber blkno,
 	if (pg < 0)
 		memset(buffer, 0, BLCKSZ);
 	else
-		memcpy(buffer, page_body[pg], BLCKSZ);
+		memcpy(buffer, page_body + (Size) pg * BLCKSZ, BLCKSZ);
 }
 
 /*
@@ -222,12 +288,17 @@ inmem_write(SMgrRelation reln, ForkNumber forknum, BlockNumber blocknum,
 			 forknum,
 			 blocknum,
 			 used_pages);
-		if (used_pages == MAX_PAGES)
-			elog(ERROR, "Inmem storage overflow");
+		if (used_pages == arena_pages)
+		{
+			if (arena_pages >= MAX_PAGES)
+				elog(ERROR, "Inmem storage overflow");
+			grow_arena();
+		}
 
 		pg = used_pages;
 		used_pages++;
 		INIT_BUFFERTAG(page_tag[pg], reln->smgr_rnode.node, forknum, blocknum);
+		hash_insert_page(pg);
 	}
 	else
 	{
@@ -239,7 +310,7 @@ inmem_write(SMgrRelation reln, ForkNumber forknum, BlockNumber blocknum,
 			 blocknum,
 			 used_pages);
 	}
-	memcpy(page_body[pg], buffer, BLCKSZ);
+	memcpy(page_body + (Size) pg * BLCKSZ, buffer, BLCKSZ);
 }
 
 /*
@@ -18,15 +18,25 @@
  *                // 'msgtype', in network byte order
  * <payload>
  *
- * There are three message types:
+ * There are five message types:
  *
  * BeginRedoForBlock ('B'): Prepare for WAL replay for given block
  * PushPage ('P'): Copy a page image (in the payload) to buffer cache
  * ApplyRecord ('A'): Apply a WAL record (in the payload)
  * GetPage ('G'): Return a page image from buffer cache.
+ * ApplyBatch ('R'): Carry a whole redo request - block, optional base
+ *                   image, any number of WAL records and the implied
+ *                   GetPage - in a single message.
  *
- * Currently, you only get a response to GetPage requests; the response is
- * simply a 8k page, without any headers. Errors are logged to stderr.
+ * Currently, you only get a response to GetPage and ApplyBatch requests;
+ * the response is simply a 8k page, without any headers. Errors are logged
+ * to stderr.
+ *
+ * With --fork-server, the process instead acts as a template: it performs
+ * the expensive startup once and then forks one worker per 'F' request
+ * received on stdin (a unix domain socket), passing the worker's stdin,
+ * stdout and stderr via SCM_RIGHTS. Each worker serves the protocol above.
+ * See WalRedoForkServer().
  *
  * FIXME:
  * - this currently requires a valid PGDATA, and creates a lock file there
@@ -48,6 +58,8 @@
 #include <signal.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #ifdef HAVE_SYS_SELECT_H
 #include <sys/select.h>
 #endif
@@ -121,13 +133,19 @@ PG_MODULE_MAGIC;
 
 static int	ReadRedoCommand(StringInfo inBuf);
 static void BeginRedoForBlock(StringInfo input_message);
+static void BeginRedoForBlockInternal(RelFileNode rnode, ForkNumber forknum, BlockNumber blknum);
 static void PushPage(StringInfo input_message);
+static void PushPageInternal(RelFileNode rnode, ForkNumber forknum, BlockNumber blknum, const char *content);
 static void ApplyRecord(StringInfo input_message);
+static void ApplyRecordInternal(XLogRecord *record, XLogRecPtr lsn, int total_len);
+static void ApplyBatch(StringInfo input_message);
 static void apply_error_callback(void *arg);
 static bool redo_block_filter(XLogReaderState *record, uint8 block_id);
 static void GetPage(StringInfo input_message);
+static void GetPageInternal(RelFileNode rnode, ForkNumber forknum, BlockNumber blknum);
 static ssize_t buffered_read(void *buf, size_t count);
 static void CreateFakeSharedMemoryAndSemaphores();
+static void WalRedoForkServer(void);
 
 static BufferTag target_redo_tag;
 
@@ -192,6 +210,7 @@ WalRedoMain(int argc, char *argv[])
 {
 	int			firstchar;
 	StringInfoData input_message;
+	bool		fork_server = false;
 #ifdef HAVE_LIBSECCOMP
 	bool		enable_seccomp;
 #endif
@@ -279,6 +298,20 @@ WalRedoMain(int argc, char *argv[])
 	}
 	reader_state = XLogReaderAllocate(wal_segment_size, NULL, XL_ROUTINE(), NULL);
 
+	/*
+	 * In fork-server mode all the expensive initialization above is done just
+	 * once, in the template process. WalRedoForkServer() loops forking one
+	 * worker per request and returns only in the worker, with stdin, stdout
+	 * and stderr replaced by the pipes passed in the request. The worker then
+	 * enters seccomp and serves the normal redo loop below; the template
+	 * itself never does.
+	 */
+	for (int i = 1; i < argc; i++)
+		if (strcmp(argv[i], "--fork-server") == 0)
+			fork_server = true;
+	if (fork_server)
+		WalRedoForkServer();
+
 #ifdef HAVE_LIBSECCOMP
 	/* We prefer opt-out to opt-in for greater security */
 	enable_seccomp = true;
@@ -330,6 +363,10 @@ WalRedoMain(int argc, char *argv[])
 				GetPage(&input_message);
 				break;
 
+			case 'R':			/* ApplyBatch */
+				ApplyBatch(&input_message);
+				break;
+
 				/*
 				 * EOF means we're done. Perform normal shutdown.
 				 */
@@ -366,6 +403,129 @@ WalRedoMain(int argc, char *argv[])
 }
 
 
+/*
+ * Fork-server ("template") mode: the caller starts one fully initialized redo
+ * process per postgres version with --fork-server and stdin connected to a
+ * unix domain socket. Each 'F' control message carries three file descriptors
+ * (SCM_RIGHTS): the worker's stdin, stdout and stderr. We fork a worker that
+ * installs them as fds 0-2 and returns to serve the normal redo loop with all
+ * the startup work already done, cutting worker spawn time from a full
+ * single-user bootstrap to a plain fork(). The worker's pid is written back
+ * to the socket (as a network-order uint32) so that the caller can kill the
+ * worker if it hangs; workers that have exited are reaped here between
+ * requests.
+ */
+static void
+WalRedoForkServer(void)
+{
+	for (;;)
+	{
+		char		cmd;
+		int			fds[3];
+		struct msghdr msg;
+		struct iovec iov;
+		union
+		{
+			struct cmsghdr hdr;
+			char		buf[CMSG_SPACE(sizeof(int) * 3)];
+		}			cmsgbuf;
+		struct cmsghdr *cmsg;
+		ssize_t		rc;
+		pid_t		pid;
+
+		/* Reap workers that have exited since the last request */
+		while (waitpid(-1, NULL, WNOHANG) > 0)
+			;
+
+		memset(&msg, 0, sizeof(msg));
+		iov.iov_base = &cmd;
+		iov.iov_len = 1;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cmsgbuf.buf;
+		msg.msg_controllen = sizeof(cmsgbuf.buf);
+
+		rc = recvmsg(STDIN_FILENO, &msg, 0);
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			ereport(FATAL,
+					(errcode(ERRCODE_CONNECTION_FAILURE),
+					 errmsg("could not read from fork-server socket: %m")));
+		}
+		if (rc == 0)
+		{
+			/* Caller went away. Perform normal shutdown. */
+			ereport(LOG,
+					(errmsg("received EOF on fork-server socket, shutting down")));
+			proc_exit(0);
+		}
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		if (cmd != 'F' || cmsg == NULL ||
+			cmsg->cmsg_level != SOL_SOCKET ||
+			cmsg->cmsg_type != SCM_RIGHTS ||
+			cmsg->cmsg_len != CMSG_LEN(sizeof(int) * 3))
+			ereport(FATAL,
+					(errcode(ERRCODE_PROTOCOL_VIOLATION),
+					 errmsg("invalid fork-server request")));
+		memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+		/* Don't let the worker inherit and replay buffered output */
+		fflush(NULL);
+
+		pid = fork();
+		if (pid == 0)
+		{
+			/* Worker: become an ordinary redo process on the passed pipes */
+			if (dup2(fds[0], STDIN_FILENO) < 0 ||
+				dup2(fds[1], STDOUT_FILENO) < 0 ||
+				dup2(fds[2], STDERR_FILENO) < 0)
+				ereport(FATAL,
+						(errcode_for_file_access(),
+						 errmsg("could not install WAL redo worker pipes: %m")));
+			close(fds[0]);
+			close(fds[1]);
+			close(fds[2]);
+
+			/* New pid, new start time, new random seeds */
+			InitProcessGlobals();
+			return;
+		}
+		if (pid < 0)
+			ereport(FATAL,
+					(errcode(ERRCODE_INTERNAL_ERROR),
+					 errmsg("could not fork WAL redo worker: %m")));
+
+		close(fds[0]);
+		close(fds[1]);
+		close(fds[2]);
+
+		/* Tell the caller which pid serves its pipes */
+		{
+			uint32		npid = pg_hton32((uint32) pid);
+			char	   *p = (char *) &npid;
+			size_t		left = sizeof(npid);
+
+			while (left > 0)
+			{
+				rc = write(STDIN_FILENO, p, left);
+				if (rc < 0)
+				{
+					if (errno == EINTR)
+						continue;
+					ereport(FATAL,
+							(errcode(ERRCODE_CONNECTION_FAILURE),
+							 errmsg("could not write to fork-server socket: %m")));
+				}
+				p += rc;
+				left -= rc;
+			}
+		}
+	}
+}
+
 /*
  * Initialize dummy shmem.
  *
@@ -650,7 +810,6 @@ BeginRedoForBlock(StringInfo input_message)
 	RelFileNode rnode;
 	ForkNumber forknum;
 	BlockNumber blknum;
-	SMgrRelation reln;
 
 	/*
 	 * message format:
@@ -666,6 +825,15 @@ BeginRedoForBlock(StringInfo input_message)
 	rnode.dbNode = pq_getmsgint(input_message, 4);
 	rnode.relNode = pq_getmsgint(input_message, 4);
 	blknum = pq_getmsgint(input_message, 4);
+
+	BeginRedoForBlockInternal(rnode, forknum, blknum);
+}
+
+static void
+BeginRedoForBlockInternal(RelFileNode rnode, ForkNumber forknum, BlockNumber blknum)
+{
+	SMgrRelation reln;
+
 	wal_redo_buffer = InvalidBuffer;
 
 	INIT_BUFFERTAG(target_redo_tag, rnode, forknum, blknum);
@@ -695,8 +863,6 @@ PushPage(StringInfo input_message)
 	ForkNumber forknum;
 	BlockNumber blknum;
 	const char *content;
-	Buffer		buf;
-	Page		page;
 
 	/*
 	 * message format:
@@ -715,6 +881,15 @@ PushPage(StringInfo input_message)
 	blknum = pq_getmsgint(input_message, 4);
 	content = pq_getmsgbytes(input_message, BLCKSZ);
 
+	PushPageInternal(rnode, forknum, blknum, content);
+}
+
+static void
+PushPageInternal(RelFileNode rnode, ForkNumber forknum, BlockNumber blknum, const char *content)
+{
+	Buffer		buf;
+	Page		page;
+
 	buf = NeonRedoReadBuffer(rnode, forknum, blknum, RBM_ZERO_AND_LOCK);
 	wal_redo_buffer = buf;
 	page = BufferGetPage(buf);
@@ -731,14 +906,9 @@ PushPage(StringInfo input_message)
 static void
 ApplyRecord(StringInfo input_message)
 {
-	char	   *errormsg;
 	XLogRecPtr	lsn;
 	XLogRecord *record;
 	int			nleft;
-	ErrorContextCallback errcallback;
-#if PG_VERSION_NUM >= 150000
-	DecodedXLogRecord *decoded;
-#endif
 
 	/*
 	 * message format:
@@ -748,15 +918,32 @@ ApplyRecord(StringInfo input_message)
 	 */
 	lsn = pq_getmsgint64(input_message);
 
-	smgrinit();					/* reset inmem smgr state */
-
 	/* note: the input must be aligned here */
 	record = (XLogRecord *) pq_getmsgbytes(input_message, sizeof(XLogRecord));
 
 	nleft = input_message->len - input_message->cursor;
-	if (record->xl_tot_len != sizeof(XLogRecord) + nleft)
+
+	ApplyRecordInternal(record, lsn, sizeof(XLogRecord) + nleft);
+}
+
+/*
+ * Apply one record. 'record' points to 'total_len' contiguous, aligned bytes
+ * of it, and 'lsn' is the record's end LSN.
+ */
+static void
+ApplyRecordInternal(XLogRecord *record, XLogRecPtr lsn, int total_len)
+{
+	char	   *errormsg;
+	ErrorContextCallback errcallback;
+#if PG_VERSION_NUM >= 150000
+	DecodedXLogRecord *decoded;
+#endif
+
+	smgrinit();					/* reset inmem smgr state */
+
+	if (record->xl_tot_len != total_len)
 		elog(ERROR, "mismatch between record (%d) and message size (%d)",
-			 record->xl_tot_len, (int) sizeof(XLogRecord) + nleft);
+			 record->xl_tot_len, total_len);
 
 	/* Setup error traceback support for ereport() */
 	errcallback.callback = apply_error_callback;
@@ -852,6 +1039,73 @@ ApplyRecord(StringInfo input_message)
 #endif
 }
 
+/*
+ * Handle a whole redo request in one message: prepare for replay of a block,
+ * install the optional base image, apply any number of records and send the
+ * resulting page back. This is equivalent to a BeginRedoForBlock / PushPage /
+ * ApplyRecord* / GetPage sequence, but the loop over a long record chain runs
+ * without per-record message framing.
+ */
+static void
+ApplyBatch(StringInfo input_message)
+{
+	RelFileNode rnode;
+	ForkNumber	forknum;
+	BlockNumber blknum;
+	bool		has_base_img;
+	uint32		n_records;
+
+	/*
+	 * message format:
+	 *
+	 * spcNode
+	 * dbNode
+	 * relNode
+	 * ForkNumber
+	 * BlockNumber
+	 * has_base_img
+	 * number of records
+	 * 8k page content, if has_base_img
+	 * for each record: record length, LSN (the *end* of the record), record
+	 *
+	 * Each per-record entry is preceded by padding to an 8-byte boundary
+	 * (relative to the start of the payload) and lays the record out 16 bytes
+	 * into the entry, so records can be applied in place like with
+	 * ApplyRecord.
+	 */
+	forknum = pq_getmsgbyte(input_message);
+	rnode.spcNode = pq_getmsgint(input_message, 4);
+	rnode.dbNode = pq_getmsgint(input_message, 4);
+	rnode.relNode = pq_getmsgint(input_message, 4);
+	blknum = pq_getmsgint(input_message, 4);
+	has_base_img = pq_getmsgbyte(input_message) != 0;
+	n_records = pq_getmsgint(input_message, 4);
+
+	BeginRedoForBlockInternal(rnode, forknum, blknum);
+
+	if (has_base_img)
+		PushPageInternal(rnode, forknum, blknum,
+						 pq_getmsgbytes(input_message, BLCKSZ));
+
+	for (uint32 i = 0; i < n_records; i++)
+	{
+		uint32		rec_len;
+		XLogRecPtr	lsn;
+		XLogRecord *record;
+
+		input_message->cursor = TYPEALIGN(8, input_message->cursor);
+		rec_len = pq_getmsgint(input_message, 4);
+		(void) pq_getmsgint(input_message, 4);	/* padding */
+		lsn = pq_getmsgint64(input_message);
+		record = (XLogRecord *) pq_getmsgbytes(input_message, rec_len);
+		Assert(record == (XLogRecord *) TYPEALIGN(8, record));
+
+		ApplyRecordInternal(record, lsn, rec_len);
+	}
+
+	GetPageInternal(rnode, forknum, blknum);
+}
+
 /*
  * Error context callback for errors occurring during ApplyRecord
  */
@@ -917,9 +1171,6 @@ GetPage(StringInfo input_message)
 	RelFileNode rnode;
 	ForkNumber forknum;
 	BlockNumber blknum;
-	Buffer		buf;
-	Page		page;
-	int			tot_written;
 
 	/*
 	 * message format:
@@ -936,6 +1187,16 @@ GetPage(StringInfo input_message)
 	rnode.relNode = pq_getmsgint(input_message, 4);
 	blknum = pq_getmsgint(input_message, 4);
 
+	GetPageInternal(rnode, forknum, blknum);
+}
+
+static void
+GetPageInternal(RelFileNode rnode, ForkNumber forknum, BlockNumber blknum)
+{
+	Buffer		buf;
+	Page		page;
+	int			tot_written;
+
 	/* FIXME: check that we got a BeginRedoForBlock message or this earlier */
 
 	buf = NeonRedoReadBuffer(rnode, forknum, blknum, RBM_NORMAL);
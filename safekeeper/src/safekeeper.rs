@@ -32,6 +32,11 @@ pub const SK_FORMAT_VERSION: u32 = 7;
 const SK_PROTOCOL_VERSION: u32 = 2;
 pub const UNKNOWN_SERVER_VERSION: u32 = 0;
 
+/// Codecs for AppendRequest WAL payloads, negotiated during the greeting
+/// exchange. Values match WP_COMPRESSION_* in walproposer.h.
+pub const COMPRESSION_NONE: u32 = 0;
+pub const COMPRESSION_ZLIB: u32 = 1;
+
 /// Consensus logical timestamp.
 pub type Term = u64;
 const INVALID_TERM: Term = 0;
@@ -281,6 +286,11 @@ pub struct ProposerGreeting {
     pub tenant_id: TenantId,
     pub tli: TimeLineID,
     pub wal_seg_size: u32,
+    /// Codec the proposer offers for AppendRequest WAL payloads
+    /// (COMPRESSION_*). Trails the fixed struct on the wire and is absent in
+    /// greetings from older walproposers, hence not part of deserialization.
+    #[serde(skip)]
+    pub compression: u32,
 }
 
 /// Acceptor -> Proposer initial response: the highest term known to me
@@ -289,6 +299,10 @@ pub struct ProposerGreeting {
 pub struct AcceptorGreeting {
     term: u64,
     node_id: NodeId,
+    /// Codec chosen for AppendRequest WAL payloads; appended to the wire
+    /// message only when the proposer offered one, as older walproposers
+    /// reject greetings with trailing bytes.
+    compression: Option<u32>,
 }
 
 /// Vote request sent from proposer to safekeepers
@@ -396,7 +410,10 @@ impl ProposerAcceptorMessage {
         let tag = stream.read_u64::<LittleEndian>()? as u8 as char;
         match tag {
             'g' => {
-                let msg = ProposerGreeting::des_from(&mut stream)?;
+                let mut msg = ProposerGreeting::des_from(&mut stream)?;
+                // Compression offer trails the fixed part; default to none
+                // for older walproposers which don't send it.
+                msg.compression = stream.read_u32::<LittleEndian>().unwrap_or(COMPRESSION_NONE);
                 Ok(ProposerAcceptorMessage::Greeting(msg))
             }
             'v' => {
@@ -445,6 +462,39 @@ impl ProposerAcceptorMessage {
 
                 Ok(ProposerAcceptorMessage::AppendRequest(msg))
             }
+            'z' => {
+                // Same as 'a', but the WAL payload is a self-contained zlib
+                // stream; the header is unchanged and end_lsn - begin_lsn
+                // gives the decompressed size.
+                let hdr = AppendRequestHeader::des_from(&mut stream)?;
+                let rec_size = hdr
+                    .end_lsn
+                    .checked_sub(hdr.begin_lsn)
+                    .context("begin_lsn > end_lsn in compressed AppendRequest")?
+                    .0 as usize;
+                if rec_size > MAX_SEND_SIZE {
+                    bail!(
+                        "compressed AppendRequest is longer than MAX_SEND_SIZE ({})",
+                        MAX_SEND_SIZE
+                    );
+                }
+
+                let mut wal_data_vec: Vec<u8> = Vec::with_capacity(rec_size);
+                flate2::read::ZlibDecoder::new(stream)
+                    .read_to_end(&mut wal_data_vec)
+                    .context("decompress AppendRequest WAL payload")?;
+                if wal_data_vec.len() != rec_size {
+                    bail!(
+                        "compressed AppendRequest decompressed to {} bytes, expected {}",
+                        wal_data_vec.len(),
+                        rec_size
+                    );
+                }
+                let wal_data = Bytes::from(wal_data_vec);
+                let msg = AppendRequest { h: hdr, wal_data };
+
+                Ok(ProposerAcceptorMessage::AppendRequest(msg))
+            }
             _ => bail!("unknown proposer-acceptor message tag: {}", tag,),
         }
     }
@@ -466,6 +516,9 @@ impl AcceptorProposerMessage {
                 buf.put_u64_le('g' as u64);
                 buf.put_u64_le(msg.term);
                 buf.put_u64_le(msg.node_id.0);
+                if let Some(alg) = msg.compression {
+                    buf.put_u32_le(alg);
+                }
             }
             AcceptorProposerMessage::VoteResponse(msg) => {
                 buf.put_u64_le('v' as u64);
@@ -662,6 +715,7 @@ where
         Ok(Some(AcceptorProposerMessage::Greeting(AcceptorGreeting {
             term: self.state.acceptor_state.term,
             node_id: self.node_id,
+            compression: (msg.compression == COMPRESSION_ZLIB).then_some(COMPRESSION_ZLIB),
         })))
     }
 